@@ -2,6 +2,9 @@
 #include <sys/param.h>
 #include <time.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/file.h>
 #include <signal.h>
 #include "tra.h"
 
@@ -106,6 +109,95 @@ syscreateexcl(char *name)
 	return fd;
 }
 
+/*
+ * lock all of fd, shared or exclusive, against other opens
+ * of the file, even in this process.  without wait, fail
+ * rather than block.
+ */
+int
+syslock(int fd, int excl, int wait)
+{
+	return flock(fd, (excl ? LOCK_EX : LOCK_SH) | (wait ? 0 : LOCK_NB));
+}
+
+void
+sysunlock(int fd)
+{
+	flock(fd, LOCK_UN);
+}
+
+/*
+ * write the n[i] bytes at a[i], for i<nv, one after another
+ * at off, in as few system calls as we can.  a and n are
+ * overwritten.
+ */
+int
+syspwritev(int fd, void **a, uint *n, int nv, vlong off)
+{
+	int i, k;
+	ssize_t r;
+	struct iovec iov[128];
+
+	i = 0;
+	while(i < nv){
+		for(k=0; k<nelem(iov) && i+k<nv; k++){
+			iov[k].iov_base = a[i+k];
+			iov[k].iov_len = n[i+k];
+		}
+		r = pwritev(fd, iov, k, off);
+		if(r <= 0)
+			return -1;
+		off += r;
+		for(; i<nv && r>=n[i]; i++)
+			r -= n[i];
+		if(r > 0){
+			a[i] = (char*)a[i]+r;
+			n[i] -= r;
+		}
+	}
+	return 0;
+}
+
+/*
+ * map the first size bytes of fd privately: writes
+ * to the mapping are copied and never reach the file.
+ */
+void*
+sysmmap(int fd, uvlong size)
+{
+	void *v;
+
+	v = mmap(nil, size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if(v == MAP_FAILED)
+		return nil;
+	return v;
+}
+
+void
+sysmunmap(void *v, uvlong size)
+{
+	munmap(v, size);
+}
+
+/*
+ * start reading n bytes at off into the buffer cache
+ * without waiting for them.
+ */
+void
+sysprefetch(int fd, vlong off, vlong n)
+{
+	posix_fadvise(fd, off, n, POSIX_FADV_WILLNEED);
+}
+
+int
+sysncpu(void)
+{
+	long n;
+
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? n : 1;
+}
+
 void*
 mksig(struct stat *s, uint *np)
 {
@@ -0,0 +1,1020 @@
+#include "tra.h"
+
+/*
+ * Maintain an on-disk (key, value) mapping in a B+ tree,
+ * for directories too big to keep as a list (list.c).
+ *
+ * The header block is the same size as a list header,
+ * so that an emptied list can be turned into a tree in
+ * place without its parent noticing:
+ *	"BHDR"	(4 bytes)
+ *	ptr-to-root	(s->addrsize bytes)
+ *	page size	(4 bytes)
+ *
+ * Every node is a page-sized block:
+ *	"BLF\0" or "BIN\0"	(4 bytes; leaf or interior)
+ *	ptr-to-next-leaf	(s->addrsize bytes; 0 in interior nodes)
+ *	number of entries (2 bytes)
+ *	<entries>
+ *
+ * Leaf entries are (key, value) pairs laid out as in list.c:
+ *	namelen	(2 bytes)
+ *	name	namelen bytes
+ *	length	(2 bytes)
+ *	data		length bytes
+ *
+ * Interior entries point at the children:
+ *	keylen	(2 bytes)
+ *	key		keylen bytes
+ *	ptr-to-child	(s->addrsize bytes)
+ * The first key is empty; each child holds the keys from
+ * its own key up to the next one.  The leaves are chained
+ * in key order for walks.
+ *
+ * A node that overflows is split in two, and a node that a
+ * deletion leaves less than a quarter full is merged with a
+ * neighbor if the two fit in one node.  No entry may take
+ * more than a third of a node, so both halves of a split fit.
+ * Splits at the outside edge of the tree leave the old node
+ * full, so loading keys in order packs the leaves.
+ */
+
+typedef struct Bent Bent;
+typedef struct Bnode Bnode;
+typedef struct Bpath Bpath;
+typedef struct BTree BTree;
+
+struct Bent
+{
+	Datum key;
+	Datum val;	/* in leaves */
+	uvlong child;	/* in interior nodes */
+	uchar *childp;
+};
+
+struct Bnode
+{
+	DBlock *b;
+	int leaf;
+	uvlong next;
+	int n;
+	Bent *e;
+};
+
+struct Bpath
+{
+	uvlong addr;
+	int i;		/* child we went down */
+	int first;	/* ... was the first */
+	int last;	/* ... was the last */
+};
+
+struct BTree
+{
+	DMap m;
+	u32int magic;
+
+	int pagesize;
+	DStore *s;
+	DBlock *hdr;
+	uchar *rootp;
+};
+
+enum
+{
+	MaxDepth = 32,
+};
+
+#define BHDRSIZE(s)	(4+(s)->addrsize+4)
+#define NODEHDRSIZE(s)	(4+(s)->addrsize+2)
+#define LEAFENTSIZE(k, v)	(2+(k)+2+(v))
+#define INENTSIZE(s, k)	(2+(k)+(s)->addrsize)
+
+static BTree*
+map2tree(DMap *map)
+{
+	BTree *t;
+
+	t = (BTree*)map;
+	if(t->magic != (u32int)map2tree)
+		abort();
+	return t;
+}
+
+static uvlong
+getroot(BTree *t)
+{
+	return getaddr(t->s, t->rootp);
+}
+
+static void
+setroot(BTree *t, uvlong a)
+{
+	putaddr(t->s, t->rootp, a);
+	t->hdr->flags |= DDirty;
+	t->hdr->flush(t->hdr);
+}
+
+static int
+entsize(BTree *t, int leaf, Bent *e)
+{
+	if(leaf)
+		return LEAFENTSIZE(e->key.n, e->val.n);
+	return INENTSIZE(t->s, e->key.n);
+}
+
+static int
+nodesize(BTree *t, int leaf, Bent *e, int n)
+{
+	int i, sz;
+
+	sz = NODEHDRSIZE(t->s);
+	for(i=0; i<n; i++)
+		sz += entsize(t, leaf, &e[i]);
+	return sz;
+}
+
+/*
+ * read and parse the node at addr, leaving
+ * room in the entry array for extra more.
+ */
+static Bnode*
+opennode(BTree *t, uvlong addr, int extra)
+{
+	int i, n;
+	uchar *p, *ep;
+	DBlock *b;
+	DStore *s;
+	Bnode *nd;
+	Bent *e;
+
+	s = t->s;
+	if((b = s->read(s, addr)) == nil){
+		werrstr("could not read btree block %llux: %r", addr);
+		return nil;
+	}
+	if(b->n != t->pagesize){
+		b->close(b);
+		werrstr("bad block size in btree block %llux", addr);
+		return nil;
+	}
+	p = b->a;
+	ep = p+b->n;
+	if(memcmp(p, "BLF", 4) != 0 && memcmp(p, "BIN", 4) != 0){
+		b->close(b);
+		werrstr("bad magic in btree block %llux", addr);
+		return nil;
+	}
+	nd = emalloc(sizeof(Bnode));
+	nd->b = b;
+	nd->leaf = p[1] == 'L';
+	p += 4;
+	nd->next = getaddr(s, p);
+	p += s->addrsize;
+	n = SHORT(p);
+	p += 2;
+	nd->n = n;
+	nd->e = emalloc((n+extra)*sizeof(Bent));
+	for(i=0; i<n; i++){
+		e = &nd->e[i];
+		if(p+2 > ep)
+			goto Malformed;
+		e->key.n = SHORT(p);
+		p += 2;
+		e->key.a = p;
+		p += e->key.n;
+		if(nd->leaf){
+			if(p+2 > ep)
+				goto Malformed;
+			e->val.n = SHORT(p);
+			p += 2;
+			e->val.a = p;
+			p += e->val.n;
+		}else{
+			if(p+s->addrsize > ep)
+				goto Malformed;
+			e->childp = p;
+			e->child = getaddr(s, p);
+			p += s->addrsize;
+		}
+		if(p > ep){
+		Malformed:
+			free(nd->e);
+			free(nd);
+			b->close(b);
+			werrstr("malformed btree block %llux", addr);
+			return nil;
+		}
+	}
+	return nd;
+}
+
+static void
+closenode(Bnode *nd)
+{
+	nd->b->close(nd->b);
+	free(nd->e);
+	free(nd);
+}
+
+static void
+freenode(Bnode *nd)
+{
+	nd->b->free(nd->b);
+	free(nd->e);
+	free(nd);
+}
+
+/*
+ * lay out e[0..n-1] in b.  the entries may point into b itself.
+ */
+static void
+packnode(BTree *t, DBlock *b, int leaf, uvlong next, Bent *e, int n)
+{
+	int i, as;
+	uchar *buf, *p;
+
+	as = t->s->addrsize;
+	buf = emalloc(t->pagesize);
+	p = buf;
+	memmove(p, leaf ? "BLF" : "BIN", 4);
+	p += 4;
+	putaddr(t->s, p, next);
+	p += as;
+	PSHORT(p, n);
+	p += 2;
+	for(i=0; i<n; i++){
+		PSHORT(p, e[i].key.n);
+		p += 2;
+		memmove(p, e[i].key.a, e[i].key.n);
+		p += e[i].key.n;
+		if(leaf){
+			PSHORT(p, e[i].val.n);
+			p += 2;
+			memmove(p, e[i].val.a, e[i].val.n);
+			p += e[i].val.n;
+		}else{
+			putaddr(t->s, p, e[i].child);
+			p += as;
+		}
+	}
+	assert(p <= buf+t->pagesize);
+	memmove(b->a, buf, t->pagesize);
+	b->flags |= DDirty;
+	free(buf);
+}
+
+static DBlock*
+allocnode(BTree *t)
+{
+	DBlock *b;
+
+	b = t->s->alloc(t->s, t->pagesize);
+	if(b == nil)
+		return nil;
+	memset(b->a, 0, b->n);
+	return b;
+}
+
+/*
+ * index of the first leaf entry >= key; *eq says whether it's equal.
+ */
+static int
+leafsearch(Bnode *nd, Datum *key, int *eq)
+{
+	int lo, hi, m, c;
+
+	*eq = 0;
+	lo = 0;
+	hi = nd->n;
+	while(lo < hi){
+		m = (lo+hi)/2;
+		c = datumcmp(&nd->e[m].key, key);
+		if(c == 0){
+			*eq = 1;
+			return m;
+		}
+		if(c < 0)
+			lo = m+1;
+		else
+			hi = m;
+	}
+	return lo;
+}
+
+/*
+ * index of the child that would hold key.
+ */
+static int
+childsearch(Bnode *nd, Datum *key)
+{
+	int lo, hi, m;
+
+	lo = 1;
+	hi = nd->n;
+	while(lo < hi){
+		m = (lo+hi)/2;
+		if(datumcmp(&nd->e[m].key, key) <= 0)
+			lo = m+1;
+		else
+			hi = m;
+	}
+	return lo-1;
+}
+
+/*
+ * walk from the root to the leaf that would hold key,
+ * recording the way in path.
+ */
+static Bnode*
+descend(BTree *t, Datum *key, int extra, Bpath *path, int *depth)
+{
+	int d, i;
+	uvlong a;
+	Bnode *nd;
+
+	d = 0;
+	for(a=getroot(t);; a=nd->e[i].child, closenode(nd)){
+		if((nd = opennode(t, a, extra)) == nil)
+			return nil;
+		if(nd->leaf)
+			break;
+		if(d == MaxDepth){
+			closenode(nd);
+			werrstr("btree too deep");
+			return nil;
+		}
+		i = childsearch(nd, key);
+		path[d].addr = a;
+		path[d].i = i;
+		path[d].first = i == 0;
+		path[d].last = i == nd->n-1;
+		d++;
+	}
+	*depth = d;
+	return nd;
+}
+
+static void
+copyval(Datum *val, Datum *v)
+{
+	int n;
+
+	n = v->n;
+	if(val->n == 0 && val->a == nil){
+		val->n = n;
+		val->a = emallocnz(n+1);
+		((char*)val->a)[n] = 0;
+	}
+	if(n > val->n)
+		n = val->n;
+	if(n > 0)
+		memmove(val->a, v->a, n);
+	val->n = v->n;
+}
+
+static int
+treelookup(DMap *map, Datum *key, Datum *val)
+{
+	int i, d, eq;
+	Bnode *nd;
+	Bpath path[MaxDepth];
+	BTree *t;
+
+	t = map2tree(map);
+	if(getroot(t) == 0){
+		werrstr("key not found");
+		return -1;
+	}
+	if((nd = descend(t, key, 0, path, &d)) == nil)
+		return -1;
+	i = leafsearch(nd, key, &eq);
+	if(!eq){
+		closenode(nd);
+		werrstr("key not found");
+		return -1;
+	}
+	copyval(val, &nd->e[i].val);
+	closenode(nd);
+	return 0;
+}
+
+/*
+ * where to split a node that has overflowed after e[at]
+ * was inserted.  at the outside edge of the tree, where
+ * in-order loads happen, keep the old node full; otherwise
+ * split by bytes down the middle.
+ */
+static int
+splitpoint(BTree *t, Bnode *nd, int at, int edge)
+{
+	int m, sz, half;
+
+	if(edge > 0 && at == nd->n-1)
+		return nd->n-1;
+	if(edge < 0 && at == 0)
+		return 1;
+	half = (nodesize(t, nd->leaf, nd->e, nd->n) - NODEHDRSIZE(t->s))/2;
+	sz = 0;
+	for(m=0; m<nd->n-1; m++){
+		sz += entsize(t, nd->leaf, &nd->e[m]);
+		if(sz >= half)
+			break;
+	}
+	return m+1;
+}
+
+/*
+ * write nd back after e[at] was added or changed,
+ * splitting it and its ancestors as needed.
+ * edge is 1 (-1) if nd is the last (first) node on its
+ * level and at is a new entry, 0 otherwise.
+ */
+static int
+settle(BTree *t, Bnode *nd, int at, int edge, Bpath *path, int d)
+{
+	int m, n;
+	uchar *sepa, *osepa;
+	uvlong left, right;
+	DBlock *rb, *nb;
+	Bent e[2];
+
+	osepa = nil;
+	for(;;){
+		if(nodesize(t, nd->leaf, nd->e, nd->n) <= t->pagesize){
+			packnode(t, nd->b, nd->leaf, nd->next, nd->e, nd->n);
+			closenode(nd);
+			free(osepa);
+			return 0;
+		}
+
+		m = splitpoint(t, nd, at, edge);
+		if((rb = allocnode(t)) == nil){
+			closenode(nd);
+			free(osepa);
+			return -1;
+		}
+		n = nd->e[m].key.n;
+		sepa = emallocnz(n+1);
+		memmove(sepa, nd->e[m].key.a, n);
+		if(nd->leaf){
+			packnode(t, rb, 1, nd->next, nd->e+m, nd->n-m);
+			packnode(t, nd->b, 1, rb->addr, nd->e, m);
+		}else{
+			nd->e[m].key.n = 0;
+			packnode(t, rb, 0, 0, nd->e+m, nd->n-m);
+			packnode(t, nd->b, 0, 0, nd->e, m);
+		}
+		free(osepa);
+		osepa = sepa;
+		left = nd->b->addr;
+		right = rb->addr;
+		rb->close(rb);
+		closenode(nd);
+
+		if(d == 0){
+			if((nb = allocnode(t)) == nil){
+				free(sepa);
+				return -1;
+			}
+			memset(e, 0, sizeof e);
+			e[0].child = left;
+			e[1].key.a = sepa;
+			e[1].key.n = n;
+			e[1].child = right;
+			packnode(t, nb, 0, 0, e, 2);
+			setroot(t, nb->addr);
+			nb->close(nb);
+			free(sepa);
+			return 0;
+		}
+
+		d--;
+		if((nd = opennode(t, path[d].addr, 1)) == nil){
+			free(sepa);
+			return -1;
+		}
+		at = path[d].i+1;
+		memmove(&nd->e[at+1], &nd->e[at], (nd->n-at)*sizeof(Bent));
+		memset(&nd->e[at], 0, sizeof(Bent));
+		nd->e[at].key.a = sepa;
+		nd->e[at].key.n = n;
+		nd->e[at].child = right;
+		nd->n++;
+		if(edge > 0 && !path[d].last)
+			edge = 0;
+		if(edge < 0)
+			edge = 0;	/* the new child is never first */
+	}
+}
+
+static int
+treeinsert(DMap *map, Datum *key, Datum *val, int action)
+{
+	int i, d, eq, edge, first, last;
+	DBlock *b;
+	Bent e;
+	Bnode *nd;
+	Bpath path[MaxDepth];
+	BTree *t;
+
+	if(action == 0){
+		werrstr("no action specified");
+		return -1;
+	}
+
+	t = map2tree(map);
+	if(LEAFENTSIZE(key->n, val->n) > (t->pagesize-NODEHDRSIZE(t->s))/3){
+		werrstr("entry too big for btree (%d bytes)", LEAFENTSIZE(key->n, val->n));
+		return -1;
+	}
+
+	if(getroot(t) == 0){
+		if(!(action&DMapCreate)){
+			werrstr("key not found");
+			return -1;
+		}
+		if((b = allocnode(t)) == nil)
+			return -1;
+		memset(&e, 0, sizeof e);
+		e.key = *key;
+		e.val = *val;
+		packnode(t, b, 1, 0, &e, 1);
+		setroot(t, b->addr);
+		b->close(b);
+		return 0;
+	}
+
+	if((nd = descend(t, key, 1, path, &d)) == nil)
+		return -1;
+	i = leafsearch(nd, key, &eq);
+	edge = 0;
+	if(eq){
+		if(!(action&DMapReplace)){
+			closenode(nd);
+			werrstr("key already exists");
+			return -1;
+		}
+		nd->e[i].val = *val;
+	}else{
+		if(!(action&DMapCreate)){
+			closenode(nd);
+			werrstr("key not found");
+			return -1;
+		}
+		memmove(&nd->e[i+1], &nd->e[i], (nd->n-i)*sizeof(Bent));
+		memset(&nd->e[i], 0, sizeof(Bent));
+		nd->e[i].key = *key;
+		nd->e[i].val = *val;
+		nd->n++;
+		first = 1;
+		last = 1;
+		for(eq=0; eq<d; eq++){
+			first &= path[eq].first;
+			last &= path[eq].last;
+		}
+		if(last && i == nd->n-1)
+			edge = 1;
+		else if(first && i == 0)
+			edge = -1;
+	}
+	return settle(t, nd, i, edge, path, d);
+}
+
+static int
+treedelete(DMap *map, Datum *key)
+{
+	int i, d, eq, li, n, sz;
+	uvlong child;
+	Bent *e;
+	Bnode *nd, *pn, *sb, *l, *r;
+	Bpath path[MaxDepth];
+	BTree *t;
+
+	t = map2tree(map);
+	if(getroot(t) == 0){
+		werrstr("key not found");
+		return -1;
+	}
+	if((nd = descend(t, key, 0, path, &d)) == nil)
+		return -1;
+	i = leafsearch(nd, key, &eq);
+	if(!eq){
+		closenode(nd);
+		werrstr("key not found");
+		return -1;
+	}
+	memmove(&nd->e[i], &nd->e[i+1], (nd->n-i-1)*sizeof(Bent));
+	nd->n--;
+
+	for(;;){
+		if(d == 0){
+			if(nd->n == 0 || (!nd->leaf && nd->n == 1)){
+				child = nd->leaf ? 0 : nd->e[0].child;
+				freenode(nd);
+				setroot(t, child);
+				return 0;
+			}
+			break;
+		}
+		sz = nodesize(t, nd->leaf, nd->e, nd->n) - NODEHDRSIZE(t->s);
+		if(sz >= (t->pagesize-NODEHDRSIZE(t->s))/4)
+			break;
+
+		/* merge with a neighbor if they fit together */
+		if((pn = opennode(t, path[d-1].addr, 0)) == nil){
+			closenode(nd);
+			return -1;
+		}
+		li = path[d-1].i;
+		if(li > 0)
+			li--;
+		else if(li+1 >= pn->n){
+			closenode(pn);
+			break;
+		}
+		if((sb = opennode(t, pn->e[li == path[d-1].i ? li+1 : li].child, 0)) == nil){
+			closenode(pn);
+			closenode(nd);
+			return -1;
+		}
+		if(li == path[d-1].i){
+			l = nd;
+			r = sb;
+		}else{
+			l = sb;
+			r = nd;
+		}
+		n = l->n+r->n;
+		e = emalloc((n+1)*sizeof(Bent));
+		memmove(e, l->e, l->n*sizeof(Bent));
+		memmove(e+l->n, r->e, r->n*sizeof(Bent));
+		if(!l->leaf && r->n > 0)
+			e[l->n].key = pn->e[li+1].key;
+		if(nodesize(t, l->leaf, e, n) > t->pagesize){
+			free(e);
+			closenode(sb);
+			closenode(pn);
+			break;
+		}
+		packnode(t, l->b, l->leaf, r->next, e, n);
+		free(e);
+		closenode(l);
+		freenode(r);
+		memmove(&pn->e[li+1], &pn->e[li+2], (pn->n-li-2)*sizeof(Bent));
+		pn->n--;
+		nd = pn;
+		d--;
+	}
+	packnode(t, nd->b, nd->leaf, nd->next, nd->e, nd->n);
+	closenode(nd);
+	return 0;
+}
+
+static int
+freesubtree(BTree *t, uvlong a)
+{
+	int i, r;
+	Bnode *nd;
+
+	if((nd = opennode(t, a, 0)) == nil)
+		return -1;
+	r = 0;
+	if(!nd->leaf)
+		for(i=0; i<nd->n; i++)
+			r |= freesubtree(t, nd->e[i].child);
+	freenode(nd);
+	return r;
+}
+
+static int
+treedeleteall(DMap *map)
+{
+	int r;
+	uvlong a;
+	BTree *t;
+
+	t = map2tree(map);
+	r = 0;
+	if((a = getroot(t)) != 0)
+		r = freesubtree(t, a);
+	setroot(t, 0);
+	return r;
+}
+
+static int
+treewalk(DMap *map, void (*fn)(void*, Datum*, Datum*), void *arg)
+{
+	int i;
+	uvlong a, next, pf;
+	Bnode *nd;
+	BTree *t;
+
+	t = map2tree(map);
+	for(a=getroot(t); a; a=nd->e[0].child, closenode(nd)){
+		if((nd = opennode(t, a, 0)) == nil)
+			panic("treewalk: %r");
+		if(nd->leaf)
+			break;
+	}
+	for(; a; a=next){
+		if(nd == nil && (nd = opennode(t, a, 0)) == nil)
+			panic("treewalk: %r");
+		next = nd->next;
+		if(next){
+			pf = next;
+			dstoreprefetch(t->s, &pf, 1);
+		}
+		for(i=0; i<nd->n; i++)
+			(*fn)(arg, &nd->e[i].key, &nd->e[i].val);
+		closenode(nd);
+		nd = nil;
+	}
+	return 0;
+}
+
+static void
+dumpnode(BTree *t, uvlong a, int fd, int depth)
+{
+	int i;
+	Bnode *nd;
+
+	if((nd = opennode(t, a, 0)) == nil){
+		fprint(fd, "%*s?cannot load %llux: %r\n", depth, "", a);
+		return;
+	}
+	fprint(fd, "%*s--- %llux %s n %d next %llux\n", depth, "", a,
+		nd->leaf ? "leaf" : "interior", nd->n, nd->next);
+	for(i=0; i<nd->n; i++){
+		fprint(fd, "%*s\t%.*s", depth, "",
+			utfnlen((char*)nd->e[i].key.a, nd->e[i].key.n), (char*)nd->e[i].key.a);
+		if(nd->leaf)
+			fprint(fd, ": %.*s\n",
+				utfnlen((char*)nd->e[i].val.a, nd->e[i].val.n), (char*)nd->e[i].val.a);
+		else{
+			fprint(fd, " -> %llux\n", nd->e[i].child);
+			dumpnode(t, nd->e[i].child, fd, depth+1);
+		}
+	}
+	closenode(nd);
+}
+
+static void
+treedump(DMap *map, int fd)
+{
+	BTree *t;
+
+	t = map2tree(map);
+	fprint(fd, "===\n");
+	if(getroot(t))
+		dumpnode(t, getroot(t), fd, 0);
+	fprint(fd, "===\n");
+}
+
+static int
+treeclose(DMap *map)
+{
+	int r;
+	BTree *t;
+
+	t = map2tree(map);
+	r = t->hdr->close(t->hdr);
+	free(t);
+	return r;
+}
+
+static int
+treeflush(DMap *map)
+{
+	BTree *t;
+
+	t = map2tree(map);
+	return t->hdr->flush(t->hdr);
+}
+
+static int
+treefree(DMap *map)
+{
+	BTree *t;
+
+	t = map2tree(map);
+	if(treedeleteall(map) < 0)
+		return -1;
+	t->hdr->free(t->hdr);
+	free(t);
+	return 0;
+}
+
+static int
+treeisempty(DMap *map)
+{
+	return getroot(map2tree(map)) == 0;
+}
+
+/*
+ * move the node at a, and then everything under it, into
+ * free pages below them.  *na gets a's new address.  the
+ * leaves come in key order, so the previous one (*prev)
+ * is the one whose next pointer needs fixing.
+ */
+static int
+compactnode(BTree *t, uvlong a, uvlong *prev, uvlong *na)
+{
+	int i, n, r, moved;
+	uvlong f, c;
+	DBlock *b, *nb, *pb;
+	DStore *s;
+	Bnode *nd;
+
+	s = t->s;
+	n = 0;
+	moved = 0;
+	f = dstorefirstfree(s);
+	if(f != 0 && f < a){
+		if((b = s->read(s, a)) == nil)
+			return -1;
+		if((nb = s->alloc(s, b->n)) == nil){
+			b->close(b);
+			return -1;
+		}
+		if(nb->addr < a){
+			memmove(nb->a, b->a, b->n);
+			nb->flags |= DDirty;
+			a = nb->addr;
+			nb->close(nb);
+			b->free(b);
+			moved = 1;
+			n++;
+		}else{
+			nb->free(nb);
+			b->close(b);
+		}
+	}
+	*na = a;
+
+	if((nd = opennode(t, a, 0)) == nil)
+		return -1;
+	if(nd->leaf){
+		if(moved && *prev){
+			if((pb = s->read(s, *prev)) == nil){
+				closenode(nd);
+				return -1;
+			}
+			putaddr(s, (uchar*)pb->a+4, a);
+			pb->flags |= DDirty;
+			pb->close(pb);
+		}
+		*prev = a;
+		closenode(nd);
+		return n;
+	}
+	for(i=0; i<nd->n; i++){
+		if((r = compactnode(t, nd->e[i].child, prev, &c)) < 0){
+			closenode(nd);
+			return -1;
+		}
+		n += r;
+		if(c != nd->e[i].child){
+			putaddr(s, nd->e[i].childp, c);
+			nd->b->flags |= DDirty;
+		}
+	}
+	closenode(nd);
+	return n;
+}
+
+static int
+treecompact(DMap *map)
+{
+	int n;
+	uvlong a, na, prev;
+	BTree *t;
+
+	t = map2tree(map);
+	if((a = getroot(t)) == 0)
+		return 0;
+	prev = 0;
+	if((n = compactnode(t, a, &prev, &na)) < 0)
+		return -1;
+	if(na != a)
+		setroot(t, na);
+	return n;
+}
+
+/*
+ * is the map at addr a tree rather than a list?
+ */
+int
+dmapistree(DStore *s, uvlong addr)
+{
+	int r;
+	DBlock *b;
+
+	if((b = s->read(s, addr)) == nil)
+		return 0;
+	r = b->n == BHDRSIZE(s) && memcmp(b->a, "BHDR", 4) == 0;
+	b->close(b);
+	return r;
+}
+
+/*
+ * the most key and value bytes one entry can hold
+ * in a tree made from the map (list or tree) at addr.
+ */
+int
+dmaptreemax(DStore *s, uvlong addr)
+{
+	int n;
+	DBlock *b;
+
+	if((b = s->read(s, addr)) == nil)
+		return 0;
+	n = 0;
+	if(b->n == BHDRSIZE(s))
+		n = (LONG((uchar*)b->a+4+s->addrsize)-NODEHDRSIZE(s))/3 - LEAFENTSIZE(0, 0);
+	b->close(b);
+	return n;
+}
+
+/*
+ * open the map at addr, whichever kind it is.
+ */
+DMap*
+dmapopen(DStore *s, uvlong addr)
+{
+	if(dmapistree(s, addr))
+		return dmaptree(s, addr, 0);
+	return dmaplist(s, addr, 0);
+}
+
+/*
+ * open the tree at addr, or create one if addr is 0.
+ * an empty list at addr becomes an empty tree.
+ */
+DMap*
+dmaptree(DStore *s, uvlong addr, uint pagesize)
+{
+	BTree *t;
+	DBlock *hdr;
+	uchar *p;
+
+	if(addr == 0){
+		if(pagesize == 0)
+			panic("cannot allocate btree with page size 0");
+		hdr = s->alloc(s, BHDRSIZE(s));
+		if(hdr == nil)
+			return nil;
+		p = hdr->a;
+		memmove(p, "BHDR", 4);
+		p += 4;
+		putaddr(s, p, 0);
+		p += s->addrsize;
+		PLONG(p, pagesize);
+		hdr->flags |= DDirty;
+	}else{
+		hdr = s->read(s, addr);
+		if(hdr == nil)
+			return nil;
+		if(hdr->n != BHDRSIZE(s)){
+			werrstr("bad btree header at 0x%llux; size %ud expected %d", addr, hdr->n, BHDRSIZE(s));
+			hdr->close(hdr);
+			return nil;
+		}
+		p = hdr->a;
+		if(memcmp(p, "LHDR", 4) == 0 && getaddr(s, p+4) == 0){
+			memmove(p, "BHDR", 4);
+			hdr->flags |= DDirty;
+		}
+		if(memcmp(p, "BHDR", 4) != 0){
+			werrstr("bad btree header at 0x%llux: magic %.8ux", addr, *(u32int*)p);
+			hdr->close(hdr);
+			return nil;
+		}
+	}
+
+	t = emalloc(sizeof(BTree));
+	t->s = s;
+	t->hdr = hdr;
+	t->rootp = (uchar*)hdr->a+4;
+	t->pagesize = LONG((uchar*)hdr->a+4+s->addrsize);
+	if(t->pagesize < 3*LEAFENTSIZE(1, 1)+NODEHDRSIZE(s) || t->pagesize > s->pagesize){
+		werrstr("bad btree page size %d", t->pagesize);
+		hdr->close(hdr);
+		free(t);
+		return nil;
+	}
+	t->m.lookup = treelookup;
+	t->m.insert = treeinsert;
+	t->m.delete = treedelete;
+	t->m.deleteall = treedeleteall;
+	t->m.walk = treewalk;
+	t->m.dump = treedump;
+	t->m.close = treeclose;
+	t->m.free = treefree;
+	t->m.flush = treeflush;
+	t->m.isempty = treeisempty;
+	t->m.compact = treecompact;
+	t->m.addr = hdr->addr;
+	t->magic = (u32int)map2tree;
+	return &t->m;
+}
@@ -0,0 +1,124 @@
+#include "tra.h"
+
+/*
+ * microbenchmarks for the list cache.
+ *
+ *	clbench [-c ncycle] [-n nentry] [-r nlookup] file
+ *
+ * creates file holding one list of nentry entries, then
+ * ncycle times opens it through a list cache, loads it into
+ * memory, does nlookup lookups at random keys, and closes it
+ * with a zero budget so that it is freed.
+ */
+
+void
+usage(void)
+{
+	fprint(2, "usage: clbench [-c ncycle] [-n nentry] [-r nlookup] file\n");
+	exits("usage");
+}
+
+static void
+mkkey(Datum *k, char *buf, int i)
+{
+	sprint(buf, "file%08d", i);
+	k->a = buf;
+	k->n = strlen(buf);
+}
+
+void
+main(int argc, char **argv)
+{
+	int i, j, ncycle, nentry, nlookup;
+	char buf[32];
+	uchar val[64], out[64];
+	uvlong addr;
+	vlong t, tload, tlook, tfree;
+	Datum k, v;
+	DMap *m;
+	DStore *s;
+	LStats st;
+	Listcache *lc;
+
+	ncycle = 10;
+	nentry = 50000;
+	nlookup = 100000;
+	ARGBEGIN{
+	case 'c':
+		ncycle = atoi(EARGF(usage()));
+		break;
+	case 'n':
+		nentry = atoi(EARGF(usage()));
+		break;
+	case 'r':
+		nlookup = atoi(EARGF(usage()));
+		break;
+	default:
+		usage();
+	}ARGEND
+
+	if(argc != 1 || nentry <= 0)
+		usage();
+
+	srandom(1);
+	remove(argv[0]);
+	remove(smprint("%s.redo", argv[0]));
+	s = createdstore(argv[0], 8192);
+	if(s == nil)
+		sysfatal("createdstore %s: %r", argv[0]);
+	lc = openlistcache();
+	listcachesize(lc, 0);
+	m = dmapclist(lc, s, 0, 8192-s->hdrsize);
+	if(m == nil)
+		sysfatal("dmapclist: %r");
+	addr = m->addr;
+	t = nsec();
+	for(i=0; i<nentry; i++){
+		mkkey(&k, buf, i);
+		memset(val, i, sizeof val);
+		v.a = val;
+		v.n = sizeof val;
+		if(m->insert(m, &k, &v, DMapCreate) < 0)
+			sysfatal("insert: %r");
+	}
+	m->close(m);
+	if(s->flush(s) < 0)
+		sysfatal("flush: %r");
+	print("create %d: %.3fs\n", nentry, (nsec()-t)/1e9);
+
+	tload = 0;
+	tlook = 0;
+	tfree = 0;
+	for(j=0; j<ncycle; j++){
+		t = nsec();
+		if((m = dmapclist(lc, s, addr, 0)) == nil)
+			sysfatal("dmapclist: %r");
+		/* a failed insert loads the list without changing it */
+		mkkey(&k, buf, 0);
+		if(m->insert(m, &k, &v, DMapCreate) >= 0)
+			sysfatal("insert of existing key succeeded");
+		tload += nsec()-t;
+
+		t = nsec();
+		for(i=0; i<nlookup; i++){
+			mkkey(&k, buf, random()%nentry);
+			v.a = out;
+			v.n = sizeof out;
+			if(m->lookup(m, &k, &v) < 0)
+				sysfatal("lookup %s: %r", buf);
+		}
+		tlook += nsec()-t;
+
+		t = nsec();
+		m->close(m);
+		tfree += nsec()-t;
+	}
+	listcachestats(lc, &st);
+	print("load: %.3fms/cycle\n", tload/1e6/ncycle);
+	print("lookup: %.0fns/lookup\n", (double)tlook/ncycle/(nlookup ? nlookup : 1));
+	print("free: %.3fms/cycle\n", tfree/1e6/ncycle);
+	print("list cache: %lud hit %lud miss %lud evict\n", st.hit, st.miss, st.evict);
+	closelistcache(lc);
+	s->close(s);
+	exits(nil);
+}
@@ -1,56 +1,93 @@
 #include "tra.h"
-#include "avl.h"
+#include "mtree.h"
 
 int cmaplookups, cmapinserts;
 
 /*
  * Avoid unsightly O(n^2) behavior in on-disk list insertions by keeping 
- * the in-memory version in a balanced tree.  This means reading
- * the entire list from disk even to do a lookup.  We cache lists even
- * after they have been closed to avoid the hit all the time. 
+ * the in-memory version in a B+ tree (mtree.c).  The tree is only built
+ * the first time the list is changed; until then lookups go straight
+ * to the list, which only reads the page that can hold the key.
+ * We cache lists even after they have been closed to avoid the hit
+ * all the time. 
+ *
+ * The cache is hashed by (store, address).  Maps nobody has open
+ * sit on an LRU list, and the least recently used are written
+ * back and dropped whenever the cache holds more than its budget
+ * of memory (see listcachesize).
+ *
+ * A map's entries, keys and values are carved out of big blocks
+ * (its arena) that are all freed at once when the map goes.
+ * Deleted entries and replaced values leave holes; when the holes
+ * take up most of the arena, the live entries are copied to a new
+ * one.
  */
 
+typedef struct Arena Arena;
 typedef struct CMap CMap;
 typedef struct Entry Entry;
 
 enum
 {
-	MaxUnused = 16,	/* somewhat arbitrary */
+	MapCost = 8*1024,	/* of a map with nothing loaded; it holds blocks open */
+	DefaultMem = 16*1024*1024,
+	ArenaBlock = 64*1024,
 };
 
 struct Listcache
 {
-	CMap **c;
+	CMap **hash;
+	int nhash;
 	int nc;
-	int mc;
-	int now;	/* lru time */
+	CMap *lruhead;	/* unused maps, most recently used first */
+	CMap *lrutail;
+	uvlong mem;	/* charged to cached maps */
+	uvlong maxmem;
+	int bigdir;	/* lists this long become trees */
+	LStats stats;
 };
 
 struct Entry 
 {
-	Avl avl;
-	Datum k;	/* k.a is malloced data */
-	Datum v;	/* v.a is malloced data */
+	Datum k;	/* k.a and v.a are in the arena */
+	Datum v;
+	int vcap;	/* room at v.a */
+};
+
+struct Arena
+{
+	uchar *blk;	/* current block; each starts with a pointer to the last */
+	uchar *p;	/* free space in blk */
+	uchar *ep;
+	uvlong size;	/* of all the blocks */
+	uvlong hole;	/* bytes in them no longer used */
 };
 
 struct CMap
 {
 	DMap cmap;	/* cached interface we present MUST BE FIRST */
 	DMap *ucmap;	/* uncached interface we eventually write to */
-	Avltree *tree;	/* tree holding records */
+	Mtree *tree;	/* tree holding records; nil until changed */
+	int n;		/* number of records */
 	int nopen;		/* number of clients holding this open */
 	DStore *s;		/* identity */
-	u32int addr;
-	int used;
+	uvlong addr;
 	int dirty;
+	Arena arena;	/* entries in tree */
+	uvlong treemem;	/* charged for tree */
+	int nwalk;	/* walks in progress; no repacking */
+	uvlong mem;	/* charged to lc */
 	Listcache *lc;
+	CMap *hnext;	/* in lc->hash */
+	CMap *lnext;	/* in lru list, if nopen == 0 */
+	CMap *lprev;
 };
 
-static Avl*
-e2a(Entry *e)
-{
-	return (Avl*)e;
-}
+#define ENTRYSIZE(e)	(sizeof(Entry)+(e)->k.n+(e)->vcap)
+
+static int cmapload(CMap*);
+static Datum *entrykey(void*);
+static void trimlistcache(Listcache*);
 
 static CMap*
 map2clist(DMap *m)
@@ -58,36 +95,238 @@ map2clist(DMap *m)
 	return (CMap*)m;
 }
 
+static void
+charge(CMap *c, vlong n)
+{
+	c->mem += n;
+	c->lc->mem += n;
+}
+
+static void
+chargetree(CMap *c)
+{
+	uvlong m;
+
+	m = c->tree ? mtreemem(c->tree) : 0;
+	charge(c, (vlong)m - (vlong)c->treemem);
+	c->treemem = m;
+}
+
+static void*
+arenaalloc(CMap *c, ulong n)
+{
+	ulong sz;
+	uchar *b;
+	Arena *a;
+
+	a = &c->arena;
+	n = (n+7)&~7;
+	if(a->blk == nil || a->p+n > a->ep){
+		sz = sizeof(uchar*)+n;
+		if(sz < ArenaBlock)
+			sz = ArenaBlock;
+		b = emallocnz(sz);
+		*(uchar**)b = a->blk;
+		if(a->blk)
+			a->hole += a->ep - a->p;
+		a->blk = b;
+		a->p = b+sizeof(uchar*);
+		a->ep = b+sz;
+		a->size += sz;
+		charge(c, sz);
+	}
+	b = a->p;
+	a->p += n;
+	return b;
+}
+
+static void
+arenafree(CMap *c, Arena *a)
+{
+	uchar *b, *next;
+
+	for(b=a->blk; b; b=next){
+		next = *(uchar**)b;
+		free(b);
+	}
+	charge(c, -(vlong)a->size);
+	memset(a, 0, sizeof *a);
+}
+
+static Entry*
+newentry(CMap *c, Datum *k, Datum *v)
+{
+	Entry *e;
+
+	e = arenaalloc(c, sizeof(Entry)+k->n+v->n);
+	e->k.a = (uchar*)&e[1];
+	e->k.n = k->n;
+	memmove(e->k.a, k->a, k->n);
+	e->v.a = (uchar*)e->k.a+k->n;
+	e->v.n = v->n;
+	e->vcap = v->n;
+	memmove(e->v.a, v->a, v->n);
+	return e;
+}
+
+/*
+ * copy the live entries to a new arena if the holes
+ * have taken over the old one.
+ */
+static void
+cmaprepack(CMap *c)
+{
+	Arena old;
+	Mtree *t;
+	Mtreewalk *w;
+	Entry *e;
+
+	if(c->nwalk || c->arena.hole < c->arena.size/2 || c->arena.size < 4*ArenaBlock)
+		return;
+	dbg(DbgCache, "cmaprepack addr %llux %llud/%llud\n", c->addr, c->arena.hole, c->arena.size);
+	old = c->arena;
+	memset(&c->arena, 0, sizeof c->arena);
+	t = mkmtree(entrykey);
+	w = mtreewalk(c->tree, 0);
+	while((e = mtreenext(w)) != nil)
+		mtreeinsert(t, newentry(c, &e->k, &e->v));
+	endmtreewalk(w);
+	freemtree(c->tree);
+	c->tree = t;
+	arenafree(c, &old);
+	chargetree(c);
+}
+
 Listcache*
 openlistcache(void)
 {
-	return emalloc(sizeof(Listcache));
+	Listcache *lc;
+
+	lc = emalloc(sizeof(Listcache));
+	lc->maxmem = DefaultMem;
+	return lc;
+}
+
+static ulong
+hashaddr(int nhash, DStore *s, uvlong addr)
+{
+	uvlong h;
+
+	h = (addr ^ (uintptr)s) * 0x9E3779B97F4A7C15ULL;
+	return (h>>32) & (nhash-1);
+}
+
+static void
+lruinsert(CMap *c)
+{
+	Listcache *lc;
+
+	lc = c->lc;
+	c->lprev = nil;
+	c->lnext = lc->lruhead;
+	if(lc->lruhead)
+		lc->lruhead->lprev = c;
+	else
+		lc->lrutail = c;
+	lc->lruhead = c;
+}
+
+static void
+lruremove(CMap *c)
+{
+	Listcache *lc;
+
+	lc = c->lc;
+	if(c->lprev)
+		c->lprev->lnext = c->lnext;
+	else
+		lc->lruhead = c->lnext;
+	if(c->lnext)
+		c->lnext->lprev = c->lprev;
+	else
+		lc->lrutail = c->lprev;
+	c->lnext = nil;
+	c->lprev = nil;
+}
+
+static void
+addcache(Listcache *lc, CMap *c)
+{
+	int i, n;
+	ulong h;
+	CMap **nh, *x, *next;
+
+	if(lc->nc >= lc->nhash){
+		n = lc->nhash ? 2*lc->nhash : 64;
+		nh = emalloc(n*sizeof(nh[0]));
+		for(i=0; i<lc->nhash; i++)
+			for(x=lc->hash[i]; x; x=next){
+				next = x->hnext;
+				h = hashaddr(n, x->s, x->addr);
+				x->hnext = nh[h];
+				nh[h] = x;
+			}
+		free(lc->hash);
+		lc->hash = nh;
+		lc->nhash = n;
+	}
+	h = hashaddr(lc->nhash, c->s, c->addr);
+	c->hnext = lc->hash[h];
+	lc->hash[h] = c;
+	lc->nc++;
+	charge(c, MapCost);
+}
+
+/*
+ * take c out of the cache; the caller writes it back and frees it.
+ */
+static void
+uncache(CMap *c)
+{
+	CMap **l;
+	Listcache *lc;
+
+	lc = c->lc;
+	for(l=&lc->hash[hashaddr(lc->nhash, c->s, c->addr)]; *l; l=&(*l)->hnext)
+		if(*l == c)
+			break;
+	if(*l == nil)
+		panic("couldn't find cached map to uncache it");
+	*l = c->hnext;
+	if(c->nopen == 0)
+		lruremove(c);
+	lc->nc--;
+	lc->mem -= c->mem;
+	c->mem = 0;
 }
 
 static int
 cmapinsert(DMap *m, Datum *k, Datum *v, int flag)
 {
-	Avl *a;
 	CMap *c;
-	Entry ek, *e, *ep;
+	Entry *e;
 
 	dbg(DbgCache, "cinsert %.8lux %.*s %.*H\n", getcallerpc(&m), (int)utfnlen((char*)k->a, k->n), (char*)k->a, v->n, v->a);
 
 cmapinserts++;
 	c = map2clist(m);
-	ek.k = *k;
-	if((a = lookupavl(c->tree, e2a(&ek))) != nil){
+	if(cmapload(c) < 0)
+		return -1;
+	if((e = mtreelookup(c->tree, k)) != nil){
 		if(!(flag&DMapReplace)){
 dbg(DbgCache, "cinsert done\n");
 			werrstr("key already exists");
 			return -1;
 		}
 		c->dirty = 1;
-		e = (Entry*)a;
-		free(e->v.a);
-		e->v.a = emallocnz(v->n);
+		if(v->n > e->vcap){
+			c->arena.hole += e->vcap;
+			e->v.a = arenaalloc(c, v->n);
+			e->vcap = v->n;
+		}
 		e->v.n = v->n;
 		memmove(e->v.a, v->a, v->n);
+		cmaprepack(c);
 dbg(DbgCache, "cinsert done\n");
 		return 0;
 	}else{
@@ -97,17 +336,10 @@ dbg(DbgCache, "cinsert done\n");
 			return -1;
 		}
 		c->dirty = 1;
-		e = emalloc(sizeof(Entry));
-		e->k.a = emalloc(k->n);
-		e->k.n = k->n;
-		memmove(e->k.a, k->a, k->n);
-		e->v.a = emallocnz(v->n);
-		e->v.n = v->n;
-		memmove(e->v.a, v->a, v->n);
-		ep = nil;
-		insertavl(c->tree, e2a(e), (Avl**)(void*)&ep);
-		if(ep != nil)
+		c->n++;
+		if(mtreeinsert(c->tree, newentry(c, k, v)) != nil)
 			panic("cmapinsert");
+		chargetree(c);
 dbg(DbgCache, "cinsert done\n");
 		return 0;
 	}	
@@ -116,19 +348,18 @@ dbg(DbgCache, "cinsert done\n");
 static int
 cmaplookup(DMap *m, Datum *k, Datum *v)
 {
-	Avl *a;
 	CMap *c;
-	Entry ek, *e;
+	Entry *e;
 	int n;
 
 cmaplookups++;
 	c = map2clist(m);
-	ek.k = *k;
-	if((a = lookupavl(c->tree, e2a(&ek))) == nil){
+	if(c->tree == nil)
+		return c->ucmap->lookup(c->ucmap, k, v);
+	if((e = mtreelookup(c->tree, k)) == nil){
 		werrstr("key not found");
 		return -1;
 	}
-	e = (Entry*)a;
 	n = e->v.n;
 
 	if(v->n == 0 && v->a == nil){
@@ -148,47 +379,37 @@ cmaplookups++;
 static int
 cmapdelete(DMap *m, Datum *k)
 {
-	Avl *a;
 	CMap *c;
-	Entry ek, *e;
+	Entry *e;
 
 	c = map2clist(m);
-	ek.k = *k;
-	a = nil;
-	deleteavl(c->tree, e2a(&ek), &a);
-	if(a == nil){
+	if(cmapload(c) < 0)
+		return -1;
+	if((e = mtreedelete(c->tree, k)) == nil){
 		werrstr("key not found");
 		return -1;
 	}
 	c->dirty = 1;
-	e = (Entry*)a;
-	free(e->k.a);
-	free(e->v.a);
-	free(e);
+	c->n--;
+	c->arena.hole += ENTRYSIZE(e);
+	chargetree(c);
+	cmaprepack(c);
 	return 0;	
 }
 
 static int
 cmapdeleteall(DMap *m)
 {
-	Avl *a;
-	Avlwalk *w;
 	CMap *c;
-	Entry *e, *ep;
+
 	c = map2clist(m);
 	c->dirty = 1;
-	w = avlwalk(c->tree);
-	while((a = avlnext(w)) != nil){
-		ep = nil;
-		deleteavl(c->tree, a, (Avl**)(void*)&ep);
-		e = (Entry*)a;
-		if(ep != e)
-			panic("cmapdeleteall %p %p", e, ep);
-		free(e->k.a);
-		free(e->v.a);
-		free(e);
-	}
-	endwalk(w);
+	c->n = 0;
+	if(c->tree)
+		freemtree(c->tree);
+	arenafree(c, &c->arena);
+	c->tree = mkmtree(entrykey);
+	chargetree(c);
 	return 0;
 }
 
@@ -196,21 +417,25 @@ static int
 cmapwalk(DMap *m, void (*fn)(void*, Datum*, Datum*), void *arg)
 {
 	Entry *e;
-	Avlwalk *w;
+	Mtreewalk *w;
 	CMap *c;
 
 	c = map2clist(m);
-	w = avlwalk(c->tree);
-	while((e = (Entry*)avlnext(w)) != nil)
+	if(c->tree == nil)
+		return c->ucmap->walk(c->ucmap, fn, arg);
+	c->nwalk++;
+	w = mtreewalk(c->tree, 0);
+	while((e = mtreenext(w)) != nil)
 		(*fn)(arg, &e->k, &e->v);
-	endwalk(w);
+	endmtreewalk(w);
+	c->nwalk--;
 	return 0;
 }
 
 static int
 cmapflush(DMap *m)
 {
-	Avlwalk *w;
+	Mtreewalk *w;
 	CMap *c;
 	Entry *e;
 
@@ -218,11 +443,12 @@ cmapflush(DMap *m)
 	if(!c->dirty)
 		return 0;
 	c->ucmap->deleteall(c->ucmap);
-	w = avlwalk(c->tree);
-	while((e = (Entry*)avlnext(w)) != nil)
+	/* backward, so each insert goes at the front of the list */
+	w = mtreewalk(c->tree, 1);
+	while((e = mtreenext(w)) != nil)
 		if(c->ucmap->insert(c->ucmap, &e->k, &e->v, DMapCreate) < 0)
 			panic("wb insert failed during cmapflush: %r");
-	endwalk(w);
+	endmtreewalk(w);
 	c->ucmap->flush(c->ucmap);
 	c->dirty = 0;
 	return 0;
@@ -234,29 +460,23 @@ cmapclose(DMap *m)
 	CMap *c;
 
 	c = map2clist(m);
-	c->nopen--;
+	if(--c->nopen == 0){
+		lruinsert(c);
+		trimlistcache(c->lc);
+	}
 	return 0;
 }
 
 static int
 cmapfree(DMap *m)
 {
-	int i;
 	CMap *c;
-	Listcache *lc;
 
 	c = map2clist(m);
 	cmapdeleteall(m);
 	c->ucmap->free(c->ucmap);
-	freeavltree(c->tree);
-	lc = c->lc;
-
-	for(i=0; i<lc->nc; i++)
-		if(lc->c[i] == c)
-			break;
-	if(i==lc->nc)
-		panic("couldn't find cached map in list to free it");
-	lc->c[i] = lc->c[--lc->nc];
+	freemtree(c->tree);
+	uncache(c);
 	free(c);
 	return 0;
 }
@@ -267,7 +487,21 @@ cmapisempty(DMap *m)
 	CMap *c;
 
 	c = map2clist(m);
-	return isemptyavl(c->tree);
+	if(c->tree == nil)
+		return c->ucmap->isempty(c->ucmap);
+	return isemptymtree(c->tree);
+}
+
+/*
+ * the cached entries don't care where the list lives.
+ */
+static int
+cmapcompact(DMap *m)
+{
+	CMap *c;
+
+	c = map2clist(m);
+	return c->ucmap->compact(c->ucmap);
 }
 
 static void
@@ -281,41 +515,48 @@ static void
 cmapfill(void *a, Datum *k, Datum *v)
 {
 	CMap *c;
-	Entry *e, *ep;
+	Entry *ep;
 
 	c = a;
-	e = emalloc(sizeof(Entry));
-	e->k.a = emalloc(k->n);
-	e->k.n = k->n;
-	memmove(e->k.a, k->a, k->n);
-	e->v.a = emalloc(v->n);
-	e->v.n = v->n;
-	memmove(e->v.a, v->a, v->n);
-	ep = nil;
-	insertavl(c->tree, e2a(e), (Avl**)(void*)&ep);
-	if(ep){
-		free(ep->k.a);
-		free(ep->v.a);
-		free(ep);
-	}
+	if((ep = mtreeinsert(c->tree, newentry(c, k, v))) != nil)
+		c->arena.hole += ENTRYSIZE(ep);
+	else
+		c->n++;
 }
 
 int dcentrycmps;
-static int
-entrycmp(Avl *a, Avl *b)
+static Datum*
+entrykey(void *a)
 {
-	Entry *ea, *eb;
-
-	ea = (Entry*)a;
-	eb = (Entry*)b;
-
 dcentrycmps++;
-	/* keep avl sorted backwards so list insertion during flush is fast */
-	return -datumcmp(&ea->k, &eb->k);
+	return &((Entry*)a)->k;
+}
+
+/*
+ * read the whole list into the tree before the first change.
+ */
+static int
+cmapload(CMap *c)
+{
+	if(c->tree != nil)
+		return 0;
+	dbg(DbgCache, "cmapload addr %llux\n", c->addr);
+	c->tree = mkmtree(entrykey);
+	c->n = 0;
+	if(c->ucmap->walk(c->ucmap, cmapfill, c) < 0){
+		cmapdeleteall(&c->cmap);
+		freemtree(c->tree);
+		c->tree = nil;
+		chargetree(c);
+		c->dirty = 0;
+		return -1;
+	}
+	chargetree(c);
+	return 0;
 }
 
 CMap*
-newcache(Listcache *lc, DStore *s, u32int addr, uint size)
+newcache(Listcache *lc, DStore *s, uvlong addr, uint size)
 {
 	CMap *c;
 	DMap *uc;
@@ -325,7 +566,7 @@ newcache(Listcache *lc, DStore *s, u32int addr, uint size)
 		return nil;
 
 	c = emalloc(sizeof(*c));
-	dbg(DbgCache, "newcache addr %ux %ux m %p\n", addr, uc->addr, c);
+	dbg(DbgCache, "newcache addr %llux %llux m %p\n", addr, uc->addr, c);
 	c->cmap.addr = uc->addr;
 	c->cmap.insert = cmapinsert;
 	c->cmap.lookup = cmaplookup;
@@ -336,73 +577,125 @@ newcache(Listcache *lc, DStore *s, u32int addr, uint size)
 	c->cmap.free = cmapfree;
 	c->cmap.flush = cmapflush;
 	c->cmap.isempty = cmapisempty;
+	c->cmap.compact = cmapcompact;
 	c->cmap.dump = cmapdump;
 	c->lc = lc;
 	c->ucmap = uc;
 	c->addr = uc->addr;
 	c->s = s;
+	if(addr == 0){
+		c->tree = mkmtree(entrykey);
+		chargetree(c);
+	}
+	return c;
+}
 
-	c->tree = mkavltree(entrycmp);
-	if(uc->walk(uc, cmapfill, c) < 0){
-		cmapfree(&c->cmap);
-		uc->close(uc);
+/*
+ * move the records of a big, changed list into a tree at the
+ * same address, so the parent needn't change.  the list is
+ * gone afterward (c->ucmap is nil) but the records are still
+ * in c->tree.  returns nil and leaves the list alone if it isn't
+ * big or some record is too big for a tree.
+ */
+static DMap*
+cmaptotree(CMap *c)
+{
+	int max;
+	Mtreewalk *w;
+	DMap *t;
+	Entry *e;
+
+	if(!c->dirty || c->lc->bigdir == 0 || c->n < c->lc->bigdir)
+		return nil;
+	max = dmaptreemax(c->s, c->addr);
+	w = mtreewalk(c->tree, 0);
+	while((e = mtreenext(w)) != nil)
+		if(e->k.n+e->v.n > max)
+			break;
+	endmtreewalk(w);
+	if(e != nil)
 		return nil;
-	}
 
-	return c;
+	dbg(DbgCache, "cmaptotree %llux n %d\n", c->addr, c->n);
+	c->ucmap->deleteall(c->ucmap);
+	c->ucmap->close(c->ucmap);
+	c->ucmap = nil;
+	if((t = dmaptree(c->s, c->addr, 0)) == nil)
+		panic("cmaptotree: %r");
+	w = mtreewalk(c->tree, 0);
+	while((e = mtreenext(w)) != nil)
+		if(t->insert(t, &e->k, &e->v, DMapCreate) < 0)
+			panic("insert failed during cmaptotree: %r");
+	endmtreewalk(w);
+	c->dirty = 0;
+	return t;
 }
 
-void
+/*
+ * write c back, as a tree if it has grown big,
+ * and drop it from the cache.
+ */
+static void
 dumpcache(CMap *c)
 {
-	dbg(DbgCache, "dumpcache addr %ux %ux m %p\n", c->addr, c->cmap.addr, c);
-	if(cmapflush(&c->cmap) < 0)
-		panic("couldn't flush cache to evict entry");
-	cmapdeleteall(&c->cmap);
-	c->ucmap->close(c->ucmap);
-	freeavltree(c->tree);
+	DMap *t;
+
+	dbg(DbgCache, "dumpcache addr %llux %llux m %p\n", c->addr, c->cmap.addr, c);
+	if(c->ucmap && (t = cmaptotree(c)) != nil)
+		t->close(t);
+	if(c->ucmap){
+		if(cmapflush(&c->cmap) < 0)
+			panic("couldn't flush cache to evict entry");
+		c->ucmap->close(c->ucmap);
+	}
+	if(c->tree)
+		freemtree(c->tree);
+	arenafree(c, &c->arena);
+	uncache(c);
 	free(c);
 }
 
+/*
+ * evict the least recently used maps until we're within budget.
+ */
+static void
+trimlistcache(Listcache *lc)
+{
+	while(lc->mem > lc->maxmem && lc->lrutail){
+		lc->stats.evict++;
+		dumpcache(lc->lrutail);
+	}
+}
+
 DMap*
-dmapclist(Listcache *lc, DStore *s, u32int addr, uint size)
-{
-	int i, unused;
-	CMap **clast, *c;
-
-	unused = 0;
-	clast = nil;
-	for(i=0; i<lc->nc; i++){
-		if(lc->c[i]->s == s && lc->c[i]->addr == addr){
-			lc->c[i]->used =  lc->now++;
-			lc->c[i]->nopen++;
-			return &lc->c[i]->cmap;
-		}
-		if(lc->c[i]->nopen == 0){
-			unused++;
-			if(clast==nil || (*clast)->used > lc->c[i]->used)
-				clast = &lc->c[i];
+dmapclist(Listcache *lc, DStore *s, uvlong addr, uint size)
+{
+	CMap *c;
+
+	if(addr && lc->nhash)
+	for(c=lc->hash[hashaddr(lc->nhash, s, addr)]; c; c=c->hnext)
+		if(c->s == s && c->addr == addr){
+			lc->stats.hit++;
+			if(c->nopen++ == 0)
+				lruremove(c);
+			return &c->cmap;
 		}
+
+	if(addr && dmapistree(s, addr)){
+		lc->stats.tree++;
+		return dmaptree(s, addr, 0);
 	}
 
 	c = newcache(lc, s, addr, size);
 	if(c == nil)
 		return nil;
-
+	if(addr)
+		lc->stats.miss++;
 	c->nopen++;
-	if(unused >= MaxUnused){
-		dumpcache(*clast);
-		*clast = lc->c[--lc->nc];
-	}
-
-	if(lc->nc >= lc->mc){
-		lc->mc = lc->nc+16;
-		lc->c = erealloc(lc->c, lc->mc*sizeof(lc->c[0]));
-	}
+	addcache(lc, c);
+	trimlistcache(lc);
 
-	lc->c[lc->nc++] = c;
-
-	dbg(DbgCache, "dmapclist %ux => %ux %ux %ux\n", addr, c->addr, c->cmap.addr, c->ucmap->addr);
+	dbg(DbgCache, "dmapclist %llux => %llux %llux %llux\n", addr, c->addr, c->cmap.addr, c->ucmap->addr);
 	return &c->cmap;
 }
 
@@ -410,10 +703,49 @@ void
 flushlistcache(Listcache *lc)
 {
 	int i;
+	CMap *c, *next;
+	DMap *t;
 
 	dbg(DbgCache, "flushlistcache called from %lux\n", getcallerpc(&lc));
-	for(i=0; i<lc->nc; i++)
-		cmapflush(&lc->c[i]->cmap);
+	for(i=0; i<lc->nhash; i++)
+		for(c=lc->hash[i]; c; c=next){
+			next = c->hnext;
+			if(c->nopen == 0 && (t = cmaptotree(c)) != nil){
+				t->close(t);
+				dumpcache(c);
+				continue;
+			}
+			cmapflush(&c->cmap);
+		}
+}
+
+/*
+ * changed lists with n or more records are turned into
+ * trees as they are flushed or evicted; 0 means never.
+ */
+void
+listcachebigdir(Listcache *lc, int n)
+{
+	lc->bigdir = n;
+}
+
+/*
+ * set the memory budget, in bytes.
+ */
+void
+listcachesize(Listcache *lc, uvlong size)
+{
+	lc->maxmem = size;
+	trimlistcache(lc);
+}
+
+void
+listcachestats(Listcache *lc, LStats *st)
+{
+	*st = lc->stats;
+	st->nmap = lc->nc;
+	st->mem = lc->mem;
+	st->maxmem = lc->maxmem;
 }
 
 void
@@ -422,7 +754,9 @@ closelistcache(Listcache *lc)
 	int i;
 
 	dbg(DbgCache, "closelistcache called from %lux\n", getcallerpc(&lc));
-	for(i=0; i<lc->nc; i++)
-		dumpcache(lc->c[i]);
+	for(i=0; i<lc->nhash; i++)
+		while(lc->hash[i])
+			dumpcache(lc->hash[i]);
+	free(lc->hash);
 	free(lc);
 }
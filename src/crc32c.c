@@ -0,0 +1,95 @@
+#include <u.h>
+#include <libc.h>
+#include "storage.h"
+
+/*
+ * CRC-32C (Castagnoli), as used for the page checksums in storage.c.
+ * crc32c(0, p, n) is the usual checksum of p; pass the previous
+ * result to continue a running one.
+ *
+ * The portable version is slicing-by-8.  On x86-64 with gcc we use
+ * the SSE4.2 crc32 instruction when the processor has it.
+ */
+
+enum
+{
+	Poly = 0x82F63B78,	/* reversed */
+};
+
+static u32int tab[8][256];
+static int inited;
+
+static void
+mktab(void)
+{
+	int i, j;
+	u32int c;
+
+	for(i=0; i<256; i++){
+		c = i;
+		for(j=0; j<8; j++)
+			c = (c>>1) ^ (Poly & -(c&1));
+		tab[0][i] = c;
+	}
+	for(i=0; i<256; i++)
+		for(j=1; j<8; j++)
+			tab[j][i] = (tab[j-1][i]>>8) ^ tab[0][tab[j-1][i]&0xFF];
+}
+
+static u32int
+swcrc(u32int c, uchar *p, ulong n)
+{
+	u32int lo, hi;
+
+	for(; n && ((uintptr)p&7); n--)
+		c = (c>>8) ^ tab[0][(c^*p++)&0xFF];
+	for(; n >= 8; n -= 8, p += 8){
+		lo = c ^ (p[0] | p[1]<<8 | p[2]<<16 | (u32int)p[3]<<24);
+		hi = p[4] | p[5]<<8 | p[6]<<16 | (u32int)p[7]<<24;
+		c = tab[7][lo&0xFF] ^ tab[6][(lo>>8)&0xFF]
+			^ tab[5][(lo>>16)&0xFF] ^ tab[4][lo>>24]
+			^ tab[3][hi&0xFF] ^ tab[2][(hi>>8)&0xFF]
+			^ tab[1][(hi>>16)&0xFF] ^ tab[0][hi>>24];
+	}
+	for(; n; n--)
+		c = (c>>8) ^ tab[0][(c^*p++)&0xFF];
+	return c;
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static u32int
+hwcrc(u32int c, uchar *p, ulong n)
+{
+	u64int c64, x;
+
+	for(; n && ((uintptr)p&7); n--)
+		c = __builtin_ia32_crc32qi(c, *p++);
+	c64 = c;
+	for(; n >= 8; n -= 8, p += 8){
+		memmove(&x, p, 8);
+		c64 = __builtin_ia32_crc32di(c64, x);
+	}
+	c = c64;
+	for(; n; n--)
+		c = __builtin_ia32_crc32qi(c, *p++);
+	return c;
+}
+#define hashw()	__builtin_cpu_supports("sse4.2")
+#else
+#define hwcrc	swcrc
+#define hashw()	0
+#endif
+
+static u32int (*crcfn)(u32int, uchar*, ulong);
+
+u32int
+crc32c(u32int c, uchar *p, ulong n)
+{
+	if(!inited){
+		mktab();
+		crcfn = hashw() ? hwcrc : swcrc;
+		inited = 1;
+	}
+	return ~crcfn(~c, p, n);
+}
@@ -8,6 +8,7 @@
  *	- dbgetstat: retrieve the Stat associated with path
  *	- dbputstat: set the Stat associated with path
  *	- dbgetkids: retrieve a list of children under path
+ *	- dbgetkidviews: the same, leaving the stats undecoded
  *
  * We use a few tricks to reduce space requirements.
  * 
@@ -22,10 +23,11 @@
  * 
  * The database is built on top of the storage layer defined in
  * storage.h.  Each directory is represented by an on-disk list
- * Map. The list will probably be too inefficient for enormous
- * directories, but so far it has not been a problem.  There is
- * a B+ Tree implementation in btree.c that may eventually be
- * used in place of list.c.
+ * Map (list.c), which the list cache (clist.c) loads whole
+ * once it is changed.  When a changed directory has BigDir
+ * entries, the list cache turns it into a B+ tree (btree.c) at
+ * the same address; trees are read a node at a time and are
+ * not cached.
  * 
  * The storage layer provides atomic updates: until flush is
  * called, nothing is written to disk, and if we crash during
@@ -36,10 +38,15 @@
 
 #include "tra.h"
 
-int dbwalks, dbwalklooks, idtostrs, strtoids;
+int dbwalks, dbwalklooks, idtostrs, strtoids, ghostwalks, ghostlooks;
 
 static int dbapplylog(Db*);
+static void dbcheckpoint(Db*);
+static int compactsome(Db*);
+static void forgetbust(Db*, uvlong);
+static void forgetlist(Db*, uvlong);
 static void ghostbust(Db*, DMap*, Vtime*);
+static void noteghost(Db*, DMap*, char*);
 
 enum	/* ON-DISK: DON'T CHANGE */
 {
@@ -52,6 +59,173 @@ enum	/* ON-DISK: DON'T CHANGE */
 	LogSize = 1024*1024
 };
 
+enum
+{
+	BigDir = 2048,	/* entries; see above */
+};
+
+/*
+ * The string table maps the uids, gids, muids and machine
+ * names in stats to 16-bit ids and back.  It is small, so
+ * it is kept entirely in memory, hashed both ways, loaded
+ * from the idtostr map when the db is opened.  A new string
+ * goes into both maps when its id is made, and from there
+ * to disk at the next flush.
+ */
+typedef struct Dbstr Dbstr;
+struct Dbstr
+{
+	char *s;	/* an atom */
+	int id;
+};
+
+struct Dbstrtab
+{
+	Dbstr *e;
+	int ne;
+	int *bystr;	/* e index+1, or 0 */
+	int *byid;
+	int nh;
+};
+
+static uint
+strhash(char *s)
+{
+	uint h;
+	uchar *p;
+
+	h = 0;
+	for(p=(uchar*)s; *p; p++)
+		h = h*37 + *p;
+	return h;
+}
+
+static uint
+idhash(int id)
+{
+	return id * 0x9E3779B1;
+}
+
+static void
+strtabhash(Dbstrtab *t, int i)
+{
+	uint h;
+
+	for(h=strhash(t->e[i].s)&(t->nh-1); t->bystr[h]; h=(h+1)&(t->nh-1))
+		;
+	t->bystr[h] = i+1;
+	for(h=idhash(t->e[i].id)&(t->nh-1); t->byid[h]; h=(h+1)&(t->nh-1))
+		;
+	t->byid[h] = i+1;
+}
+
+static int
+strtablookstr(Dbstrtab *t, char *s)
+{
+	int i;
+	uint h;
+
+	if(t->nh == 0)
+		return 0;
+	for(h=strhash(s)&(t->nh-1); (i = t->bystr[h]) != 0; h=(h+1)&(t->nh-1))
+		if(strcmp(t->e[i-1].s, s) == 0)
+			return t->e[i-1].id;
+	return 0;
+}
+
+static char*
+strtablookid(Dbstrtab *t, int id)
+{
+	int i;
+	uint h;
+
+	if(t->nh == 0)
+		return nil;
+	for(h=idhash(id)&(t->nh-1); (i = t->byid[h]) != 0; h=(h+1)&(t->nh-1))
+		if(t->e[i-1].id == id)
+			return t->e[i-1].s;
+	return nil;
+}
+
+static void
+strtabadd(Dbstrtab *t, char *s, int id)
+{
+	int i;
+
+	if(t->ne%64 == 0)
+		t->e = erealloc(t->e, (t->ne+64)*sizeof t->e[0]);
+	t->e[t->ne].s = atom(s);
+	t->e[t->ne].id = id;
+	t->ne++;
+	if(2*t->ne < t->nh){
+		strtabhash(t, t->ne-1);
+		return;
+	}
+	free(t->bystr);
+	free(t->byid);
+	t->nh = t->nh ? 2*t->nh : 256;
+	t->bystr = emalloc(t->nh*sizeof t->bystr[0]);
+	t->byid = emalloc(t->nh*sizeof t->byid[0]);
+	for(i=0; i<t->ne; i++)
+		strtabhash(t, i);
+}
+
+static void
+loadstrtab1(void *v, Datum *key, Datum *val)
+{
+	int id;
+	char *s;
+	Dbstrtab *t;
+
+	t = v;
+	if(key->n != 2)	/* trafixdb complains about these */
+		return;
+	id = SHORT((uchar*)key->a);
+	if(id == 0 || strtablookid(t, id) != nil)
+		return;
+	s = emalloc(val->n+1);
+	memmove(s, val->a, val->n);
+	strtabadd(t, s, id);
+	free(s);
+}
+
+static Dbstrtab*
+loadstrtab(Db *db)
+{
+	Dbstrtab *t;
+
+	t = emalloc(sizeof *t);
+	db->idtostr->walk(db->idtostr, loadstrtab1, t);
+	return t;
+}
+
+static void
+freestrtab(Dbstrtab *t)
+{
+	if(t == nil)
+		return;
+	free(t->e);
+	free(t->bystr);
+	free(t->byid);
+	free(t);
+}
+
+/*
+ * the caller has rewritten the string maps (trafixdb
+ * does); forget what we knew of the old ones.
+ */
+void
+dbreloadstrings(Db *db)
+{
+	freestrtab(db->strtab);
+	db->strtab = loadstrtab(db);
+	free(db->sidbyrid);
+	db->sidbyrid = nil;
+	db->nsidbyrid = 0;
+	free(db->ridbysid);
+	db->ridbysid = nil;
+}
+
 /*
  * marshal/unmarshal stat structures.
  */
@@ -60,86 +234,48 @@ strtoid(Db *db, char *s)
 {
 	int i, j;
 	Datum k, v;
-	uchar buf[4];
+	uchar buf[2];
 
 	if(s == nil){
 		// fprint(2, "strtoid nil => 0\n");
 		return 0;
 	}
 
-	s = atom(s);
-
-	if(strcachebystr(&db->strcache, s, &i) >= 0){
-		// fprint(2, "strtoid %s => %d\n", s, i);
+	if((i = strtablookstr(db->strtab, s)) != 0)
 		return i;
-	}
 
 strtoids++;
-	k.a = s;
-	k.n = strlen(s);
-	v.a = buf;
-	v.n = sizeof buf;
-	if(db->strtoid->lookup(db->strtoid, &k, &v) >= 0){
-		if(v.n != 2)
-			panic("db: bad data in strtoid map");
-		// fprint(2, "dbstrtoid %s %d\n", s, i);
-		i = SHORT(buf);
-		strcache(&db->strcache, s, i);
-		return i;
-	}
-
-	k.a = buf;
-	k.n = 2;
 	j = rand()%65535;
 	for(i=0; i<65535; i++){
 		if(++j == 65536)
 			j = 1;
-		PSHORT(buf, j);
-		v.a = nil;
-		v.n = 0;
-		if(db->idtostr->lookup(db->idtostr, &k, &v) < 0)
+		if(strtablookid(db->strtab, j) == nil)
 			break;
-		free(v.a);
 	}
 	if(i==65535)
 		panic("db: too many strings");
 
 	// fprint(2, "dbstrtoid %s alloc %d\n", s, j);
+	PSHORT(buf, j);
+	k.a = buf;
+	k.n = 2;
 	v.a = s;
 	v.n = strlen(s);
 	if(db->idtostr->insert(db->idtostr, &k, &v, DMapCreate) < 0)
 		panic("db: cannot create new string");
-	if(db->strtoid->insert(db->strtoid, &v, &k, DMapCreate) < 0)
+	/* replace: strtoid may hold a stale entry that idtostr lost */
+	if(db->strtoid->insert(db->strtoid, &v, &k, DMapCreate|DMapReplace) < 0)
 		panic("db: cannot create new string");
-	strcache(&db->strcache, s, j);
+	strtabadd(db->strtab, s, j);
 	return j;
 }
 
 static char*
 idtostr(Db *db, int i)
 {
-	char *s;
-	uchar buf[2];
-	Datum k, v;
-
 	if(i == 0)
 		return nil;
-
-	if((s = strcachebyid(&db->strcache, i)) != nil)
-		return s;
-
-idtostrs++;
-	PSHORT(buf, i);
-	k.a = buf;
-	k.n = sizeof buf;
-	v.a = nil;
-	v.n = 0;
-	if(db->idtostr->lookup(db->idtostr, &k, &v) < 0)
-		return nil;
-	s = atom(v.a);
-	free(v.a);
-	strcache(&db->strcache, s, i);
-	return s;
+	return strtablookid(db->strtab, i);
 }
 
 static char*
@@ -155,7 +291,7 @@ dbreadbufstringatom(Db *db, Buf *b)
 	s = idtostr(db, i);
 	if(s == nil)
 		panic("db: bad string pointer %d", i);
-	return atom(s);
+	return s;
 }
 
 static void
@@ -171,20 +307,60 @@ dbwritebufstring(Db *db, Buf *b, char *s)
 	writebufc(b, i);
 }
 
+/*
+ * a replica's machine name goes through the string maps
+ * once; after that its id is looked up in these tables.
+ */
+static int
+ridtosid(Db *db, int rid)
+{
+	int n;
+
+	if(rid >= db->nsidbyrid){
+		n = db->nsidbyrid;
+		db->nsidbyrid = rid+16;
+		db->sidbyrid = erealloc(db->sidbyrid, db->nsidbyrid*sizeof db->sidbyrid[0]);
+		memset(db->sidbyrid+n, 0, (db->nsidbyrid-n)*sizeof db->sidbyrid[0]);
+	}
+	if(db->sidbyrid[rid] == 0)
+		db->sidbyrid[rid] = strtoid(db, replicaname(rid));
+	return db->sidbyrid[rid];
+}
+
+static int
+sidtorid(Db *db, int sid)
+{
+	char *s;
+
+	if(db->ridbysid == nil)
+		db->ridbysid = emalloc(65536*sizeof db->ridbysid[0]);
+	if(db->ridbysid[sid] == 0){
+		s = idtostr(db, sid);
+		if(s == nil)
+			panic("db: bad string pointer %d", sid);
+		db->ridbysid[sid] = replicaid(s);
+	}
+	return db->ridbysid[sid];
+}
+
 static void
 dbwritebufltime(Db *db, Buf *b, Ltime *t)
 {
-	assert(t->m != nil);
+	int i;
 
 	writebufc(b, 1);
 	writebufl(b, t->t);
 	writebufl(b, t->wall);
-	dbwritebufstring(db, b, t->m);
+	i = ridtosid(db, t->id);
+	writebufc(b, i>>8);
+	writebufc(b, i);
 }
 
 static void
 dbreadbufltime(Db *db, Buf *b, Ltime *t)
 {
+	int i;
+
 	switch(readbufc(b)){
 	case 0:
 		b->p--;
@@ -197,14 +373,16 @@ dbreadbufltime(Db *db, Buf *b, Ltime *t)
 	}
 	t->t = readbufl(b);
 	t->wall = readbufl(b);
-	t->m = dbreadbufstringatom(db, b);
-	assert(t->m != nil);
+	i = readbufc(b)<<8;
+	i |= readbufc(b);
+	assert(i != 0);
+	t->id = sidtorid(db, i);
 }
 
 static void
 dbwritebufvtime(Db *db, Buf *b, Vtime *v)
 {
-	int i;
+	int i, buf[8], *ord;
 
 	writebufc(b, 0);
 	if(v == nil){
@@ -212,14 +390,21 @@ dbwritebufvtime(Db *db, Buf *b, Vtime *v)
 		return;
 	}
 	writebufl(b, v->nl);
+	if(v->nl <= 0)
+		return;
+	ord = v->nl <= nelem(buf) ? buf : emalloc(v->nl*sizeof ord[0]);
+	vtimenameorder(v, ord);
 	for(i=0; i<v->nl; i++)
-		dbwritebufltime(db, b, v->l+i);
+		dbwritebufltime(db, b, v->l+ord[i]);
+	if(ord != buf)
+		free(ord);
 }
 
 static Vtime*
 dbreadbufvtime(Db *db, Buf *b)
 {
 	int i, n;
+	Ltime t;
 	Vtime *v;
 
 	if(readbufc(b) != 0)
@@ -231,11 +416,11 @@ dbreadbufvtime(Db *db, Buf *b)
 	if(n < -2 || n > 65536)
 		longjmp(b->jmp, 1);
 	v = mkvtime();
-	v->nl = n;
-	if(v->nl > 0){
-		v->l = emalloc(sizeof(v->l[0])*v->nl);
-		for(i=0; i<v->nl; i++)
-			dbreadbufltime(db, b, v->l+i);
+	if(n == -1)
+		v->nl = -1;
+	for(i=0; i<n; i++){
+		dbreadbufltime(db, b, &t);
+		addvtime(v, &t);
 	}
 	setmalloctag(v, getcallerpc(&db));
 	return v;
@@ -356,106 +541,336 @@ dbunparsestat(Db *db, Stat *s, Datum *d, int pad)
 }
 
 /*
- * Write the database walking code once and not in three places.
- * Each particular call is probably overkill -- the caller doesn't need all
- * the DMap, Datum, and Stat structures along the way -- but this
- * makes everything else a bit easier.  It's only memory.
+ * stat views.  the state and sync time come first in a
+ * stored stat, so looking at them decodes nothing else.
+ */
+static void
+dbskipbufvtime(Buf *b)
+{
+	int i, n;
+
+	if(readbufc(b) != 0)
+		longjmp(b->jmp, BufData);
+	n = readbufl(b);
+	if(n < -2 || n > 65536)
+		longjmp(b->jmp, BufData);
+	for(i=0; i<n; i++){
+		switch(readbufc(b)){
+		case 0:
+			readbufl(b);
+			readbufl(b);
+			if(readbufstring(b) == nil)
+				longjmp(b->jmp, BufData);
+			break;
+		case 1:
+			readbufbytes(b, 4+4+2);
+			break;
+		default:
+			longjmp(b->jmp, BufData);
+		}
+	}
+}
+
+static void
+viewbuf(Statview *v, Buf *b)
+{
+	/* format byte, then non-nil byte */
+	if(v->n < 2 || v->a[0] > 1 || v->a[1] == 0)
+		panic("dbview: bad stat format");
+	b->p = v->a+2;
+	b->ep = v->a+v->n;
+}
+
+int
+dbviewstate(Statview *v)
+{
+	Buf b;
+
+	viewbuf(v, &b);
+	if(setjmp(b.jmp))
+		panic("dbview: bad stat format");
+	return readbufl(&b);
+}
+
+Vtime*
+dbviewsynctime(Statview *v)
+{
+	Buf b;
+	Vtime *t;
+
+	viewbuf(v, &b);
+	if(setjmp(b.jmp))
+		panic("dbview: bad stat format");
+	readbufl(&b);
+	t = dbreadbufvtime(v->db, &b);
+	if(t && v->up)
+		maxvtime(t, v->up);
+	return t;
+}
+
+Vtime*
+dbviewmtime(Statview *v)
+{
+	Buf b;
+
+	viewbuf(v, &b);
+	if(setjmp(b.jmp))
+		panic("dbview: bad stat format");
+	readbufl(&b);
+	dbskipbufvtime(&b);
+	return dbreadbufvtime(v->db, &b);
+}
+
+Stat*
+dbviewstat(Statview *v)
+{
+	Stat *s;
+
+	if((s = dbparsestat(v->db, v->a, v->n)) == nil)
+		panic("dbview: %r");
+	if(s->synctime && v->up)
+		maxvtime(s->synctime, v->up);
+	setmalloctag(s, getcallerpc(&v));
+	return s;
+}
+
+/*
+ * if maxing and then unmaxing the stored sync time of v with vt
+ * changes it, make the new stored value in d, with pad bytes
+ * in front, and return 1.  stats in the old format are rewritten
+ * whole.
+ */
+static int
+viewtrimsynctime(Statview *v, Vtime *vt, Datum *d, int pad)
+{
+	int n, off, end;
+	Buf b;
+	Stat *s;
+	Vtime *t;
+
+	if(v->a[0] != 1){
+		s = dbviewstat(v);
+		maxvtime(s->synctime, vt);
+		unmaxvtime(s->synctime, vt);
+		dbunparsestat(v->db, s, d, pad);
+		freestat(s);
+		return 1;
+	}
+	viewbuf(v, &b);
+	if(setjmp(b.jmp))
+		panic("dbview: bad stat format");
+	readbufl(&b);
+	off = b.p - v->a;
+	t = dbreadbufvtime(v->db, &b);
+	end = b.p - v->a;
+	maxvtime(t, vt);
+	unmaxvtime(t, vt);
+
+	memset(&b, 0, sizeof b);
+	dbwritebufvtime(v->db, &b, t);
+	n = (intptr)b.p;
+	d->n = pad + v->n - (end-off) + n;
+	d->a = emalloc(d->n);
+	b.p = (uchar*)d->a+pad+off;
+	b.ep = b.p+n;
+	dbwritebufvtime(v->db, &b, t);
+	freevtime(t);
+	if(n == end-off && memcmp((uchar*)d->a+pad+off, v->a+off, n) == 0){
+		free(d->a);
+		return 0;
+	}
+	memmove((uchar*)d->a+pad, v->a, off);
+	memmove((uchar*)d->a+pad+off+n, v->a+end, v->n-end);
+	return 1;
+}
+
+/*
+ * A cursor holds a path in the database open: the map, stat
+ * and address of each element from the root down.  The stats
+ * it holds have their sync times down-propagated; they are
+ * reduced again only as they are written.  Moving the cursor
+ * a level or changing the stat it points at costs a lookup
+ * or two instead of a walk from the root, so a scan that
+ * follows the tree with one cursor does constant database
+ * work per file.  dbgetstat and friends just open a cursor
+ * on their path.
+ *
+ * While a cursor is open, the stats it holds must change
+ * only through it.
  */
 typedef struct Dbwalk Dbwalk;
 struct Dbwalk
 {
 	DMap *m;
-	Datum v;
 	Stat *s;
-	u32int addr;
+	uvlong addr;
 	int dirty;
 };
 
+struct Dbcursor
+{
+	Db *db;
+	Dbwalk *w;	/* w[0] is root */
+	char **e;	/* names of w[1] through w[n] */
+	int n;
+	int nfound;	/* w[0] through w[nfound] are in the db */
+	int max;
+};
+
 /*
- * Allocate and fill a Dbwalk array for each walkable point in path.
- * N.B.  w[0] is root, so dbwalk returns n to indicate n+1 elements in *wp.
+ * open a cursor on path.
  */
-static int
-dbwalk(Db *db, char **e, int ne, Dbwalk **wp)
+Dbcursor*
+dbcursor(Db *db, char **e, int ne)
 {
-	int i, n;
-	ulong addr;
-	Datum k, v;
-	Dbwalk *w;
-	Stat *s;
+	int i;
+	Dbcursor *c;
 
 dbwalks++;
-	w = emalloc((ne+1)*sizeof(w[0]));
-	w[0].m = db->root;
-	w[0].s = copystat(db->rootstat);
-	maxvtime(w[0].s->synctime, db->now);
-	w[0].addr = db->root->addr;
-	*wp = w;
-
-	for(i=0; i<ne && w[i].m; i++){
-		v.a = nil;
-		v.n = 0;
-		k.a = e[i];
-		k.n = strlen(k.a);
+	c = emalloc(sizeof *c);
+	c->db = db;
+	c->max = ne+1 < 16 ? 16 : ne+1;
+	c->w = emalloc(c->max*sizeof c->w[0]);
+	c->e = emalloc(c->max*sizeof c->e[0]);
+	c->w[0].m = db->root;
+	c->w[0].s = copystat(db->rootstat);
+	maxvtime(c->w[0].s->synctime, db->now);
+	c->w[0].addr = db->root->addr;
+	for(i=0; i<ne; i++)
+		dbcursordown(c, e[i]);
+	return c;
+}
+
+/*
+ * move c down to the child name.  returns 1 if the child
+ * is in the database; otherwise c points at a ghost.
+ */
+int
+dbcursordown(Dbcursor *c, char *name)
+{
+	int as;
+	Datum k, v;
+	Db *db;
+	Dbwalk *p, *w;
+
+	db = c->db;
+	if(c->n+1 == c->max){
+		c->max *= 2;
+		c->w = erealloc(c->w, c->max*sizeof c->w[0]);
+		c->e = erealloc(c->e, c->max*sizeof c->e[0]);
+	}
+	p = &c->w[c->n];
+	w = p+1;
+	memset(w, 0, sizeof *w);
+	c->e[c->n++] = estrdup(name);
+	if(c->nfound < c->n-1 || p->m == nil){
+		w->s = mkghoststat(p->s->synctime);
+		return 0;
+	}
+
+	v.a = nil;
+	v.n = 0;
+	k.a = name;
+	k.n = strlen(name);
 dbwalklooks++;
-		if(w[i].m->lookup(w[i].m, &k, &v) < 0)
-			break;
-		if(v.n < 4)
-			panic("dbwalk: bad db data");
-		addr = LONG((uchar*)v.a);
-		s = dbparsestat(db, (uchar*)v.a+4, v.n-4);
-		if(s == nil)
-			panic("dbwalk: bad stat format");
-		w[i+1].addr = addr;
-		w[i+1].s = s;
-		w[i+1].v = v;
-		if(addr){
-			w[i+1].m = dmapclist(db->listcache, db->s, addr, 0);
-			if(w[i+1].m == nil)
-				panic("dbwalk: bad list address");
-			dbg(DbgDb, "list %p is %lux\n", w[i+1].m, addr);
-		}else
-			w[i+1].m = nil;
+	if(p->m->lookup(p->m, &k, &v) < 0){
+		w->s = mkghoststat(p->s->synctime);
+		return 0;
+	}
+	as = db->s->addrsize;
+	if(v.n < as)
+		panic("dbwalk: bad db data");
+	w->addr = getaddr(db->s, v.a);
+	w->s = dbparsestat(db, (uchar*)v.a+as, v.n-as);
+	if(w->s == nil)
+		panic("dbwalk: bad stat format");
+	free(v.a);
+	if(w->addr){
+		w->m = dmapclist(db->listcache, db->s, w->addr, 0);
+		if(w->m == nil)
+			panic("dbwalk: bad list address");
+		dbg(DbgDb, "list %p is %llux\n", w->m, w->addr);
 	}
-	n = i;
 
 	/* down-propagate sync times */
-	maxvtime(w[0].s->synctime, db->now);
-	for(i=1; i<=n; i++)
-		maxvtime(w[i].s->synctime, w[i-1].s->synctime);
+	maxvtime(w->s->synctime, p->s->synctime);
+	c->nfound = c->n;
+	return 1;
+}
 
-	return n;
+/*
+ * move c back up to the parent.
+ */
+void
+dbcursorup(Dbcursor *c)
+{
+	Dbwalk *w;
+
+	if(c->n == 0)
+		panic("dbcursorup at root");
+	w = &c->w[c->n];
+	if(w->m)
+		w->m->close(w->m);
+	freestat(w->s);
+	free(c->e[--c->n]);
+	if(c->nfound > c->n)
+		c->nfound = c->n;
+}
+
+void
+dbclosecursor(Dbcursor *c)
+{
+	while(c->n > 0)
+		dbcursorup(c);
+	freestat(c->w[0].s);
+	free(c->w);
+	free(c->e);
+	free(c);
+}
+
+/*
+ * the stat where c points, inventing a ghost if necessary.
+ */
+Stat*
+dbcursorstat(Dbcursor *c)
+{
+	return copystat(c->w[c->n].s);
 }
 
+static void writelevels(Dbcursor*);
+
 /* 
- * Write out changed entries in the Dbwalk.
+ * Write out the changed stats in c, with their sync
+ * times reduced, and tidy the list of the last element.
  */
 static void
-writedbwalk(Db *db, Dbwalk *w, char **e, int n)
+writecursor(Dbcursor *c)
 {
-	int i;
-	Datum k, v;
-	uchar *p;
+	int n;
+	Db *db;
+	Dbwalk *w;
+	Vtime *vt;
 
-	/*
-	 * remove unnecessary sync information.
-	 */
-	for(i=n; i>0; i--)
-		unmaxvtime(w[i].s->synctime, w[i-1].s->synctime);
-	unmaxvtime(w[0].s->synctime, db->now);
+	db = c->db;
+	w = c->w;
+	n = c->n;
 
 	/*
 	 * check whether any child ghosts can be reclaimed.
 	 *
 	 * it would be nicer if we could just drop the ghost
-	 * when we writedbwalk on the path to the ghost during
+	 * when we write the cursor on the path to the ghost during
 	 * the file system scan, but at that point the ghost will
 	 * always have a sync time bigger than the current
 	 * directory, since it has been scanned and the directory
 	 * has not.
 	 */
-	if(w[n].m != nil)
-		ghostbust(db, w[n].m, w[n].s->synctime);
+	if(w[n].m != nil){
+		vt = copyvtime(w[n].s->synctime);
+		unmaxvtime(vt, n ? w[n-1].s->synctime : db->now);
+		ghostbust(db, w[n].m, vt);
+		freevtime(vt);
+	}
 
 	/*
 	 * the original database associated an empty
@@ -467,8 +882,9 @@ writedbwalk(Db *db, Dbwalk *w, char **e, int n)
 	 */
 	if(n!=0 && w[n].m != nil){
 		if(w[n].m->isempty(w[n].m)){
-			dbg(DbgDb, "removing empty list %p at %ux for %s\n",
-				w[n].m, w[n].m->addr, n ? e[n-1] : "<root>");
+			dbg(DbgDb, "removing empty list %p at %llux for %s\n",
+				w[n].m, w[n].m->addr, c->e[n-1]);
+			forgetlist(db, w[n].addr);
 			w[n].m->free(w[n].m);
 			w[n].m = nil;
 			w[n].addr = 0;
@@ -476,46 +892,207 @@ writedbwalk(Db *db, Dbwalk *w, char **e, int n)
 		}
 	}
 
-	/*
-	 * write changes.
-	 */
-	if(w[0].dirty){
-		freestat(db->rootstat);
-		db->rootstat = copystat(w[0].s);
-		db->rootstatdirty = 1;
-	}
-	for(i=1; i<=n; i++){
+	writelevels(c);
+}
+
+/*
+ * write changes, removing unnecessary sync information.
+ */
+static void
+writelevels(Dbcursor *c)
+{
+	int i;
+	Datum k, v;
+	Db *db;
+	Dbwalk *w;
+	Stat *s;
+
+	db = c->db;
+	w = c->w;
+	for(i=0; i<=c->n; i++){
 		if(!w[i].dirty)
 			continue;
-		dbunparsestat(db, w[i].s, &v, 4);
-		p = v.a;
-		PLONG(p, w[i].addr);
-		k.a = e[i-1];
-		k.n = strlen(e[i-1]);
+		w[i].dirty = 0;
+		s = copystat(w[i].s);
+		unmaxvtime(s->synctime, i ? w[i-1].s->synctime : db->now);
+		if(i == 0){
+			freestat(db->rootstat);
+			db->rootstat = s;
+			db->rootstatdirty = 1;
+			continue;
+		}
+		dbunparsestat(db, s, &v, db->s->addrsize);
+		freestat(s);
+		putaddr(db->s, v.a, w[i].addr);
+		k.a = c->e[i-1];
+		k.n = strlen(c->e[i-1]);
 		if(w[i-1].m->insert(w[i-1].m, &k, &v, DMapCreate|DMapReplace) < 0)
 			panic("dmapinsert: %r");
 		free(v.a);
+		if(w[i].s->state == SNonexistent && w[i].addr == 0)
+			noteghost(db, w[i-1].m, c->e[i-1]);
 	}
-dbg(DbgCache, "writedbwalk done - %lux\n", getcallerpc(&db));
+dbg(DbgCache, "writecursor done - %lux\n", getcallerpc(&c));
 }
 
 /*
- * free the dbwalk and its contents.  note that w[0].m is not ours to free.
+ * rewrite the stat where c points.
  */
 static void
-freedbwalk(Dbwalk *w, int n)
+cursorput(Dbcursor *c, Stat *s)
 {
-	int i;
+	int i, n;
+	Db *db;
+	Dbwalk *w;
+
+	db = c->db;
+	w = c->w;
+	n = c->n;
+	dbg(DbgDb, "cursorput %s %$\n", n ? c->e[n-1] : "<root>", s);
+
+	/* look for weirdness in the map addrs */
+	for(i=0; i<n; i++)
+		if((w[i].m==nil) ^ (w[i].addr==0))
+			fprint(2, "dbputstat m %p addr %llux\n", w[i].m, w[i].addr);
+
+	/* fill in links along the way */
+	for(i=c->nfound; i<n; i++){
+		if(w[i].m == nil){
+			w[i].m = dmapclist(db->listcache, db->s, 0, db->pagesize);
+			w[i].addr = w[i].m->addr;
+			w[i].dirty = 1;
+		}
+	}
+
+	/* the ghosts along the way go in too */
+	for(i=c->nfound+1; i<n; i++)
+		w[i].dirty = 1;
+
+	/* fill in final stat */
+	freestat(w[n].s);
+	w[n].s = copystat(s);
+	w[n].dirty = 1;
+
+	/* fill in modification times */
+	for(i=0; i<n; i++){
+		if(!leqvtime(w[n].s->mtime, w[i].s->mtime)){
+			maxvtime(w[i].s->mtime, w[n].s->mtime);
+			w[i].dirty = 1;
+		}
+	}
+
+	/*
+	 * before the db rewrite which included the down-propagation
+	 * of sync times in dbgetkids, the db scan wouldn't have maxed in
+	 * the parent sync time with the kid sync time when updating 
+	 * the local time entry.
+	 *
+	 * if we are reading a redo2 log from such an old minisync,
+	 * using such a sync time unaltered will fail because the sync
+	 * time is not >= the parent sync time.  make it so.
+	 */
+	if(n>0 && !leqvtime(w[n-1].s->synctime, w[n].s->synctime)){
+		static int first = 1;
+
+		if(first){
+			fprint(2, "database redo log is from pre-May 25 2002 trasrv; coercing sync times\n");
+			first = 0;
+		}
+		maxvtime(w[n].s->synctime, w[n-1].s->synctime);
+	}
+
+	/* write everything back */
+	writecursor(c);
+	c->nfound = n;
+}
+
+/*
+ * rewrite the stats of nk children of where c points,
+ * writing the stats along the path only once.
+ * k[i].addr must be the kid's current list address,
+ * as for dbcursorputkids.
+ */
+static void
+cursorputkids(Dbcursor *c, Kid *k, int nk)
+{
+	int i, n;
+	uvlong addr;
+	Datum key, v;
+	DMap *m;
+	Db *db;
+	Dbwalk *w;
+	Stat *s, *mt;
+	Vtime *vt;
+
+	db = c->db;
+	w = c->w;
+	n = c->n;
+	dbg(DbgDb, "cursorputkids %s %d\n", n ? c->e[n-1] : "<root>", nk);
+
+	/* fill in links along the way, including our own */
+	for(i=c->nfound; i<=n; i++){
+		if(w[i].m == nil){
+			w[i].m = dmapclist(db->listcache, db->s, 0, db->pagesize);
+			w[i].addr = w[i].m->addr;
+			w[i].dirty = 1;
+		}
+	}
+	for(i=c->nfound+1; i<=n; i++)
+		w[i].dirty = 1;
+
+	mt = nil;
+	for(i=0; i<nk; i++){
+		s = copystat(k[i].stat);
+		maxvtime(s->synctime, w[n].s->synctime);
+		if(mt == nil)
+			mt = copystat(s);
+		else
+			maxvtime(mt->mtime, s->mtime);
+
+		/* keep the kid's list, tidied as writecursor would */
+		key.a = k[i].name;
+		key.n = strlen(k[i].name);
+		addr = k[i].addr;
+		if(addr){
+			m = dmapclist(db->listcache, db->s, addr, 0);
+			if(m == nil)
+				panic("cursorputkids: bad list address");
+			vt = copyvtime(s->synctime);
+			unmaxvtime(vt, w[n].s->synctime);
+			ghostbust(db, m, vt);
+			freevtime(vt);
+			if(m->isempty(m)){
+				forgetlist(db, addr);
+				m->free(m);
+				addr = 0;
+			}else
+				m->close(m);
+		}
 
-dbg(DbgCache, "freedbwalk %d\n", n);
-	for(i=0; i<=n; i++){
-		if(i!=0 && w[i].m)
-			w[i].m->close(w[i].m);
-		freestat(w[i].s);
-		free(w[i].v.a);
+		unmaxvtime(s->synctime, w[n].s->synctime);
+		dbunparsestat(db, s, &v, db->s->addrsize);
+		putaddr(db->s, v.a, addr);
+		if(w[n].m->insert(w[n].m, &key, &v, DMapCreate|DMapReplace) < 0)
+			panic("dmapinsert: %r");
+		free(v.a);
+		if(s->state == SNonexistent && addr == 0)
+			noteghost(db, w[n].m, k[i].name);
+		freestat(s);
 	}
-	free(w);
-dbg(DbgCache, "freedbwalk done\n");
+
+	/* fill in modification times */
+	if(mt){
+		for(i=0; i<=n; i++){
+			if(!leqvtime(mt->mtime, w[i].s->mtime)){
+				maxvtime(w[i].s->mtime, mt->mtime);
+				w[i].dirty = 1;
+			}
+		}
+		freestat(mt);
+	}
+
+	writelevels(c);
+	c->nfound = n;
 }
 
 /*
@@ -526,6 +1103,7 @@ walkkids(void *v, Datum *key, Datum *val)
 {
 	struct { Db *db; Kid *k; int nk; int err; } *a;
 	uchar *p;
+	int as;
 
 	a = v;
 	if(a->err)
@@ -534,18 +1112,23 @@ walkkids(void *v, Datum *key, Datum *val)
 		a->k = erealloc(a->k, (a->nk+16)*sizeof(Kid));
 	a->k[a->nk].name = emalloc(key->n+1);
 	memmove(a->k[a->nk].name, key->a, key->n);
-	if(val->n <= 4)
+	as = a->db->s->addrsize;
+	if(val->n <= as)
 		panic("walkkids: bad db format");
 	p = val->a;
-	a->k[a->nk].addr = LONG(p);
-	a->k[a->nk].stat = dbparsestat(a->db, (uchar*)val->a+4, val->n-4);
+	a->k[a->nk].addr = getaddr(a->db->s, p);
+	a->k[a->nk].stat = dbparsestat(a->db, p+as, val->n-as);
 	if(a->k[a->nk].stat == nil)
 		panic("walkkids: bad stat format");
 	a->nk++;
 }
 
+/*
+ * with prefetch set, start reading the kids' lists too;
+ * only whole-tree walks like dumptree want that.
+ */
 static int
-kidsinmap(Db *db, DMap *m, Kid **pk)
+kidsinmap(Db *db, DMap *m, Kid **pk, int prefetch)
 {
 	struct { Db *db; Kid *k; int nk; int err; } a;
 
@@ -553,28 +1136,150 @@ kidsinmap(Db *db, DMap *m, Kid **pk)
 	a.db = db;
 	m->walk(m, walkkids, &a);
 	*pk = a.k;
+	if(prefetch)
+		dbprefetchkids(db, a.k, a.nk);
+	return a.nk;
+}
+
+/*
+ * whoever asked for the kids is likely to look inside
+ * the directories among them next; start reading their
+ * lists now.
+ */
+void
+dbprefetchkids(Db *db, Kid *k, int nk)
+{
+	int i, n;
+	uvlong *a;
+
+	if(nk == 0)
+		return;
+	a = emallocnz(nk*sizeof(a[0]));
+	n = 0;
+	for(i=0; i<nk; i++)
+		if(k[i].addr)
+			a[n++] = k[i].addr;
+	if(n)
+		dstoreprefetch(db->s, a, n);
+	free(a);
+}
+
+/*
+ * create a list of kid views from the map m.  the names and
+ * stored stats are copied into one block after the array, so
+ * the whole list is a single allocation.  while walking, the
+ * pointers hold offsets into a.buf.  prefetch is as in kidsinmap.
+ */
+typedef struct Viewwalk Viewwalk;
+struct Viewwalk
+{
+	Db *db;
+	Kidview *k;
+	int nk;
+	uchar *buf;
+	int nbuf;
+	int abuf;
+};
+
+static void
+walkkidviews(void *v, Datum *key, Datum *val)
+{
+	int as, n;
+	uchar *p;
+	Kidview *k;
+	Viewwalk *a;
+
+	a = v;
+	as = a->db->s->addrsize;
+	if(val->n <= as+2)
+		panic("walkkidviews: bad db format");
+	p = val->a;
+	if(a->nk%64 == 0)
+		a->k = erealloc(a->k, (a->nk+64)*sizeof a->k[0]);
+	n = key->n+1 + val->n-as;
+	if(a->nbuf+n > a->abuf){
+		a->abuf = 2*a->abuf + n + 1024;
+		a->buf = erealloc(a->buf, a->abuf);
+	}
+	k = &a->k[a->nk++];
+	k->name = (char*)(intptr)a->nbuf;
+	memmove(a->buf+a->nbuf, key->a, key->n);
+	a->buf[a->nbuf+key->n] = 0;
+	a->nbuf += key->n+1;
+	k->addr = getaddr(a->db->s, p);
+	k->v.db = a->db;
+	k->v.a = (uchar*)(intptr)a->nbuf;
+	k->v.n = val->n-as;
+	k->v.up = nil;
+	memmove(a->buf+a->nbuf, p+as, k->v.n);
+	a->nbuf += k->v.n;
+}
+
+static int
+kidviewsinmap(Db *db, DMap *m, Vtime *up, Kidview **pk, int prefetch)
+{
+	int i, n;
+	uchar *p;
+	uvlong *addr;
+	Kidview *k;
+	Viewwalk a;
+
+	memset(&a, 0, sizeof a);
+	a.db = db;
+	m->walk(m, walkkidviews, &a);
+	if(a.nk == 0){
+		free(a.buf);
+		*pk = nil;
+		return 0;
+	}
+	k = emallocnz(a.nk*sizeof k[0] + a.nbuf);
+	p = (uchar*)(k+a.nk);
+	memmove(p, a.buf, a.nbuf);
+	memmove(k, a.k, a.nk*sizeof k[0]);
+	free(a.buf);
+	free(a.k);
+	if(up)
+		up = copyvtime(up);
+	addr = nil;
+	if(prefetch)
+		addr = emallocnz(a.nk*sizeof addr[0]);
+	n = 0;
+	for(i=0; i<a.nk; i++){
+		k[i].name = (char*)p + (intptr)k[i].name;
+		k[i].v.a = p + (intptr)k[i].v.a;
+		k[i].v.up = up;
+		if(prefetch && k[i].addr)
+			addr[n++] = k[i].addr;
+	}
+	if(n)
+		dstoreprefetch(db->s, addr, n);
+	free(addr);
+	*pk = k;
 	return a.nk;
 }
 
+void
+freekidviews(Kidview *k, int nk)
+{
+	if(k == nil)
+		return;
+	if(nk > 0)
+		freevtime(k[0].v.up);
+	free(k);
+}
+
 /*
  * look up the stat information for the given path.
  */
 int
 dbgetstat(Db *db, char **e, int ne, Stat **ps)
 {
-	int n;
-	Dbwalk *w;
-
-	n = dbwalk(db, e, ne, &w);
-
-	if(n == ne){
-		*ps = w[n].s;
-		w[n].s = nil;
-	}else
-		/* invent ghost if necessary */
-		*ps = mkghoststat(w[n].s->synctime);
+	Dbcursor *c;
 
-	freedbwalk(w, n);
+	c = dbcursor(db, e, ne);
+	*ps = c->w[ne].s;
+	c->w[ne].s = nil;
+	dbclosecursor(c);
 dbg(DbgCache, "dbgetstat - done %d - %lux\n", ne, getcallerpc(&db));
 	return ne;
 }
@@ -585,73 +1290,162 @@ dbg(DbgCache, "dbgetstat - done %d - %lux\n", ne, getcallerpc(&db));
 static int
 _dbputstat(Db *db, char **e, int ne, Stat *s)
 {
-	int i, n;
-	Dbwalk *w;
+	Dbcursor *c;
 
-	dbg(DbgDb, "_dbputstat %s %$\n", ne ? e[ne-1] : "<root>", s);
+	c = dbcursor(db, e, ne);
+	cursorput(c, s);
+	dbclosecursor(c);
+dbg(DbgCache, "_dbputstat - ret %lux\n", getcallerpc(&db));
+	return 0;
+}
 
-	n = dbwalk(db, e, ne, &w);
-	if(n == ne)
-		freestat(w[n].s);
+/*
+ * ghostbust walks the whole list, so for each list busted we
+ * remember the sync time it was busted with and the names of
+ * the ghosts written into it since.  a child written since was
+ * trimmed against its parent's full sync time, which covers vt
+ * while vt stays the same, so trimming it again changes nothing;
+ * only the new ghosts need looking at.  a list that has had too
+ * many ghosts written, or that we don't remember, gets the walk.
+ */
+enum
+{
+	BustHash = 256,
+	BustMax = 4096,	/* lists remembered */
+	BustGhosts = 32,	/* ghosts remembered per list */
+};
 
-	/* look for weirdness in the map addrs */
-	for(i=0; i<ne; i++)
-		if((w[i].m==nil) ^ (w[i].addr==0))
-			fprint(2, "dbputstat m %p addr %ux\n", w[i].m, w[i].addr);
+struct Dbbust
+{
+	uvlong addr;
+	Vtime *vt;
+	char *ghost[BustGhosts];
+	int nghost;	/* -1 if more than BustGhosts */
+	Dbbust *next;
+};
 
-	/* fill in links along the way */
-	for(i=n; i<ne; i++){
-		if(w[i].m == nil){
-			w[i].m = dmapclist(db->listcache, db->s, 0, db->pagesize);
-			w[i].addr = w[i].m->addr;
-			w[i].dirty = 1;
-		}
-	}
+static Dbbust**
+lookbust(Db *db, uvlong addr)
+{
+	Dbbust **l;
 
-	/* fill in stats along the way */
-	for(i=n+1; i<ne; i++){
-		w[i].s = mkghoststat(w[i-1].s->synctime);
-		w[i].dirty = 1;
-	}
+	if(db->bust == nil)
+		db->bust = emalloc(BustHash*sizeof db->bust[0]);
+	for(l=&db->bust[addr%BustHash]; *l; l=&(*l)->next)
+		if((*l)->addr == addr)
+			break;
+	return l;
+}
 
-	/* fill in final stat */
-	w[ne].s = copystat(s);
-	w[ne].dirty = 1;
+static void
+clearghosts(Dbbust *b)
+{
+	int i;
 
-	/* fill in modification times */
-	for(i=0; i<ne; i++){
-		if(!leqvtime(w[ne].s->mtime, w[i].s->mtime)){
-			maxvtime(w[i].s->mtime, w[ne].s->mtime);
-			w[i].dirty = 1;
-		}
-	}
+	for(i=0; i<b->nghost; i++)
+		free(b->ghost[i]);
+	b->nghost = 0;
+}
 
-	/*
-	 * before the db rewrite which included the down-propagation
-	 * of sync times in dbgetkids, the db scan wouldn't have maxed in
-	 * the parent sync time with the kid sync time when updating 
-	 * the local time entry.
-	 *
-	 * if we are reading a redo2 log from such an old minisync,
-	 * using such a sync time unaltered will fail because the sync
-	 * time is not >= the parent sync time.  make it so.
-	 */
-	if(ne>0 && !leqvtime(w[ne-1].s->synctime, w[ne].s->synctime)){
-		static int first = 1;
+static void
+freebust(Dbbust *b)
+{
+	clearghosts(b);
+	freevtime(b->vt);
+	free(b);
+}
 
-		if(first){
-			fprint(2, "database redo log is from pre-May 25 2002 trasrv; coercing sync times\n");
-			first = 0;
+static void
+freebusts(Db *db)
+{
+	int i;
+	Dbbust *b, *next;
+
+	if(db->bust == nil)
+		return;
+	for(i=0; i<BustHash; i++)
+		for(b=db->bust[i]; b; b=next){
+			next = b->next;
+			freebust(b);
 		}
-		maxvtime(w[ne].s->synctime, w[ne-1].s->synctime);
+	free(db->bust);
+	db->bust = nil;
+	db->nbust = 0;
+}
+
+/*
+ * the list at addr is being freed; its address may be reused.
+ */
+static void
+forgetbust(Db *db, uvlong addr)
+{
+	Dbbust *b, **l;
+
+	l = lookbust(db, addr);
+	if((b = *l) == nil)
+		return;
+	*l = b->next;
+	freebust(b);
+	db->nbust--;
+}
+
+/*
+ * a ghost named name has been written into m.
+ */
+static void
+noteghost(Db *db, DMap *m, char *name)
+{
+	Dbbust *b;
+
+	if((b = *lookbust(db, m->addr)) == nil || b->nghost < 0)
+		return;
+	if(b->nghost == BustGhosts){
+		clearghosts(b);
+		b->nghost = -1;
+		return;
 	}
+	b->ghost[b->nghost++] = estrdup(name);
+}
 
-	/* write everything back */
-	writedbwalk(db, w, e, ne);
-dbg(DbgCache, "Freedbwalk\n");
-	freedbwalk(w, ne);
-dbg(DbgCache, "_dbputstat - ret %lux\n", getcallerpc(&db));
-	return 0;
+/*
+ * remove the ghosts named in b from m if they are still
+ * ghosts with sync time <= vt.
+ */
+static void
+bustnoted(Db *db, DMap *m, Dbbust *b, Vtime *vt)
+{
+	int i, as;
+	Datum key, val;
+	Statview v;
+	Vtime *t;
+
+	as = db->s->addrsize;
+	for(i=0; i<b->nghost; i++){
+ghostlooks++;
+		key.a = b->ghost[i];
+		key.n = strlen(b->ghost[i]);
+		val.a = nil;
+		val.n = 0;
+		if(m->lookup(m, &key, &val) < 0)
+			continue;
+		if(val.n <= as+2)
+			panic("ghostbust: bad db format");
+		v.db = db;
+		v.a = (uchar*)val.a+as;
+		v.n = val.n-as;
+		v.up = nil;
+		t = nil;
+		if(getaddr(db->s, val.a) == 0 && dbviewstate(&v) == SNonexistent
+		&& leqvtime(t = dbviewsynctime(&v), vt)){
+			dbg(DbgGhost, "ghost for %s / %V removed; parent %V\n",
+				b->ghost[i], t, vt);
+			if(m->delete(m, &key) < 0)
+				panic("ghostbust delete: %r");
+		}
+		freevtime(t);
+		free(val.a);
+	}
+	clearghosts(b);
 }
 
 /*
@@ -666,66 +1460,126 @@ ghostbust(Db *db, DMap *m, Vtime *vt)
 {
 	int i, n;
 	uchar *p;
-	Kid *k;
+	Kidview *k;
 	Datum key, val;
+	Dbbust *b, **l;
+	Vtime *t;
 
-	n = kidsinmap(db, m, &k);
-	for(i=0; i<n; i++){
-		// fprint(2, "%p %d %s...\n", m, i, k[i].name);
-		if(k[i].stat->state == SNonexistent
-		&& k[i].addr == 0
-		&& leqvtime(k[i].stat->synctime, vt)){
-			dbg(DbgGhost, "ghost for %s / %V removed; parent %V\n\t%$",
-				k[i].name, k[i].stat->synctime, vt, k[i].stat);
-			key.a = k[i].name;
-			key.n = strlen(k[i].name);
-			if(m->delete(m, &key) < 0)
-				panic("ghostbust delete: %r");
-			continue;
+	l = lookbust(db, m->addr);
+	if((b = *l) != nil && b->nghost >= 0 && leqvtime(b->vt, vt) && leqvtime(vt, b->vt)){
+		bustnoted(db, m, b, vt);
+		return;
+	}
+	if(b == nil){
+		if(db->nbust >= BustMax){
+			freebusts(db);
+			l = lookbust(db, m->addr);
 		}
-		maxvtime(k[i].stat->synctime, vt);
-		unmaxvtime(k[i].stat->synctime, vt);
-		/* write back */
+		b = emalloc(sizeof *b);
+		b->addr = m->addr;
+		*l = b;
+		db->nbust++;
+	}
+	clearghosts(b);
+	freevtime(b->vt);
+	b->vt = copyvtime(vt);
+
+ghostwalks++;
+	n = kidviewsinmap(db, m, nil, &k, 0);
+	for(i=0; i<n; i++){
 		key.a = k[i].name;
 		key.n = strlen(k[i].name);
-		dbunparsestat(db, k[i].stat, &val, 4);
+		if(k[i].addr == 0 && dbviewstate(&k[i].v) == SNonexistent){
+			t = dbviewsynctime(&k[i].v);
+			if(leqvtime(t, vt)){
+				dbg(DbgGhost, "ghost for %s / %V removed; parent %V\n",
+					k[i].name, t, vt);
+				freevtime(t);
+				if(m->delete(m, &key) < 0)
+					panic("ghostbust delete: %r");
+				continue;
+			}
+			freevtime(t);
+		}
+		/* write back only what trimming changed */
+		if(!viewtrimsynctime(&k[i].v, vt, &val, db->s->addrsize))
+			continue;
 		p = val.a;
-		PLONG(p, k[i].addr);
-		// fprint(2, "wb %d...", val.n);
+		putaddr(db->s, p, k[i].addr);
 		if(m->insert(m, &key, &val, DMapReplace) < 0)
 			panic("ghostbust replace: %r");
 		free(val.a);
 	}
-	freekids(k, n);
+	freekidviews(k, n);
 }
 
 /* 
  * return the names and stat information for the children
- * of the named path.
+ * of where c points.
  */
 int
-dbgetkids(Db *db, char **e, int ne, Kid **pk)
+dbcursorkids(Dbcursor *c, Kid **pk)
 {
-	int i, n, nk;
+	int i, nk;
 	Kid *k;
 	Dbwalk *w;
 
-	n = dbwalk(db, e, ne, &w);
+	w = &c->w[c->n];
+	if(w->m == nil){
+		*pk = nil;
+		return 0;
+	}
+	k = nil;
+	nk = kidsinmap(c->db, w->m, &k, 0);
+	/* down-propagate sync times */
+	for(i=0; i<nk; i++)
+		maxvtime(k[i].stat->synctime, w->s->synctime);
+	*pk = k;
+	return nk;
+}
+
+/*
+ * like dbcursorkids, but the stats are left as stored
+ * and decoded only as the caller asks for them.
+ */
+int
+dbcursorkidviews(Dbcursor *c, Kidview **pk)
+{
+	Dbwalk *w;
 
-	if(w[ne].m == nil){
+	w = &c->w[c->n];
+	if(w->m == nil){
 		*pk = nil;
-		nk = 0;
-	}else{
-		k = nil;
-		nk = kidsinmap(db, w[ne].m, &k);
-		/* down-propagate sync times */
-		for(i=0; i<nk; i++)
-			maxvtime(k[i].stat->synctime, w[ne].s->synctime);
-		if(k)
-			setmalloctag(k, getcallerpc(&db));
-		*pk = k;
-	}
-	freedbwalk(w, n);
+		return 0;
+	}
+	return kidviewsinmap(c->db, w->m, w->s->synctime, pk, 0);
+}
+
+int
+dbgetkids(Db *db, char **e, int ne, Kid **pk)
+{
+	int nk;
+	Dbcursor *c;
+
+	c = dbcursor(db, e, ne);
+	nk = dbcursorkids(c, pk);
+	if(*pk)
+		setmalloctag(*pk, getcallerpc(&db));
+	dbclosecursor(c);
+	return nk;
+}
+
+int
+dbgetkidviews(Db *db, char **e, int ne, Kidview **pk)
+{
+	int nk;
+	Dbcursor *c;
+
+	c = dbcursor(db, e, ne);
+	nk = dbcursorkidviews(c, pk);
+	if(*pk)
+		setmalloctag(*pk, getcallerpc(&db));
+	dbclosecursor(c);
 	return nk;
 }
 
@@ -765,29 +1619,34 @@ _dbputmeta(Db *db, char *key, char *val)
 /*
  * Log changes to the database so we can replay them if
  * we get killed before writing the real db back out to disk.
+ *
+ * Records collect in logbuf, which costs only a copy, and go
+ * out as a group when it fills, at logflush, or before a
+ * checkpoint.  A group is a 12-byte header (length, checksum
+ * of the records, time), the records, and the header again,
+ * all in one write.  A crash can tear only the last group, and
+ * dbapplylog stops at the first group that does not check.
  */
 static void
 dbflushit(Db *db)
 {
 	int n;
-	int x;
-	uchar hdr[12];
+	ulong x;
+	uchar *hdr;
 
 	n = db->logbuf->p - db->logbase;
+	if(n == 0)	/* dbapplylog stops at an empty record */
+		return;
+	hdr = db->logbase-12;	/* genopendb leaves room on both sides */
 	PLONG(hdr, n);
-	x = random();
+	x = crc32c(0, db->logbase, n);
 	PLONG(hdr+4, x);
 	x = time(0);
 	PLONG(hdr+8, x);
-	if(write(db->logfd, hdr, 12) != 12)
+	memmove(db->logbase+n, hdr, 12);
+	if(write(db->logfd, hdr, 12+n+12) != 12+n+12)
 		sysfatal("writing db log: %r");
-	if(write(db->logfd, db->logbase, n) != n)
-		sysfatal("writing db log: %r");
-	if(0 && fsync(db->logfd) < 0)
-		sysfatal("syncing db log: %r");
-	if(write(db->logfd, hdr, 12) != 12)
-		sysfatal("writing db log: %r");
-	if(0 && fsync(db->logfd) < 0)
+	if(db->durability && fdatasync(db->logfd) < 0)
 		sysfatal("syncing db log: %r");
 	db->logbuf->p = db->logbase;
 }
@@ -798,29 +1657,53 @@ logflush(Db *db)
 	dbflushit(db);
 }
 
+/*
+ * add a record to the log.  for LogPutstat, e is the path;
+ * for LogPutmeta, e[0] and e[1] are the key and value; for
+ * LogDelmeta, e[0] is the key.
+ */
 static void
-logit(Db *db, Buf *b)
+logit(Db *db, int op, char **e, int ne, Stat *s)
 {
-	int n;
+	int i;
+	uchar *p;
+	Buf *b;
+	volatile int full;
 
-return;
-/*
-	if(db->ignwr){
-		free(b);
+	if(db->ignwr)
 		return;
-	}
-*/
+	dstorechanged(db->s);
 
-	n = b->ep - b->p;
-	if(db->logbuf->ep - db->logbuf->p < n)
+	b = db->logbuf;
+	p = b->p;
+	full = 0;
+	if(setjmp(b->jmp)){
+		/* no room: send out what we have and try again */
+		if(full || p == db->logbase)
+			panic("dblogit");
+		full = 1;
+		b->p = p;
 		dbflushit(db);
-	if(db->logbuf->ep - db->logbuf->p < n)
-		panic("dblogit");
-//fprint(2, "LOG %.*H\n", b->ep - b->p, b->p);
-	memmove(db->logbuf->p, b->p, n);
-	free(b);
-	db->logbuf->p += n;
-	if(db->alwaysflush)
+	}
+	writebufc(b, op);
+	switch(op){
+	default:
+		panic("dblogit op %d", op);
+	case LogPutmeta:
+		writebufstring(b, e[0]);
+		writebufstring(b, e[1]);
+		break;
+	case LogDelmeta:
+		writebufstring(b, e[0]);
+		break;
+	case LogPutstat:
+		writebufl(b, ne);
+		for(i=0; i<ne; i++)
+			writebufstring(b, e[i]);
+		writebufstat(b, s);
+		break;
+	}
+	if(db->alwaysflush || db->durability == DSyncStrict)
 		dbflushit(db);
 }
 
@@ -834,101 +1717,80 @@ _dbdelmeta(Db *db, char *key)
 	return db->meta->delete(db->meta, &k);
 }
 
-static Buf*
-putstatbuf(char **e, int ne, Stat *st)
-{
-	int i;
-	Buf *b, s;
-
-	memset(&s, 0, sizeof s);
-	if(setjmp(s.jmp))
-		panic("putstatbuf");
-	writebufc(&s, LogPutstat);
-	writebufl(&s, ne);
-	for(i=0; i<ne; i++)
-		writebufstring(&s, e[i]);
-	writebufstat(&s, st);
-
-	b = mkbuf(nil, (intptr)s.p);
-	writebufc(b, LogPutstat);
-	writebufl(b, ne);
-	for(i=0; i<ne; i++)
-		writebufstring(b, e[i]);
-	writebufstat(b, st);
-	if(b->ep != b->p)
-		panic("putstatbuf0");
-	b->p = (uchar*)&b[1];
-	return b;
-}
-
 int
 dbputstat(Db *db, char **e, int ne, Stat *s)
 {
 	if(_dbputstat(db, e, ne, s) < 0)
 		return -1;
 dbg(DbgCache, "dbputstat logit\n");
-	logit(db, putstatbuf(e, ne, s));
+	logit(db, LogPutstat, e, ne, s);
 dbg(DbgCache, "dbputstat logit done - %lux\n", getcallerpc(&db));
+	dbcheckpoint(db);
 	return 0;
 }
 
-static Buf*
-putmetabuf(char *key, char *val)
+/*
+ * rewrite the stat where c points.
+ */
+int
+dbcursorput(Dbcursor *c, Stat *s)
 {
-	Buf *b, s;
+	cursorput(c, s);
+	logit(c->db, LogPutstat, c->e, c->n, s);
+	dbcheckpoint(c->db);
+	return 0;
+}
 
-	memset(&s, 0, sizeof s);
-	if(setjmp(s.jmp))
-		panic("putmetabuf");
-	writebufc(&s, LogPutmeta);
-	writebufstring(&s, key);
-	writebufstring(&s, val);
+/*
+ * rewrite the stats of nk children of where c points,
+ * as nk calls to dbcursordown, dbcursorput, and dbcursorup
+ * would, but touching the directory's list and the stats
+ * above it only once.  c is left where it was.  k[i].addr
+ * must be the kid's list address as the db has it, 0 for
+ * a new kid or one without a list (see dbcursorkidviews),
+ * so the kids need not be looked up again.
+ */
+int
+dbcursorputkids(Dbcursor *c, Kid *k, int nk)
+{
+	int i;
+	char **e;
 
-	b = mkbuf(nil, s.p-(uchar*)nil);
-	writebufc(b, LogPutmeta);
-	writebufstring(b, key);
-	writebufstring(b, val);
-	if(b->ep != b->p)
-		panic("putmetabuf0");
-	b->p = (uchar*)&b[1];
-	return b;
+	if(nk == 0)
+		return 0;
+	cursorputkids(c, k, nk);
+	e = emalloc((c->n+1)*sizeof e[0]);
+	memmove(e, c->e, c->n*sizeof e[0]);
+	for(i=0; i<nk; i++){
+		e[c->n] = k[i].name;
+		logit(c->db, LogPutstat, e, c->n+1, k[i].stat);
+	}
+	free(e);
+	dbcheckpoint(c->db);
+	return 0;
 }
 
 int
 dbputmeta(Db *db, char *key, char *val)
 {
+	char *kv[2];
+
 	if(_dbputmeta(db, key, val) < 0)
 		return -1;
-	logit(db, putmetabuf(key, val));
+	kv[0] = key;
+	kv[1] = val;
+	logit(db, LogPutmeta, kv, 2, nil);
+	dbcheckpoint(db);
 	return 0;
 }
 
-static Buf*
-delmetabuf(char *key)
-{
-	Buf *b, s;
-
-	memset(&s, 0, sizeof s);
-	if(setjmp(s.jmp))
-		panic("delmetabuf");
-	writebufc(&s, LogDelmeta);
-	writebufstring(&s, key);
-
-	b = mkbuf(nil, (intptr)s.p);
-	writebufc(b, LogDelmeta);
-	writebufstring(b, key);
-	if(b->ep != b->p)
-		panic("delmetabuf0");
-	b->p = (uchar*)&b[1];
-	return b;
-}
-
 int
 dbdelmeta(Db *db, char *key)
 {
 	if(_dbdelmeta(db, key) < 0)
 		return -1;
-	logit(db, delmetabuf(key));
+	logit(db, LogDelmeta, &key, 1, nil);
+	dbcheckpoint(db);
 	return 0;
 }
 
@@ -954,11 +1816,61 @@ dbresetlog(Db *db)
 {
 	if(seek(db->logfd, 0, 0) < 0
 	|| write(db->logfd, "XXXXXXXXXXXX", 12) != 12
-	|| ftruncate(db->logfd, 0) < 0)
+	|| ftruncate(db->logfd, 0) < 0
+	|| seek(db->logfd, 0, 0) < 0)	/* next group goes at the start */
 		return -1;
 	return 0;
 }
 
+/*
+ * called by the store's flush with the store locked, once
+ * the pages are written; see dstoreonflush.
+ */
+static int
+logflushed(void *v)
+{
+	return dbresetlog(v);
+}
+
+/*
+ * The block store wants its dirty pages written, either
+ * because they fill the page cache or because enough has
+ * changed since the last checkpoint.  Between operations
+ * the db is consistent, so write it out the same way
+ * closedb does; after that the log has nothing left to replay.
+ * The store resets the log before it unlocks, so a snapshot
+ * reader (see opendbsnap) never replays old groups over the
+ * new pages.
+ */
+static void
+dbcheckpoint(Db *db)
+{
+	if(db->breakwrite || !dstoreneedflush(db->s))
+		return;
+	dbg(DbgCache, "dbcheckpoint\n");
+	dbflushit(db);	/* log reaches the disk before any page does */
+	if(compactsome(db) < 0)
+		sysfatal("checkpoint: compacting: %r");
+	flushlistcache(db->listcache);
+	dstoreonflush(db->s, logflushed, db);
+	if(flushdb(db) < 0)
+		sysfatal("checkpoint: %r");
+}
+
+/*
+ * called between requests when there is nothing else to do.
+ * checkpoint if one is due and return the seconds until
+ * the next will be, or -1 if there is nothing to write.
+ */
+long
+dbidle(Db *db)
+{
+	if(db->breakwrite)
+		return -1;
+	dbcheckpoint(db);
+	return dstoreckptdue(db->s);
+}
+
 static int
 dbapplylog(Db *db)
 {
@@ -967,8 +1879,10 @@ dbapplylog(Db *db)
 	Buf *b;
 	char *k, *v, **e;
 	volatile int first, changes, me;
+	Dbcursor *c;
 	Stat *s;
 
+	c = nil;
 	changes = 0;
 	b = db->logbuf;
 	e = nil;
@@ -995,6 +1909,8 @@ dbapplylog(Db *db)
 //fprint(2, "chk...");
 		if(memcmp(hdr, hdr0, 12) != 0)
 			break;
+		if(crc32c(0, db->logbase, n) != LONG(hdr+4))
+			break;
 
 //fprint(2, "log...\n");
 
@@ -1006,7 +1922,8 @@ dbapplylog(Db *db)
 		b->p = db->logbase;
 		b->ep = b->p + n;
 		if(first){
-			fprint(2, "database not closed properly; applying operation redo log\n");
+			if(!db->snap)
+				fprint(2, "database not closed properly; applying operation redo log\n");
 			first = 0;
 		}
 		if(setjmp(b->jmp))
@@ -1021,13 +1938,13 @@ dbapplylog(Db *db)
 			case LogPutmeta:
 				k = readbufstring(b);
 				v = readbufstring(b);
-fprint(2, "log putmeta %s %s\n", k, v);
+if(!db->snap) fprint(2, "log putmeta %s %s\n", k, v);
 				_dbputmeta(db, k, v);
 				changes = 1;
 				break;
 			case LogDelmeta:
 				k = readbufstring(b);
-fprint(2, "log delmeta %s\n", k);
+if(!db->snap) fprint(2, "log delmeta %s\n", k);
 				_dbdelmeta(db, k);
 				changes = 1;
 				break;
@@ -1048,7 +1965,20 @@ for(i=ne-1; i>=0; i--)
 fprint(2, "log putstat %P %$\n", p, s);
 freepath(p);
 }
-				_dbputstat(db, e, ne, s);
+				/*
+				 * the records of a scan come in tree order;
+				 * move one cursor only as far as each one needs.
+				 */
+				if(c == nil)
+					c = dbcursor(db, nil, 0);
+				for(i=0; i<c->n && i<ne; i++)
+					if(strcmp(c->e[i], e[i]) != 0)
+						break;
+				while(c->n > i)
+					dbcursorup(c);
+				for(; i<ne; i++)
+					dbcursordown(c, e[i]);
+				cursorput(c, s);
 dbg(DbgCache, "done dbputstat\n");
 				freestat(s);
 				changes = 1;
@@ -1057,6 +1987,8 @@ dbg(DbgCache, "done dbputstat\n");
 		}
 	}
 //fprint(2, "out\n");
+	if(c)
+		dbclosecursor(c);
 	if(changes)
 		return flushdb(db);
 	return 0;
@@ -1068,16 +2000,16 @@ namedmap(Db *db, char *s)
 {
 	char *q, *qq, buf[32];
 	DMap *m;
-	u32int a;
+	uvlong a;
 
 	if((q=dbgetmeta(db, s)) == nil){
 		m = dmapclist(db->listcache, db->s, 0, db->pagesize);
-		snprint(buf, sizeof buf, "%ud", m->addr);
+		snprint(buf, sizeof buf, "%llud", m->addr);
 		m->close(m);
 		_dbputmeta(db, s, buf);
 		q = estrdup(buf);
 	}
-	if((a = strtol(q, &qq, 10)) == 0 || *qq != '\0'){
+	if((a = strtoull(q, &qq, 10)) == 0 || *qq != '\0'){
 		werrstr("bad %s address '%s'", s, q);
 		fprint(2, "bad address %s\n", q);
 		return nil;
@@ -1125,9 +2057,16 @@ dbreadnow(Db *db)
   	return nil;
 }
 
-/* addr is zero iff Db is being created from scratch */
+/*
+ * the super block is
+ *	"DBHD" pagesize(4) root meta rootstat
+ * with each pointer s->addrsize bytes.
+ * addr is zero iff Db is being created from scratch.
+ */
+#define SUPERSIZE(s)	(4+4+3*(s)->addrsize)
+
 static Db*
-genopendb(char *path, DStore *s, u32int addr, int pagesize)
+genopendb(char *path, DStore *s, uvlong addr, int pagesize, int snap)
 {
 	char err[ERRMAX];
 	char *logpath;
@@ -1136,14 +2075,15 @@ genopendb(char *path, DStore *s, u32int addr, int pagesize)
 	DMap *root, *meta;
 	Listcache *lc;
 	uchar *p;
-	u32int a;
+	uvlong a;
 	int logfd;
 
 	root = nil;
 	meta = nil;
 	lc = openlistcache();
+	listcachebigdir(lc, snap ? 0 : BigDir);
 	if(addr == 0){
-		super = s->alloc(s, 20);
+		super = s->alloc(s, SUPERSIZE(s));
 		if(super == nil)
 			return nil;
 		p = super->a;
@@ -1157,8 +2097,8 @@ genopendb(char *path, DStore *s, u32int addr, int pagesize)
 			closelistcache(lc);
 			return nil;
 		}
-		PLONG(p, root->addr);
-		p += 4;
+		putaddr(s, p, root->addr);
+		p += s->addrsize;
 		meta = dmapclist(lc, s, 0, pagesize);
 		if(meta==nil){
 			root->free(root);
@@ -1166,9 +2106,9 @@ genopendb(char *path, DStore *s, u32int addr, int pagesize)
 			closelistcache(lc);
 			return nil;
 		}
-		PLONG(p, meta->addr);
-		p += 4;
-		PLONG(p, 0);
+		putaddr(s, p, meta->addr);
+		p += s->addrsize;
+		putaddr(s, p, 0);
 		root->flush(root);
 		meta->flush(meta);
 	}else{
@@ -1176,7 +2116,7 @@ genopendb(char *path, DStore *s, u32int addr, int pagesize)
 			closelistcache(lc);
 			return nil;
 		}
-		if(super->n != 20 || memcmp(super->a, "DBHD", 4) != 0){
+		if(super->n != SUPERSIZE(s) || memcmp(super->a, "DBHD", 4) != 0){
 			super->close(super);
 			werrstr("bad superblock");
 			closelistcache(lc);
@@ -1186,6 +2126,8 @@ genopendb(char *path, DStore *s, u32int addr, int pagesize)
 	db = emalloc(sizeof(Db));
 	db->logfd = -1;
 	db->s = s;
+	db->snap = snap;
+	db->ignwr = snap;
 	db->addr = super->addr;
 	p = super->a;
 	p += 4;	/* DBHD */
@@ -1194,9 +2136,10 @@ genopendb(char *path, DStore *s, u32int addr, int pagesize)
 	p += 4;
 
 	db->listcache = lc;
+	db->bigdir = BigDir;
 
-	a = LONG(p);
-	p += 4;
+	a = getaddr(s, p);
+	p += s->addrsize;
 	if(a == 0){
 		strcpy(err, "bad root directory pointer");
 	Err:
@@ -1215,8 +2158,8 @@ genopendb(char *path, DStore *s, u32int addr, int pagesize)
 	if((db->root = dmapclist(db->listcache, s, a, 0)) == nil)
 		goto Err;
 
-	a = LONG(p);
-	p += 4;
+	a = getaddr(s, p);
+	p += s->addrsize;
 	if(a == 0){
 		strcpy(err, "bad meta db pointer");
 	Err1:
@@ -1238,8 +2181,9 @@ fprint(2, "no strtoid");
 fprint(2, "no idtostr");
 		goto Rerr2;
 }
+	db->strtab = loadstrtab(db);
 
-	a = LONG(p);
+	a = getaddr(s, p);
 	if(a == 0){
 		db->rootstat = nil;
 		db->rootstatblock = nil;
@@ -1251,6 +2195,7 @@ fprint(2, "rootstat block %p\n", db->rootstatblock);
 			rerrstr(err, sizeof err);
 		Err2:
 			fprint(2, "err %s\n", err);
+			freestrtab(db->strtab);
 			if(db->strtoid)
 				db->strtoid->close(db->strtoid);
 			if(db->idtostr)
@@ -1276,24 +2221,39 @@ fprint(2, "rootstat block %p\n", db->rootstatblock);
 		snprint(err, sizeof err, "logpath: %r");
 		goto Err2;
 	}
-	if((logfd = open(logpath, ORDWR|OLOCK)) < 0){
+	if((logfd = open(logpath, snap ? OREAD : ORDWR|OLOCK)) < 0){
 		snprint(err, sizeof err, "open %s: %r", logpath);
 		goto Err2;
 	}
 	db->logfd = logfd;
-	db->logbuf = mkbuf(nil, LogSize);
-	db->logbase = db->logbuf->p;
+	db->logbuf = mkbuf(nil, 12+LogSize+12);	/* see dbflushit */
+	db->logbase = db->logbuf->p+12;
 	if(a != 0 && dbapplylog(db) < 0){	/* run recovery on extant db */
 		snprint(err, sizeof err, "dbapplylog: %r");
 		goto Err2;
 	}
 	db->logbuf->p = db->logbase;
 	db->logbuf->ep = db->logbase + LogSize;
+	if(snap){
+		/*
+		 * the store is as of the writer's last checkpoint and
+		 * the log has everything since, so the replay above
+		 * brought us up to date; let the writer go on.
+		 */
+		close(logfd);
+		db->logfd = -1;
+		dstoresnapready(s);
+		return db;
+	}
 	seek(logfd, 0, 0);
 	write(logfd, "XXXXXXXXXXXX", 12);
 	seek(logfd, 0, 0);
 	ftruncate(logfd, 0);
 	db->breakwrite = config("testdblog");
+	if(config("syncstrict"))
+		dbdurability(db, DSyncStrict);
+	else if(config("syncgroup"))
+		dbdurability(db, DSyncGroup);
 	return db;
 }
 
@@ -1310,7 +2270,7 @@ createdb(char *path, int pagesize)
 	if(s == nil)
 		return nil;
 
-	b = s->alloc(s, 8);
+	b = s->alloc(s, 4+s->addrsize);
 	if(b->addr != pagesize){
 		werrstr("couldn't predict block address");
 	Error:
@@ -1324,26 +2284,26 @@ createdb(char *path, int pagesize)
 	if((fd = syscreateexcl(logname(path))) < 0)
 		goto Error;
 	close(fd);
-	db = genopendb(path, s, 0, pagesize-s->hdrsize);
+	db = genopendb(path, s, 0, pagesize-s->hdrsize, 0);
 	if(db == nil)
 		goto Error;
 	memmove(b->a, "DBDB", 4);
-	PLONG((uchar*)b->a+4, db->addr);
+	putaddr(s, (uchar*)b->a+4, db->addr);
 	flushdb(db);
 	flushlistcache(db->listcache);
 	return db;
 }
 
-Db*
-opendb(char *path)
+static Db*
+opendb1(char *path, int snap)
 {
 	Db *db;
 	DBlock *b;
 	DStore *s;
-	u32int a;
+	uvlong a;
 	char e[ERRMAX];
 
-	s = opendstore(path);
+	s = snap ? opendstoresnap(path) : opendstore(path);
 	if(s == nil)
 		return nil;
 
@@ -1354,7 +2314,7 @@ opendb(char *path)
 		return nil;
 	}
 
-	if(b->n != 8 || memcmp(b->a, "DBDB", 4) != 0){
+	if(b->n != 4+s->addrsize || memcmp(b->a, "DBDB", 4) != 0){
 		werrstr("damaged superblock");
 	Error:
 		rerrstr(e, sizeof e);
@@ -1364,19 +2324,40 @@ opendb(char *path)
 		return nil;
 	}
 
-	a = LONG((uchar*)b->a+4);
+	a = getaddr(s, (uchar*)b->a+4);
 	if(a == 0){
 		werrstr("bad db address in superblock");
 		goto Error;
 	}
 	free(b);
 
-	db = genopendb(path, s, a, 0);
-	if(db == nil)	
-		goto Error;
+	db = genopendb(path, s, a, 0, snap);
+	if(db == nil){	/* b is gone; don't go through Error */
+		rerrstr(e, sizeof e);
+		s->close(s);
+		errstr(e, sizeof e);
+		return nil;
+	}
 	return db;
 }
 
+Db*
+opendb(char *path)
+{
+	return opendb1(path, 0);
+}
+
+/*
+ * open the database read-only as of now, while some
+ * other process (trasrv) may go on writing it.  what
+ * we read never changes, and nothing we do is written.
+ */
+Db*
+opendbsnap(char *path)
+{
+	return opendb1(path, 1);
+}
+
 int
 flushdb(Db *db)
 {
@@ -1413,15 +2394,14 @@ flushdb(Db *db)
 		db->rootstatblock = b;
 	}
 	p = (uchar*)db->super->a + 4+4;
-	PLONG(p, db->root->addr);
-	p += 4;
-	PLONG(p, db->meta->addr);
-	p += 4;
-	if(db->rootstatblock){
-		PLONG(p, db->rootstatblock->addr);
-	}else{
-		PLONG(p, 0);
-	}
+	putaddr(db->s, p, db->root->addr);
+	p += db->s->addrsize;
+	putaddr(db->s, p, db->meta->addr);
+	p += db->s->addrsize;
+	if(db->rootstatblock)
+		putaddr(db->s, p, db->rootstatblock->addr);
+	else
+		putaddr(db->s, p, 0);
 	db->rootstatdirty = 0;
 	db->super->flags |= DDirty;
 	if(db->super->flush(db->super) < 0)
@@ -1438,6 +2418,10 @@ closedb(Db *db)
 
 	if(db->breakwrite){
 		free(db->logbuf);
+		freestrtab(db->strtab);
+		freebusts(db);
+		free(db->sidbyrid);
+		free(db->ridbysid);
 		closelistcache(db->listcache);
 		free(db);
 		return 0;
@@ -1454,10 +2438,17 @@ if(r<0) {fprint(2, "cannot write: %r\n"); abort(); }
 		db->rootstatblock->close(db->rootstatblock);
 	db->super->close(db->super);
 	closelistcache(db->listcache);
+	if(!db->snap)
+		dstoreonflush(db->s, logflushed, db);
 	db->s->close(db->s);
-	dbresetlog(db);
-	close(db->logfd);
+	if(!db->snap)
+		close(db->logfd);
 	free(db->logbuf);
+	freestrtab(db->strtab);
+	freebusts(db);
+	free(db->compact);
+	free(db->sidbyrid);
+	free(db->ridbysid);
 	free(db);
 	return r;
 }
@@ -1479,6 +2470,11 @@ freedb(Db *db)
 	r = db->s->free(db->s);
 	dbresetlog(db);
 	close(db->logfd);
+	freestrtab(db->strtab);
+	freebusts(db);
+	free(db->compact);
+	free(db->sidbyrid);
+	free(db->ridbysid);
 	free(db);
 	return r;
 }
@@ -1504,37 +2500,39 @@ struct D
 	int fd;
 };
 
+/*
+ * collect the kids before descending so that
+ * their lists are being read while we print.
+ */
 static void
-dumpwalk(void *v, Datum *key, Datum *val)
+dumptree(D *pa, DMap *m)
 {
-	char *name;
+	int i, nk;
 	Stat *s;
 	D a;
-	DMap *m;
-	u32int addr;
-
-	a = *(D*)v;
-	name = emallocnz(key->n+1);
-	memmove(name, key->a, key->n);
-	name[key->n] = '\0';
-	a.p = mkpath(a.p, name);
-	free(name);
-	s = dbparsestat(a.db, (uchar*)val->a+4, val->n-4);
-	addr = LONG((uchar*)val->a);
-	fprint(a.fd, "%P\tlist=%ux\t\tdelta=%V", a.p, addr, s->synctime);
-	s->synctime = maxvtime(s->synctime, a.vt);
-	fprint(a.fd, " %$\n", s);
-	a.vt = s->synctime;
-	if(addr != 0){
-		m = dmapclist(a.db->listcache, a.db->s, addr, 0);
-		if(m != nil){
-			m->walk(m, dumpwalk, &a);
-			m->close(m);
-		}else
-			fprint(a.fd, "\t\t-no valid db for %P\n", a.p);
+	Kid *k;
+	DMap *km;
+
+	nk = kidsinmap(pa->db, m, &k, 1);
+	for(i=0; i<nk; i++){
+		a = *pa;
+		a.p = mkpath(a.p, k[i].name);
+		s = k[i].stat;
+		fprint(a.fd, "%P\tlist=%llux\t\tdelta=%V", a.p, k[i].addr, s->synctime);
+		s->synctime = maxvtime(s->synctime, a.vt);
+		fprint(a.fd, " %$\n", s);
+		a.vt = s->synctime;
+		if(k[i].addr != 0){
+			km = dmapclist(a.db->listcache, a.db->s, k[i].addr, 0);
+			if(km != nil){
+				dumptree(&a, km);
+				km->close(km);
+			}else
+				fprint(a.fd, "\t\t-no valid db for %P\n", a.p);
+		}
+		freepath(a.p);
 	}
-	freestat(s);
-	freepath(a.p);
+	freekids(k, nk);
 }
 
 void
@@ -1566,17 +2564,257 @@ dumpdb(Db *db, int fd)
 	a.p = p;
 	a.fd = fd;
 	a.vt = db->rootstat->synctime;
-	db->root->walk(db->root, dumpwalk, &a);
+	dumptree(&a, db->root);
 }
 
 int
 dbignorewrites(Db *db)
 {
-//	db->ignwr = 1;
-//	dstoreignorewrites(db->s);
+	db->ignwr = 1;
+	listcachebigdir(db->listcache, 0);
+	return dstoreignorewrites(db->s);
+}
+
+/*
+ * none: nothing is synced; fastest, but a crash can lose the session.
+ * group: the log records gathered between logflush calls
+ *	(one trasrv request) go out together with one sync.
+ * strict: every change is its own log record, synced before
+ *	the call returns.
+ * either way the store syncs its own redo log before it
+ * writes back pages at a checkpoint.
+ */
+int
+dbdurability(Db *db, int mode)
+{
+	if(dstoredurability(db->s, mode) < 0)
+		return -1;
+	db->durability = mode;
 	return 0;
 }
 
+enum
+{
+	CompactMin = 64,	/* free pages */
+	CompactFrac = 8,	/* of the store */
+	CompactLists = 64,	/* lists moved per checkpoint */
+};
+
+/*
+ * the list at addr is no longer waiting to be compacted.
+ */
+static void
+forgetcompact(Db *db, uvlong addr)
+{
+	int i;
+
+	for(i=0; i<db->ncompact; i++)
+		if(db->compact[i] == addr){
+			db->compact[i] = db->compact[--db->ncompact];
+			break;
+		}
+}
+
+/*
+ * the list at addr is being freed; its address may be reused.
+ */
+static void
+forgetlist(Db *db, uvlong addr)
+{
+	forgetbust(db, addr);
+	forgetcompact(db, addr);
+}
+
+/*
+ * a pass starts once enough of the store is free, unless
+ * the last pass moved nothing and the store is the same size.
+ */
+static int
+compactdue(Db *db)
+{
+	DStats st;
+
+	dstorestats(db->s, &st);
+	if(st.freepage < CompactMin || st.freepage < st.size/db->s->pagesize/CompactFrac)
+		return 0;
+	return st.size != db->compactsize;
+}
+
+/*
+ * compact m and queue its children's lists.
+ */
+static int
+compactlist(Db *db, DMap *m)
+{
+	int i, n, nk;
+	Kidview *k;
+
+	if((n = m->compact(m)) < 0)
+		return -1;
+	nk = kidviewsinmap(db, m, nil, &k, 0);
+	for(i=0; i<nk; i++){
+		if(k[i].addr == 0)
+			continue;
+		if(db->ncompact%64 == 0)
+			db->compact = erealloc(db->compact, (db->ncompact+64)*sizeof db->compact[0]);
+		db->compact[db->ncompact++] = k[i].addr;
+	}
+	freekidviews(k, nk);
+	return n;
+}
+
+/*
+ * once enough of the store is free, move directory list pages
+ * down into the lowest free pages so the next flush can cut
+ * the free tail off the file.  list headers stay where they
+ * are, since the parent directories hold their addresses.
+ *
+ * the walk is spread over checkpoints: each moves at most
+ * CompactLists lists and leaves the rest queued in db->compact
+ * for the next.  returns the pages moved so far this pass.
+ */
+static int
+compactsome(Db *db)
+{
+	int i, n, r;
+	uvlong addr;
+	DMap *m;
+	DStats st;
+
+	if(db->ignwr || db->snap)
+		return 0;
+	if(db->ncompact == 0){
+		if(!compactdue(db))
+			return 0;
+		db->compactmoved = 0;
+		if((r = db->meta->compact(db->meta)) < 0)
+			return -1;
+		db->compactmoved += r;
+		if((r = db->strtoid->compact(db->strtoid)) < 0)
+			return -1;
+		db->compactmoved += r;
+		if((r = db->idtostr->compact(db->idtostr)) < 0)
+			return -1;
+		db->compactmoved += r;
+		if((r = compactlist(db, db->root)) < 0)
+			return -1;
+		db->compactmoved += r;
+	}else{
+		for(i=0; i<CompactLists && db->ncompact > 0; i++){
+			addr = db->compact[--db->ncompact];
+			if((m = dmapclist(db->listcache, db->s, addr, 0)) == nil)
+				return -1;
+			r = compactlist(db, m);
+			m->close(m);
+			if(r < 0)
+				return -1;
+			db->compactmoved += r;
+		}
+	}
+	n = db->compactmoved;
+	if(db->ncompact == 0){
+		dstorestats(db->s, &st);
+		dbg(DbgDb, "compact: moved %d of %llud pages; %lud are free\n",
+			n, st.size/db->s->pagesize, st.freepage);
+		db->compactsize = n ? 0 : st.size;
+	}
+	return n;
+}
+
+/*
+ * finish compacting: the rest of the pass under way,
+ * or a whole one if the store is due.
+ */
+int
+dbcompact(Db *db)
+{
+	int n;
+
+	do{
+		if((n = compactsome(db)) < 0)
+			return -1;
+		dbcheckpoint(db);
+	}while(db->ncompact > 0);
+	return n;
+}
+
+/*
+ * bulk loading, for tramkdb -r: the lists of a new db are
+ * written bottom up, each whole and in order, so nothing is
+ * walked or cached and the pages come out packed full.
+ */
+static uvlong
+loadlist(Db *db, Stat *s, Kid *k, int nk, int tree)
+{
+	int i, j;
+	uvlong addr;
+	Datum key, v;
+	DMap *m;
+	Stat *ks;
+
+	/* a tree packs its leaves when loaded in order, a list in reverse */
+	if(tree)
+		m = dmaptree(db->s, 0, db->pagesize);
+	else
+		m = dmaplist(db->s, 0, db->pagesize);
+	if(m == nil)
+		panic("loadlist: %r");
+	for(i=0; i<nk; i++){
+		j = tree ? i : nk-1-i;
+		if(!leqvtime(k[j].stat->mtime, s->mtime))
+			maxvtime(s->mtime, k[j].stat->mtime);
+		ks = copystat(k[j].stat);
+		unmaxvtime(ks->synctime, s->synctime);
+		dbunparsestat(db, ks, &v, db->s->addrsize);
+		freestat(ks);
+		putaddr(db->s, v.a, k[j].addr);
+		key.a = k[j].name;
+		key.n = strlen(k[j].name);
+		if(m->insert(m, &key, &v, DMapCreate) < 0)
+			panic("dmapinsert: %r");
+		free(v.a);
+	}
+	addr = m->addr;
+	m->close(m);
+	return addr;
+}
+
+/*
+ * write a new list for the nk kids in k, sorted by name,
+ * of a directory with stat s, and return its address,
+ * 0 if there are no kids.  the kids' own lists are already
+ * written, at k[i].addr.  s->mtime takes in the kids' as
+ * cursorput would.
+ */
+uvlong
+dbloadkids(Db *db, Stat *s, Kid *k, int nk)
+{
+	if(nk == 0)
+		return 0;
+	return loadlist(db, s, k, nk, db->bigdir && nk >= db->bigdir);
+}
+
+/*
+ * the same for the root, which stays a list as it would
+ * in a scan, and whose stat goes in as well.
+ */
+void
+dbloadroot(Db *db, Stat *s, Kid *k, int nk)
+{
+	uvlong addr;
+
+	if(nk > 0){
+		addr = loadlist(db, s, k, nk, 0);
+		db->root->free(db->root);
+		if((db->root = dmapclist(db->listcache, db->s, addr, 0)) == nil)
+			panic("dbloadroot: %r");
+	}
+	freestat(db->rootstat);
+	db->rootstat = copystat(s);
+	unmaxvtime(db->rootstat->synctime, db->now);
+	db->rootstatdirty = 1;
+}
+
 void
 tramkdb(char *dbfile, char *gnot, int bsize, int addrandom)
 {
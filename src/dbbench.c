@@ -0,0 +1,326 @@
+#include "tra.h"
+
+/*
+ * microbenchmarks for the db layer.
+ *
+ *	dbbench [-b batch] [-d depth] [-n nop] [-s none|group|strict] [-u nuid] file
+ *
+ * creates file and times nop dbputstat calls spread over
+ * a few directories depth levels down, committing (logflush)
+ * every batch calls.  the files are owned by nuid users.
+ * then times a rescan that gets and puts every stat in the
+ * tree: by path, with a cursor, and with a cursor putting the
+ * plain files of each directory in one batch.  then times
+ * changing one file and then its directory, as a scan does,
+ * nop/64 times in one directory.  last, times listing the
+ * tree and looking at each file's state, with parsed kids
+ * and with kid views.
+ */
+
+enum
+{
+	Maxdepth = 64,
+};
+
+static char *top[Maxdepth];
+static int depth;
+static char **uid;
+static int nuid = 1;
+
+static char *syncname[] = {
+[DSyncNone]	"none",
+[DSyncGroup]	"group",
+[DSyncStrict]	"strict",
+};
+
+void
+usage(void)
+{
+	fprint(2, "usage: dbbench [-b batch] [-d depth] [-n nop] [-s none|group|strict] [-u nuid] file\n");
+	exits("usage");
+}
+
+static void
+put(Db *db, int i, int now)
+{
+	char d[32], f[32], *e[Maxdepth+2];
+	Stat *s;
+
+	snprint(d, sizeof d, "d%d", i%64);
+	snprint(f, sizeof f, "f%d", i/64);
+	memmove(e, top, depth*sizeof e[0]);
+	e[depth] = d;
+	e[depth+1] = f;
+	if(dbgetstat(db, e, depth+2, &s) < 0)
+		sysfatal("dbgetstat: %r");
+	s->state = SFile;
+	s->mode = 0644;
+	s->length = now;
+	s->uid = uid[i%nuid];
+	s->gid = uid[(i+1)%nuid];
+	s->muid = uid[(i+2)%nuid];
+	freevtime(s->mtime);
+	s->mtime = mkvtime1("bench", now, now);
+	freevtime(s->synctime);
+	s->synctime = mkvtime1("bench", now, now);
+	if(dbputstat(db, e, depth+2, s) < 0)
+		sysfatal("dbputstat: %r");
+	freestat(s);
+}
+
+static int
+scanpath(Db *db, char **e, int ne)
+{
+	int i, n, nk;
+	Kid *k;
+	Stat *s;
+
+	n = 0;
+	nk = dbgetkids(db, e, ne, &k);
+	for(i=0; i<nk; i++){
+		e[ne] = k[i].name;
+		if(dbgetstat(db, e, ne+1, &s) < 0)
+			sysfatal("dbgetstat: %r");
+		if(dbputstat(db, e, ne+1, s) < 0)
+			sysfatal("dbputstat: %r");
+		freestat(s);
+		n++;
+		if(k[i].addr)
+			n += scanpath(db, e, ne+1);
+	}
+	freekids(k, nk);
+	return n;
+}
+
+static int
+scancursor(Dbcursor *c)
+{
+	int i, n, nk;
+	Kid *k;
+	Stat *s;
+
+	n = 0;
+	nk = dbcursorkids(c, &k);
+	for(i=0; i<nk; i++){
+		dbcursordown(c, k[i].name);
+		s = dbcursorstat(c);
+		if(dbcursorput(c, s) < 0)
+			sysfatal("dbcursorput: %r");
+		freestat(s);
+		n++;
+		if(k[i].addr)
+			n += scancursor(c);
+		dbcursorup(c);
+	}
+	freekids(k, nk);
+	return n;
+}
+
+static int
+scanbatch(Dbcursor *c)
+{
+	int i, n, nk, nb;
+	Kid *k, *b;
+
+	n = 0;
+	nb = 0;
+	nk = dbcursorkids(c, &k);
+	b = emalloc(nk*sizeof b[0]);
+	for(i=0; i<nk; i++){
+		n++;
+		if(k[i].addr == 0){
+			b[nb++] = k[i];
+			continue;
+		}
+		dbcursordown(c, k[i].name);
+		if(dbcursorput(c, k[i].stat) < 0)
+			sysfatal("dbcursorput: %r");
+		n += scanbatch(c);
+		dbcursorup(c);
+	}
+	if(dbcursorputkids(c, b, nb) < 0)
+		sysfatal("dbcursorputkids: %r");
+	free(b);
+	freekids(k, nk);
+	return n;
+}
+
+/*
+ * change file i and then the mtime of its directory.
+ */
+static void
+putdir(Db *db, int i, int now)
+{
+	char d[32], *e[Maxdepth+1];
+	Stat *s;
+
+	put(db, i, now);
+	snprint(d, sizeof d, "d%d", i%64);
+	memmove(e, top, depth*sizeof e[0]);
+	e[depth] = d;
+	if(dbgetstat(db, e, depth+1, &s) < 0)
+		sysfatal("dbgetstat: %r");
+	freevtime(s->mtime);
+	s->mtime = mkvtime1("bench", now, now);
+	if(dbputstat(db, e, depth+1, s) < 0)
+		sysfatal("dbputstat: %r");
+	freestat(s);
+}
+
+static int
+listkids(Dbcursor *c, int *nfile)
+{
+	int i, n, nk;
+	Kid *k;
+
+	n = 0;
+	nk = dbcursorkids(c, &k);
+	for(i=0; i<nk; i++){
+		n++;
+		if(k[i].stat->state == SFile)
+			(*nfile)++;
+		if(k[i].addr){
+			dbcursordown(c, k[i].name);
+			n += listkids(c, nfile);
+			dbcursorup(c);
+		}
+	}
+	freekids(k, nk);
+	return n;
+}
+
+static int
+listviews(Dbcursor *c, int *nfile)
+{
+	int i, n, nk;
+	Kidview *k;
+
+	n = 0;
+	nk = dbcursorkidviews(c, &k);
+	for(i=0; i<nk; i++){
+		n++;
+		if(dbviewstate(&k[i].v) == SFile)
+			(*nfile)++;
+		if(k[i].addr){
+			dbcursordown(c, k[i].name);
+			n += listviews(c, nfile);
+			dbcursorup(c);
+		}
+	}
+	freekidviews(k, nk);
+	return n;
+}
+
+void
+main(int argc, char **argv)
+{
+	int i, n, nf, batch, mode, nop, ncommit;
+	char *file, *arg, *e[Maxdepth+3];
+	vlong t;
+	double sec;
+	Db *db;
+	Dbcursor *c;
+
+	initfmt();
+	batch = 1;
+	nop = 10000;
+	mode = DSyncNone;
+	ARGBEGIN{
+	case 'b':
+		batch = atoi(EARGF(usage()));
+		break;
+	case 'd':
+		depth = atoi(EARGF(usage()));
+		if(depth < 0 || depth > Maxdepth)
+			usage();
+		break;
+	case 'n':
+		nop = atoi(EARGF(usage()));
+		break;
+	case 's':
+		arg = EARGF(usage());
+		for(mode=0; mode<nelem(syncname); mode++)
+			if(strcmp(arg, syncname[mode]) == 0)
+				break;
+		if(mode == nelem(syncname))
+			usage();
+		break;
+	case 'u':
+		nuid = atoi(EARGF(usage()));
+		break;
+	default:
+		usage();
+	}ARGEND
+
+	if(argc != 1 || batch <= 0 || nop <= 0 || nuid <= 0 || nuid > 60000)
+		usage();
+	file = argv[0];
+	for(i=0; i<depth; i++)
+		top[i] = esmprint("top%d", i);
+	uid = emalloc(nuid*sizeof uid[0]);
+	for(i=0; i<nuid; i++)
+		uid[i] = atom(esmprint("user%d", i));
+
+	remove(file);
+	remove(esmprint("%s.redo", file));
+	remove(esmprint("%s.redo2", file));
+	tramkdb(file, "bench", 8192, 0);
+	db = opendb(file);
+	if(db == nil)
+		sysfatal("opendb %s: %r", file);
+	if(dbdurability(db, mode) < 0)
+		sysfatal("dbdurability: %r");
+
+	ncommit = 0;
+	t = nsec();
+	for(i=0; i<nop; i++){
+		put(db, i, i+1);
+		if(i%batch == batch-1){
+			logflush(db);
+			ncommit++;
+		}
+	}
+	logflush(db);
+	sec = (nsec()-t)/1e9;
+	print("%s: %d puts, %d commits in %.3fs: %.0f puts/s %.0f commits/s\n",
+		syncname[mode], nop, ncommit, sec, nop/sec, ncommit/sec);
+
+	t = nsec();
+	n = scanpath(db, e, 0);
+	logflush(db);
+	print("rescan by path: %d stats in %.3fs\n", n, (nsec()-t)/1e9);
+	t = nsec();
+	c = dbcursor(db, nil, 0);
+	n = scancursor(c);
+	dbclosecursor(c);
+	logflush(db);
+	print("rescan by cursor: %d stats in %.3fs\n", n, (nsec()-t)/1e9);
+	t = nsec();
+	c = dbcursor(db, nil, 0);
+	n = scanbatch(c);
+	dbclosecursor(c);
+	logflush(db);
+	print("rescan by batch: %d stats in %.3fs\n", n, (nsec()-t)/1e9);
+
+	t = nsec();
+	for(i=0; i<nop; i+=64)
+		putdir(db, i, nop+i+1);
+	logflush(db);
+	print("file and dir puts: %d in %.3fs\n", (nop+63)/64, (nsec()-t)/1e9);
+
+	for(i=0; i<2; i++){
+		nf = 0;
+		t = nsec();
+		c = dbcursor(db, nil, 0);
+		n = i ? listviews(c, &nf) : listkids(c, &nf);
+		dbclosecursor(c);
+		print("list by %s: %d stats, %d files in %.3fs\n",
+			i ? "view" : "kids", n, nf, (nsec()-t)/1e9);
+	}
+
+	t = nsec();
+	if(closedb(db) < 0)
+		sysfatal("closedb: %r");
+	print("close: %.3fs\n", (nsec()-t)/1e9);
+	exits(nil);
+}
@@ -0,0 +1,113 @@
+#include "tra.h"
+
+/*
+ * microbenchmarks for the block store.
+ *
+ *	dsbench [-c cachemb] [-d ndirty] [-n nblock] [-r nread] file
+ *
+ * creates file with nblock blocks of random size, checkpointing
+ * every ndirty dirty pages, reopens it, and times nread
+ * dstoreread calls at random addresses.
+ */
+
+void
+usage(void)
+{
+	fprint(2, "usage: dsbench [-c cachemb] [-d ndirty] [-n nblock] [-r nread] file\n");
+	exits("usage");
+}
+
+static double
+secs(vlong t)
+{
+	return (nsec()-t)/1e9;
+}
+
+void
+main(int argc, char **argv)
+{
+	int i, nblock, nread, cachemb, ndirty, nflush;
+	uvlong *addr;
+	vlong t, tf;
+	DBlock *b;
+	DStats st;
+	DStore *s;
+
+	cachemb = 0;
+	ndirty = 0;
+	nblock = 100000;
+	nread = 1000000;
+	ARGBEGIN{
+	case 'c':
+		cachemb = atoi(EARGF(usage()));
+		break;
+	case 'd':
+		ndirty = atoi(EARGF(usage()));
+		break;
+	case 'n':
+		nblock = atoi(EARGF(usage()));
+		break;
+	case 'r':
+		nread = atoi(EARGF(usage()));
+		break;
+	default:
+		usage();
+	}ARGEND
+
+	if(argc != 1 || nblock <= 0)
+		usage();
+
+	srandom(1);
+	addr = emalloc(nblock*sizeof addr[0]);
+	remove(argv[0]);
+	remove(smprint("%s.redo", argv[0]));
+	s = createdstore(argv[0], 8192);
+	if(s == nil)
+		sysfatal("createdstore %s: %r", argv[0]);
+	if(ndirty)
+		dstorecheckpoint(s, ndirty, 0);
+	nflush = 0;
+	tf = 0;
+	t = nsec();
+	for(i=0; i<nblock; i++){
+		b = s->alloc(s, 16+random()%500);
+		if(b == nil)
+			sysfatal("alloc: %r");
+		memset(b->a, i, b->n);
+		b->flags |= DDirty;
+		addr[i] = b->addr;
+		b->close(b);
+		if(dstoreneedflush(s)){
+			tf -= nsec();
+			if(s->flush(s) < 0)
+				sysfatal("flush: %r");
+			tf += nsec();
+			nflush++;
+		}
+	}
+	print("alloc %d: %.3fs, %d flushes in %.3fs\n", nblock, secs(t), nflush, tf/1e9);
+	t = nsec();
+	if(s->close(s) < 0)
+		sysfatal("close: %r");
+	print("close: %.3fs\n", secs(t));
+
+	s = opendstore(argv[0]);
+	if(s == nil)
+		sysfatal("opendstore %s: %r", argv[0]);
+	if(cachemb)
+		dstorecachesize(s, (uvlong)cachemb*1024*1024);
+	t = nsec();
+	for(i=0; i<nread; i++){
+		b = s->read(s, addr[random()%nblock]);
+		if(b == nil)
+			sysfatal("read: %r");
+		b->close(b);
+	}
+	t = nsec()-t;
+	dstorestats(s, &st);
+	print("read %d: %.3fs, %.0fns/read\n", nread, t/1e9, (double)t/nread);
+	print("cache: %lud hit %lud miss %lud evict %lud/%lud pages\n",
+		st.hit, st.miss, st.evict, st.npage, st.maxpage);
+	s->close(s);
+	exits(nil);
+}
@@ -165,6 +165,18 @@ tcanread(Fd *f)
 	return f->p < f->ep;
 }
 
+/*
+ * threaded readers block in their own procs; there is
+ * no one to wake on a timeout, so say there is input.
+ */
+int
+twait(Fd *f, long ms)
+{
+	USED(f);
+	USED(ms);
+	return 1;
+}
+
 int
 _tread(Fd *f, void *a, int n)
 {
@@ -9,8 +9,8 @@
  * blocks kept in a doubly-linked list.  The disk blocks
  * have the form:
  *	"DIR\0"	(4 bytes)
- *	ptr-to-prev-block	(4 bytes)
- *	ptr-to-next-block	(4 bytes)
+ *	ptr-to-prev-block	(s->addrsize bytes)
+ *	ptr-to-next-block	(s->addrsize bytes)
  *	number of pairs in this block (2 bytes)
  *	<pairs>
  *
@@ -22,8 +22,18 @@
  *
  * Blocks are split and joined whenever possible to 
  * avoid pathologic cases.
+ *
+ * For lookups we keep the first key of each block in memory,
+ * so that a lookup binary searches the index and then the one
+ * block that can hold the key, which stays parsed for the next
+ * lookup.  The index is extended only as far as lookups need,
+ * so a lookup reads the blocks up to its key at most once.
+ * Any change made through the map throws these away; the
+ * index is checked against the block as it is opened in case
+ * the list changed some other way.
  */
 
+typedef struct DListidx DListidx;
 typedef struct DListpage DListpage;
 typedef struct DListent DListent;
 typedef struct DListhdr DListhdr;
@@ -32,9 +42,9 @@ typedef struct DList DList;
 struct DListhdr
 {
 	uchar *prevp;
-	ulong prev;
+	uvlong prev;
 	uchar *nextp;
-	ulong next;
+	uvlong next;
 	uchar *np;
 	int n;
 };
@@ -47,9 +57,16 @@ struct DListent
 	int sz;
 };
 
+struct DListidx
+{
+	uvlong addr;
+	uvlong next;
+	Datum key;	/* first key in block; key.a is malloced */
+};
+
 struct DListpage
 {
-	ulong addr;
+	uvlong addr;
 	DList *list;
 	DBlock *dat;
 	DListhdr hdr;
@@ -64,16 +81,20 @@ struct DList
 	u32int magic;
 
 	int pagesize;
+	int hdrsize;	/* of a list page */
 	DStore *s;
-	u32int firstblock;
+	uvlong firstblock;
 	uchar *firstblockp;
 	DBlock *hdr;
+	DListidx *idx;
+	int nidx;
+	int indexed;		/* idx is in use */
+	uvlong idxnext;	/* first block not in idx */
+	DListpage *last;	/* block of the last lookup */
 };
 
-enum
-{
-	DListHdrSize = 4+4+4+2
-};
+#define DLISTHDRSIZE(s)	(4+2*(s)->addrsize+2)
+#define LHDRSIZE(s)	(4+(s)->addrsize+4)
 #define BLOCKSIZE(nlen, blen)	(2+(nlen)+2+(blen))
 
 DList*
@@ -88,15 +109,17 @@ map2list(DMap *map)
 }
 
 static int
-parselisthdr(uchar **pp, uchar *ep, DListhdr *hdr, int errok)
+parselisthdr(DList *list, uchar **pp, uchar *ep, DListhdr *hdr, int errok)
 {
 	uchar *p;
+	DStore *s;
 
+	s = list->s;
 	p = *pp;
-	if(p+DListHdrSize > ep){
+	if(p+list->hdrsize > ep){
 		if(!errok)
 			abort();
-		werrstr("hdr too small (need %d have %d)", DListHdrSize, (int)(ep-p));
+		werrstr("hdr too small (need %d have %d)", list->hdrsize, (int)(ep-p));
 		return -1;
 	}
 	if(memcmp(p, "DIR", 4) != 0){
@@ -107,11 +130,11 @@ parselisthdr(uchar **pp, uchar *ep, DListhdr *hdr, int errok)
 	}
 	p += 4;
 	hdr->prevp = p;
-	hdr->prev = LONG(p);
-	p += 4;
+	hdr->prev = getaddr(s, p);
+	p += s->addrsize;
 	hdr->nextp = p;
-	hdr->next = LONG(p);
-	p += 4;
+	hdr->next = getaddr(s, p);
+	p += s->addrsize;
 	hdr->np = p;
 	hdr->n = SHORT(p);
 	p += 2;
@@ -150,7 +173,7 @@ parselistent(uchar **pp, uchar *ep, DListent *de, int errok)
 }
 
 static DListpage*
-openlistpage(DList *list, ulong addr)
+openlistpage(DList *list, uvlong addr)
 {
 	int i;
 	uchar *p, *ep;
@@ -159,7 +182,7 @@ openlistpage(DList *list, ulong addr)
 	DListhdr hdr;
 
 	if((dat = list->s->read(list->s, addr)) == nil){
-		werrstr("could not read directory block %lux", addr);
+		werrstr("could not read directory block %llux: %r", addr);
 		return nil;
 	}
 	if(dat->n != list->pagesize){
@@ -169,7 +192,7 @@ openlistpage(DList *list, ulong addr)
 	}
 	p = dat->a;
 	ep = p+dat->n;
-	if(parselisthdr(&p, ep, &hdr, 1) < 0){
+	if(parselisthdr(list, &p, ep, &hdr, 1) < 0){
 		dat->close(dat);
 		werrstr("malformed directory header: %r");
 		return nil;
@@ -184,7 +207,7 @@ openlistpage(DList *list, ulong addr)
 	dir->hdr = hdr;
 	dir->dat = dat;
 	dir->list = list;
-	dir->free = dir->dat->n - DListHdrSize;
+	dir->free = dir->dat->n - list->hdrsize;
 	for(i=0; i<hdr.n; i++){
 		if(parselistent(&p, ep, &dir->de[i], 1) < 0){
 			dat->close(dat);
@@ -207,12 +230,12 @@ reparsepage(DListpage *dir)
 	p = dir->dat->a;
 	ep = p+dir->dat->n;
 
-	parselisthdr(&p, ep, &dir->hdr, 0);
+	parselisthdr(dir->list, &p, ep, &dir->hdr, 0);
 	dir = realloc(dir, sizeof(DListpage)+dir->hdr.n*sizeof(DListent));
 	if(dir == nil)
 		return nil;
 	dir->de = (DListent*)&dir[1];
-	dir->free = dir->dat->n - DListHdrSize;
+	dir->free = dir->dat->n - dir->list->hdrsize;
 	for(i=0; i<dir->hdr.n; i++){
 		parselistent(&p, ep, &dir->de[i], 0);
 		dir->free -= dir->de[i].sz;
@@ -239,47 +262,173 @@ freelistpage(DListpage *dir)
 	free(dir);
 }
 
+static void
+freelistidx(DList *list)
+{
+	int i;
+
+	for(i=0; i<list->nidx; i++)
+		free(list->idx[i].key.a);
+	free(list->idx);
+	list->idx = nil;
+	list->nidx = 0;
+	list->indexed = 0;
+	closelistpage(list->last);
+	list->last = nil;
+}
+
+/*
+ * index blocks until one starts after key.  only the
+ * block headers and first entries are parsed.
+ */
+static int
+growlistidx(DList *list, Datum *key)
+{
+	uchar *p, *ep;
+	uvlong addr, pf;
+	DBlock *dat;
+	DListent de;
+	DListhdr hdr;
+	DListidx *x;
+
+	if(!list->indexed){
+		list->indexed = 1;
+		list->idxnext = list->firstblock;
+	}
+	while((addr = list->idxnext) != 0
+	&& (list->nidx == 0 || datumcmp(&list->idx[list->nidx-1].key, key) <= 0)){
+		if((dat = list->s->read(list->s, addr)) == nil){
+			werrstr("could not read directory block %llux: %r", addr);
+			goto Err;
+		}
+		p = dat->a;
+		ep = p+dat->n;
+		if(dat->n != list->pagesize || parselisthdr(list, &p, ep, &hdr, 1) < 0
+		|| (hdr.n > 0 && parselistent(&p, ep, &de, 1) < 0)){
+			dat->close(dat);
+			werrstr("malformed directory block %llux", addr);
+			goto Err;
+		}
+		list->idxnext = hdr.next;
+		if(hdr.next){
+			pf = hdr.next;
+			dstoreprefetch(list->s, &pf, 1);
+		}
+		if(hdr.n > 0){
+			if(list->nidx%16 == 0)
+				list->idx = erealloc(list->idx, (list->nidx+16)*sizeof(list->idx[0]));
+			x = &list->idx[list->nidx++];
+			x->addr = addr;
+			x->next = hdr.next;
+			x->key.n = de.key.n;
+			x->key.a = emallocnz(de.key.n+1);
+			memmove(x->key.a, de.key.a, de.key.n);
+		}
+		dat->close(dat);
+	}
+	return 0;
+
+Err:
+	freelistidx(list);
+	return -1;
+}
+
+/*
+ * open the block that would hold key, or return nil
+ * with *stale set if the index no longer matches the list.
+ */
+static DListpage*
+idxlistpage(DList *list, Datum *key, int *stale)
+{
+	int lo, hi, m;
+	DListpage *dir;
+
+	*stale = 0;
+	if(growlistidx(list, key) < 0){
+		*stale = 1;
+		return nil;
+	}
+	lo = 0;
+	hi = list->nidx;
+	while(lo < hi){
+		m = (lo+hi)/2;
+		if(datumcmp(&list->idx[m].key, key) <= 0)
+			lo = m+1;
+		else
+			hi = m;
+	}
+	if(lo == 0){
+		werrstr("key not found");
+		return nil;
+	}
+	m = lo-1;
+	if(list->last && list->last->addr == list->idx[m].addr)
+		return list->last;
+	if((dir = openlistpage(list, list->idx[m].addr)) == nil){
+		*stale = 1;
+		return nil;
+	}
+	if(dir->hdr.n == 0 || dir->hdr.next != list->idx[m].next
+	|| datumcmp(&dir->de[0].key, &list->idx[m].key) != 0){
+		closelistpage(dir);
+		*stale = 1;
+		return nil;
+	}
+	closelistpage(list->last);
+	list->last = dir;
+	return dir;
+}
+
 int dclistlookups;
 static int
 listlookup(DMap *map, Datum *key, Datum *val)
 {
-	int i, n;
-	ulong addr, next;
+	int lo, hi, m, c, n, stale;
 	DListpage *dir;
 	DList *list;
 
 	list = map2list(map);
-	for(addr=list->firstblock; addr; addr=next){
-		dir = openlistpage(list, addr);
-		if(dir == nil)
+	if(list->firstblock == 0){
+		werrstr("key not found");
+		return -1;
+	}
+	if((dir = idxlistpage(list, key, &stale)) == nil){
+		if(!stale)
 			return -1;
-		for(i=0; i<dir->hdr.n; i++){
-dclistlookups++;
-			switch(datumcmp(&dir->de[i].key, key)){
-			case 0:
-				n = dir->de[i].val.n;
-
-				if(val->n == 0 && val->a == nil){
-					val->n = n;
-					val->a = emallocnz(n+1);
-					((char*)val->a)[n] = 0;
-				}
-
-				if(n > val->n)
-					n = val->n;
-				if(n > 0)
-					memmove(val->a, dir->de[i].val.a, n);
-				val->n = dir->de[i].val.n;
-				closelistpage(dir);
-				return 0;
+		freelistidx(list);
+		if((dir = idxlistpage(list, key, &stale)) == nil){
+			if(stale)
+				werrstr("directory changed during lookup");
+			return -1;
+		}
+	}
 
-			case 1:
-				werrstr("key not found");
-				return -1;
+	lo = 0;
+	hi = dir->hdr.n;
+	while(lo < hi){
+dclistlookups++;
+		m = (lo+hi)/2;
+		c = datumcmp(&dir->de[m].key, key);
+		if(c < 0)
+			lo = m+1;
+		else if(c > 0)
+			hi = m;
+		else{
+			n = dir->de[m].val.n;
+
+			if(val->n == 0 && val->a == nil){
+				val->n = n;
+				val->a = emallocnz(n+1);
+				((char*)val->a)[n] = 0;
 			}
+
+			if(n > val->n)
+				n = val->n;
+			if(n > 0)
+				memmove(val->a, dir->de[m].val.a, n);
+			val->n = dir->de[m].val.n;
+			return 0;
 		}
-		closelistpage(dir);
-		next = dir->hdr.next;
 	}
 	werrstr("key not found");
 	return -1;
@@ -288,7 +437,7 @@ dclistlookups++;
 static DListpage*
 mklistpage(DList *list)
 {
-	ulong addr;
+	uvlong addr;
 	DBlock *dat;
 	DListpage *dir;
 
@@ -346,7 +495,7 @@ listinsert(DMap *map, Datum *key, Datum *val, int action)
 {
 	int i, insert, n, sz, first;
 	uchar *p;
-	ulong addr;
+	uvlong addr;
 	DListpage *dir, *ndir, *pdir, *dir0;
 	DList *list;
 
@@ -356,6 +505,7 @@ listinsert(DMap *map, Datum *key, Datum *val, int action)
 	}
 
 	list = map2list(map);
+	freelistidx(list);
 	// fprint(2, "listinsert %s %p first %ux...", (char*)key->a, list, list->firstblock);
 	if(list->firstblock == 0){
 		dir = mklistpage(list);
@@ -368,7 +518,7 @@ listinsert(DMap *map, Datum *key, Datum *val, int action)
 		}
 		listadd1(dir, key, val);
 		list->firstblock = dir->dat->addr;
-		PLONG(list->firstblockp, list->firstblock);
+		putaddr(list->s, list->firstblockp, list->firstblock);
 		list->hdr->flags |= DDirty;
 		closelistpage(dir);
 		return 0;
@@ -469,7 +619,7 @@ PushLeft:
 			n += dir->de[i].sz;
 		}
 		if(i>0){
-			p = (uchar*)dir->dat->a + DListHdrSize;
+			p = (uchar*)dir->dat->a + list->hdrsize;
 			memmove(pdir->end, p, n);
 			memmove(p, p+n, dir->end - (p+n));
 			pdir->hdr.n += i;
@@ -526,7 +676,7 @@ PushLeft:
 			n += dir->de[i-1].sz;
 		}
 		if(i<dir->hdr.n){
-			p = (uchar*)ndir->dat->a + DListHdrSize;
+			p = (uchar*)ndir->dat->a + list->hdrsize;
 			memmove(p+n, p, ndir->end - p);
 			memmove(p, dir->de[i].bp, n);
 			ndir->hdr.n += (dir->hdr.n - i);
@@ -576,25 +726,25 @@ PushLeft:
 	dir0 = mklistpage(list);
 	if(dir->addr == list->firstblock){
 		list->firstblock = dir0->addr;
-		PLONG(list->firstblockp, list->firstblock);
+		putaddr(list->s, list->firstblockp, list->firstblock);
 		list->hdr->flags |= DDirty;
 	}
 
 	if(pdir){
 		pdir->hdr.next = dir0->addr;
-		PLONG(pdir->hdr.nextp, pdir->hdr.next);
+		putaddr(list->s, pdir->hdr.nextp, pdir->hdr.next);
 		pdir->dat->flags |= DDirty;
 		dir0->hdr.prev = pdir->addr;
-		PLONG(dir0->hdr.prevp, dir0->hdr.prev);
+		putaddr(list->s, dir0->hdr.prevp, dir0->hdr.prev);
 		dir0->dat->flags |= DDirty;
 		closelistpage(pdir);
 	}
 
 	dir->hdr.prev = dir0->addr;
-	PLONG(dir->hdr.prevp, dir->hdr.prev);
+	putaddr(list->s, dir->hdr.prevp, dir->hdr.prev);
 	dir->dat->flags |= DDirty;
 	dir0->hdr.next = dir->addr;
-	PLONG(dir0->hdr.nextp, dir0->hdr.next);
+	putaddr(list->s, dir0->hdr.nextp, dir0->hdr.next);
 
 	pdir = dir0;
 	goto PushLeft;
@@ -605,11 +755,12 @@ listdelete(DMap *map, Datum *key)
 {
 	int i, sz;
 	uchar *p, *np;
-	ulong addr, next;
+	uvlong addr, next;
 	DListpage *dir, *pdir, *ndir;
 	DList *list;
 
 	list = map2list(map);
+	freelistidx(list);
 	for(addr=list->firstblock; addr; addr=next){
 		dir = openlistpage(list, addr);
 		if(dir == nil)
@@ -651,7 +802,7 @@ Found:
 		}
 	}
 
-	p = (uchar*)dir->dat->a + DListHdrSize;
+	p = (uchar*)dir->dat->a + list->hdrsize;
 	sz = dir->end - p;
 	if(dir->hdr.n != 0){
 		if(pdir && sz <= pdir->free){
@@ -661,7 +812,7 @@ Found:
 			dir->hdr.n = 0;
 			pdir->dat->flags |= DDirty;
 		}else if(ndir && sz <= ndir->free){
-			np = (uchar*)ndir->dat->a + DListHdrSize;
+			np = (uchar*)ndir->dat->a + list->hdrsize;
 			memmove(np+sz, np, ndir->end - np);
 			memmove(np, p, sz);
 			ndir->hdr.n += dir->hdr.n;
@@ -674,18 +825,18 @@ Found:
 	if(dir->hdr.n == 0){
 		if(pdir){
 			pdir->hdr.next = dir->hdr.next;
-			PLONG(pdir->hdr.nextp, pdir->hdr.next);
+			putaddr(list->s, pdir->hdr.nextp, pdir->hdr.next);
 			pdir->dat->flags |= DDirty;
 		}else{
 			if(dir->dat->addr != list->firstblock)
 				abort();
 			list->firstblock = dir->hdr.next;
-			PLONG(list->firstblockp, list->firstblock);
+			putaddr(list->s, list->firstblockp, list->firstblock);
 			list->hdr->flags |= DDirty;
 		}
 		if(ndir){
 			ndir->hdr.prev = dir->hdr.prev;
-			PLONG(ndir->hdr.prevp, ndir->hdr.prev);
+			putaddr(list->s, ndir->hdr.prevp, ndir->hdr.prev);
 			ndir->dat->flags |= DDirty;
 		}
 		freelistpage(dir);
@@ -704,9 +855,10 @@ listdeleteall(DMap *map)
 {
 	DList *list;
 	DListpage *dir;
-	u32int addr, next;
+	uvlong addr, next;
 
 	list = map2list(map);
+	freelistidx(list);
 	for(addr=list->firstblock; addr; addr=next){
 		dir = openlistpage(list, addr);
 		if(dir == nil)
@@ -715,7 +867,7 @@ listdeleteall(DMap *map)
 		freelistpage(dir);
 	}
 	list->firstblock = 0;
-	PLONG(list->firstblockp, list->firstblock);
+	putaddr(list->s, list->firstblockp, list->firstblock);
 	list->hdr->flags |= DDirty;
 	return 0;
 }
@@ -726,7 +878,7 @@ listwalk(DMap *map, void (*fn)(void*, Datum*, Datum*), void *arg)
 	DListpage *dir;
 	DList *list;
 	int i;
-	ulong a, next;
+	uvlong a, next, pf;
 
 	list = map2list(map);
 	// fprint(2, "walk %p...", map);
@@ -745,6 +897,10 @@ listwalk(DMap *map, void (*fn)(void*, Datum*, Datum*), void *arg)
 		}
 		// fprint(2, "@%lux...", a);
 		next = dir->hdr.next;
+		if(next){
+			pf = next;
+			dstoreprefetch(list->s, &pf, 1);
+		}
 		for(i=0; i<dir->hdr.n; i++){
 			// fprint(2, "%s...", (char*)dir->de[i].key.a);
 			(*fn)(arg, &dir->de[i].key, &dir->de[i].val);
@@ -761,18 +917,18 @@ listdump(DMap *map, int fd)
 	int i;
 	DListpage *dir;
 	DList *list;
-	ulong a, next;
+	uvlong a, next;
 
 	list = map2list(map);
 	fprint(fd, "===\n");
 	for(a=list->firstblock; a; a=next){
-		fprint(fd, "--- %lux\n", a);
+		fprint(fd, "--- %llux\n", a);
 		dir = openlistpage(list, a);
 		if(dir == nil){
 			// fprint(fd, "?cannot load: %r\n");
 			return;
 		}
-		fprint(fd, "[prev %lux next %lux n %d free %d]\n", dir->hdr.prev, dir->hdr.next, dir->hdr.n, dir->free);
+		fprint(fd, "[prev %llux next %llux n %d free %d]\n", dir->hdr.prev, dir->hdr.next, dir->hdr.n, dir->free);
 		next = dir->hdr.next;
 		for(i=0; i<dir->hdr.n; i++)
 			fprint(fd, "\t%.*s: %.*s\n", 
@@ -791,6 +947,7 @@ listclose(DMap *map)
 
 	list = map2list(map);
 	r = list->hdr->close(list->hdr);
+	freelistidx(list);
 	free(list);
 	return r;
 }
@@ -809,7 +966,7 @@ listfree(DMap *map)
 {
 	DListpage *dir;
 	DList *list;
-	ulong a, next;
+	uvlong a, next;
 
 	list = map2list(map);
 	for(a=list->firstblock; a; a=next){
@@ -820,10 +977,86 @@ listfree(DMap *map)
 		freelistpage(dir);
 	}
 	list->hdr->free(list->hdr);
+	freelistidx(list);
 	free(list);
 	return 0;
 }
 
+/*
+ * move list pages down into free pages below them.
+ * only the list header is addressed from outside the
+ * list, so the pages can go anywhere as long as
+ * their neighbors (or the header) are told.
+ */
+static int
+listcompact(DMap *map)
+{
+	int n;
+	uvlong a, f, next, prev;
+	DBlock *b, *nb, *pb, *xb;
+	DList *list;
+	DStore *s;
+
+	list = map2list(map);
+	freelistidx(list);
+	s = list->s;
+	n = 0;
+	prev = 0;
+	for(a=list->firstblock; a; prev=a, a=next){
+		if((b = s->read(s, a)) == nil)
+			return -1;
+		next = getaddr(s, (uchar*)b->a+4+s->addrsize);
+		f = dstorefirstfree(s);
+		if(f == 0 || f > a){
+			b->close(b);
+			continue;
+		}
+		pb = nil;
+		xb = nil;
+		if((prev && (pb = s->read(s, prev)) == nil)
+		|| (next && (xb = s->read(s, next)) == nil)
+		|| (nb = s->alloc(s, b->n)) == nil){
+			if(pb)
+				pb->close(pb);
+			if(xb)
+				xb->close(xb);
+			b->close(b);
+			return -1;
+		}
+		if(nb->addr > a){
+			nb->free(nb);
+			if(pb)
+				pb->close(pb);
+			if(xb)
+				xb->close(xb);
+			b->close(b);
+			continue;
+		}
+		memmove(nb->a, b->a, b->n);
+		nb->flags |= DDirty;
+		if(pb){
+			putaddr(s, (uchar*)pb->a+4+s->addrsize, nb->addr);
+			pb->flags |= DDirty;
+			pb->close(pb);
+		}else{
+			list->firstblock = nb->addr;
+			putaddr(s, list->firstblockp, list->firstblock);
+			list->hdr->flags |= DDirty;
+			list->hdr->flush(list->hdr);
+		}
+		if(xb){
+			putaddr(s, (uchar*)xb->a+4, nb->addr);
+			xb->flags |= DDirty;
+			xb->close(xb);
+		}
+		a = nb->addr;
+		nb->close(nb);
+		b->free(b);
+		n++;
+	}
+	return n;
+}
+
 static int
 listisempty(DMap *map)
 {	
@@ -834,38 +1067,38 @@ listisempty(DMap *map)
 }
 
 DMap*
-dmaplist(DStore *s, u32int addr, uint pagesize)
+dmaplist(DStore *s, uvlong addr, uint pagesize)
 {
 	DList *l;
 	DBlock *hdr;
 	uchar *p;
 
-	l = malloc(sizeof(DList));
+	l = mallocz(sizeof(DList), 1);
 	if(l == nil)
 		return nil;
 
 	if(addr == 0){
 		if(pagesize == 0)
 			panic("cannot allocate list with page size 0");
-		hdr = s->alloc(s, 12);
+		hdr = s->alloc(s, LHDRSIZE(s));
 		if(hdr == nil)
 			return nil;
 		p = hdr->a;
 		memmove(p, "LHDR", 4);
 		p += 4;
-		PLONG(p, 0);
-		p += 4;
+		putaddr(s, p, 0);
+		p += s->addrsize;
 		PLONG(p, pagesize);
 		hdr->flags |= DDirty;
 	}else{
 		hdr = s->read(s, addr);
 		if(hdr == nil)
 			return nil;
-		if(hdr->n != 12 || memcmp(hdr->a, "LHDR", 4) != 0){
-			if(hdr->n != 12)
-				werrstr("bad list header at 0x%ux; size %ud expected 12", addr, hdr->n);
+		if(hdr->n != LHDRSIZE(s) || memcmp(hdr->a, "LHDR", 4) != 0){
+			if(hdr->n != LHDRSIZE(s))
+				werrstr("bad list header at 0x%llux; size %ud expected %d", addr, hdr->n, LHDRSIZE(s));
 			else
-				werrstr("bad list header at 0x%ux: magic %.8ux", addr, *(u32int*)hdr->a);
+				werrstr("bad list header at 0x%llux: magic %.8ux", addr, *(u32int*)hdr->a);
 			hdr->close(hdr);
 			return nil;
 		}
@@ -883,12 +1116,14 @@ dmaplist(DStore *s, u32int addr, uint pagesize)
 	l->m.flush = listflush;
 	l->m.addr = hdr->addr;
 	l->m.isempty = listisempty;
+	l->m.compact = listcompact;
 	l->magic = (u32int)map2list;
+	l->hdrsize = DLISTHDRSIZE(s);
 	p = hdr->a;
 	p += 4;
 	l->firstblockp = p;
-	l->firstblock = LONG(p);
-	p += 4;
+	l->firstblock = getaddr(s, p);
+	p += s->addrsize;
 	l->pagesize = LONG(p);
 	l->hdr = hdr;
 	return &l->m;
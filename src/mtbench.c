@@ -0,0 +1,194 @@
+#include "tra.h"
+#include "avl.h"
+#include "mtree.h"
+
+/*
+ * compare the in-memory trees: avl.c against mtree.c.
+ *
+ *	mtbench [-n nentry]...
+ *
+ * for each size (default 1000, 100000, 1000000), inserts
+ * nentry items in random order, looks each up in another
+ * random order, walks them in order, and deletes them all.
+ * the keys look like file names.
+ */
+
+typedef struct Item Item;
+struct Item
+{
+	Avl avl;
+	Datum k;
+};
+
+void
+usage(void)
+{
+	fprint(2, "usage: mtbench [-n nentry]...\n");
+	exits("usage");
+}
+
+static int
+itemcmp(Avl *a, Avl *b)
+{
+	return datumcmp(&((Item*)a)->k, &((Item*)b)->k);
+}
+
+static Datum*
+itemkey(void *v)
+{
+	return &((Item*)v)->k;
+}
+
+static void
+shuffle(int *p, int n)
+{
+	int i, j, x;
+
+	for(i=0; i<n; i++)
+		p[i] = i;
+	for(i=n-1; i>0; i--){
+		j = random()%(i+1);
+		x = p[i];
+		p[i] = p[j];
+		p[j] = x;
+	}
+}
+
+static double
+ns(vlong t, int n)
+{
+	return (double)t/n;
+}
+
+static void
+bench(int n)
+{
+	int i, *ins, *look, *del;
+	char *buf;
+	vlong t, tins, tlook, twalk, tdel;
+	Avl *a;
+	Avltree *at;
+	Avlwalk *aw;
+	Item *it, *x, *prev;
+	Mtree *mt;
+	Mtreewalk *mw;
+
+	it = emalloc(n*sizeof it[0]);
+	buf = emalloc(n*16);
+	for(i=0; i<n; i++){
+		it[i].k.a = buf+i*16;
+		it[i].k.n = sprint(it[i].k.a, "file%d.c", i);
+	}
+	ins = emalloc(n*sizeof ins[0]);
+	look = emalloc(n*sizeof look[0]);
+	del = emalloc(n*sizeof del[0]);
+	shuffle(ins, n);
+	shuffle(look, n);
+	shuffle(del, n);
+
+	t = nsec();
+	at = mkavltree(itemcmp);
+	for(i=0; i<n; i++){
+		a = nil;
+		insertavl(at, &it[ins[i]].avl, &a);
+	}
+	tins = nsec()-t;
+	t = nsec();
+	for(i=0; i<n; i++)
+		if(lookupavl(at, &it[look[i]].avl) != &it[look[i]].avl)
+			sysfatal("avl lookup %d", look[i]);
+	tlook = nsec()-t;
+	t = nsec();
+	aw = avlwalk(at);
+	for(i=0; avlnext(aw) != nil; i++)
+		;
+	endwalk(aw);
+	twalk = nsec()-t;
+	if(i != n)
+		sysfatal("avl walk %d of %d", i, n);
+	t = nsec();
+	for(i=0; i<n; i++){
+		deleteavl(at, &it[del[i]].avl, &a);
+		if(a != &it[del[i]].avl)
+			sysfatal("avl delete %d", del[i]);
+	}
+	tdel = nsec()-t;
+	freeavltree(at);
+	print("%8d avl\tinsert %4.0fns lookup %4.0fns walk %4.1fns delete %4.0fns\n",
+		n, ns(tins, n), ns(tlook, n), ns(twalk, n), ns(tdel, n));
+
+	t = nsec();
+	mt = mkmtree(itemkey);
+	for(i=0; i<n; i++)
+		if(mtreeinsert(mt, &it[ins[i]]) != nil)
+			sysfatal("mtree insert %d", ins[i]);
+	tins = nsec()-t;
+	t = nsec();
+	for(i=0; i<n; i++)
+		if(mtreelookup(mt, &it[look[i]].k) != &it[look[i]])
+			sysfatal("mtree lookup %d", look[i]);
+	tlook = nsec()-t;
+	t = nsec();
+	mw = mtreewalk(mt, 0);
+	for(i=0; mtreenext(mw) != nil; i++)
+		;
+	endmtreewalk(mw);
+	twalk = nsec()-t;
+	if(i != n)
+		sysfatal("mtree walk %d of %d", i, n);
+	mw = mtreewalk(mt, 0);
+	for(prev=nil; (x = mtreenext(mw)) != nil; prev=x)
+		if(prev && datumcmp(&prev->k, &x->k) >= 0)
+			sysfatal("mtree walk out of order");
+	endmtreewalk(mw);
+	print("\t mtree\tinsert %4.0fns lookup %4.0fns walk %4.1fns",
+		ns(tins, n), ns(tlook, n), ns(twalk, n));
+	print(" mem %lldB/item", mtreemem(mt)/n);
+	t = nsec();
+	for(i=0; i<n; i++)
+		if(mtreedelete(mt, &it[del[i]].k) != &it[del[i]])
+			sysfatal("mtree delete %d", del[i]);
+	tdel = nsec()-t;
+	if(!isemptymtree(mt))
+		sysfatal("mtree not empty");
+	freemtree(mt);
+	print(" delete %4.0fns\n", ns(tdel, n));
+
+	free(it);
+	free(buf);
+	free(ins);
+	free(look);
+	free(del);
+}
+
+void
+main(int argc, char **argv)
+{
+	int i, nn, n[10];
+
+	nn = 0;
+	ARGBEGIN{
+	case 'n':
+		if(nn == nelem(n))
+			usage();
+		n[nn++] = atoi(EARGF(usage()));
+		break;
+	default:
+		usage();
+	}ARGEND
+
+	if(argc != 0)
+		usage();
+	if(nn == 0){
+		n[nn++] = 1000;
+		n[nn++] = 100000;
+		n[nn++] = 1000000;
+	}
+	srandom(1);
+	for(i=0; i<nn; i++){
+		if(n[i] <= 0)
+			usage();
+		bench(n[i]);
+	}
+	exits(nil);
+}
@@ -0,0 +1,569 @@
+#include "tra.h"
+#include "mtree.h"
+
+/*
+ * In-memory ordered set kept as a B+ tree of small nodes,
+ * so that a search reads a few arrays instead of chasing a
+ * pointer per level as in avl.c.  The tree doesn't own the
+ * items; key(item) is the Datum an item is sorted by (as by
+ * datumcmp), and it must not change while the item is in
+ * the tree.
+ *
+ * Next to each item or child pointer, a node holds the first
+ * eight bytes of its key as a big-endian number, so most
+ * comparisons are settled without touching the key itself.
+ * Interior nodes keep their own copies of the separating keys:
+ * sep[i] is the least key that can be under child i (sep[0] is
+ * unused).  The leaves are chained both ways for walks.
+ *
+ * As in btree.c, a node that overflows is split in two,
+ * except that at the outside edge of the tree the old node
+ * is left full, and a node that falls below a quarter full
+ * is merged with a neighbor or takes half of its entries.
+ *
+ * A walk can go on while the tree changes: it finds its place
+ * again after the last item it returned, which must still be
+ * valid memory even if it has been deleted.
+ */
+
+enum
+{
+	Fan = 64,
+
+	Left = 1,	/* node is at the outside edge of the tree */
+	Right = 2,
+};
+
+typedef struct Node Node;
+struct Node
+{
+	int leaf;
+	int n;
+	Node *prev;	/* leaves, in key order */
+	Node *next;
+	uvlong pfx[Fan];	/* first bytes of each key */
+	void *p[Fan];	/* items in leaves, children in interior nodes */
+	Datum *sep;	/* interior nodes: the keys */
+};
+
+struct Mtree
+{
+	Node *root;
+	Datum *(*key)(void*);
+	int nitem;
+	ulong version;	/* bumped by every change, for walks */
+	uvlong mem;	/* in nodes and keys */
+};
+
+struct Mtreewalk
+{
+	Mtree *tree;
+	int back;
+	int started;
+	Node *n;
+	int i;
+	void *last;
+	ulong version;
+};
+
+static uvlong
+prefix(Datum *k)
+{
+	int i;
+	uchar *a;
+	uvlong p;
+
+	a = k->a;
+	if(k->n >= 8)
+		return (uvlong)a[0]<<56 | (uvlong)a[1]<<48 | (uvlong)a[2]<<40
+			| (uvlong)a[3]<<32 | (u32int)a[4]<<24 | a[5]<<16
+			| a[6]<<8 | a[7];
+	p = 0;
+	for(i=0; i<8; i++){
+		p <<= 8;
+		if(i < k->n)
+			p |= a[i];
+	}
+	return p;
+}
+
+static int
+keycmp(Mtree *t, Node *n, int i, uvlong kp, Datum *k)
+{
+	if(n->pfx[i] != kp)
+		return n->pfx[i] < kp ? -1 : 1;
+	if(n->leaf)
+		return datumcmp(t->key(n->p[i]), k);
+	return datumcmp(&n->sep[i], k);
+}
+
+/*
+ * the index of the first key in n not less than k;
+ * *eq says whether it is k.
+ */
+static int
+search(Mtree *t, Node *n, uvlong kp, Datum *k, int *eq)
+{
+	int lo, hi, m, c;
+
+	*eq = 0;
+	lo = n->leaf ? 0 : 1;
+	hi = n->n;
+	while(lo < hi){
+		m = (lo+hi)/2;
+		c = keycmp(t, n, m, kp, k);
+		if(c == 0){
+			*eq = 1;
+			return m;
+		}
+		if(c < 0)
+			lo = m+1;
+		else
+			hi = m;
+	}
+	return lo;
+}
+
+/*
+ * the child of interior node n that would hold k.
+ */
+static int
+child(Mtree *t, Node *n, uvlong kp, Datum *k)
+{
+	int i, eq;
+
+	i = search(t, n, kp, k, &eq);
+	return eq ? i : i-1;
+}
+
+static Node*
+mknode(Mtree *t, int leaf)
+{
+	Node *n;
+
+	n = emalloc(sizeof *n);
+	n->leaf = leaf;
+	t->mem += sizeof *n;
+	if(!leaf){
+		n->sep = emalloc(Fan*sizeof n->sep[0]);
+		t->mem += Fan*sizeof n->sep[0];
+	}
+	return n;
+}
+
+static void
+freenode(Mtree *t, Node *n)
+{
+	t->mem -= sizeof *n;
+	if(n->sep){
+		t->mem -= Fan*sizeof n->sep[0];
+		free(n->sep);
+	}
+	free(n);
+}
+
+static void
+copysep(Mtree *t, Datum *d, Datum *k)
+{
+	d->a = emallocnz(k->n);
+	d->n = k->n;
+	memmove(d->a, k->a, k->n);
+	t->mem += k->n;
+}
+
+static void
+freesep(Mtree *t, Datum *d)
+{
+	t->mem -= d->n;
+	free(d->a);
+	d->a = nil;
+	d->n = 0;
+}
+
+/*
+ * the key to file r under in its parent.
+ * an interior node gives up its sep[0].
+ */
+static void
+lowkey(Mtree *t, Node *r, uvlong *pfx, Datum *sep)
+{
+	*pfx = r->pfx[0];
+	if(r->leaf)
+		copysep(t, sep, t->key(r->p[0]));
+	else{
+		*sep = r->sep[0];
+		r->sep[0].a = nil;
+		r->sep[0].n = 0;
+	}
+}
+
+static void
+put(Node *n, int i, uvlong pfx, void *p, Datum *sep)
+{
+	int m;
+
+	m = n->n - i;
+	memmove(&n->pfx[i+1], &n->pfx[i], m*sizeof n->pfx[0]);
+	memmove(&n->p[i+1], &n->p[i], m*sizeof n->p[0]);
+	n->pfx[i] = pfx;
+	n->p[i] = p;
+	if(!n->leaf){
+		memmove(&n->sep[i+1], &n->sep[i], m*sizeof n->sep[0]);
+		n->sep[i] = *sep;
+	}
+	n->n++;
+}
+
+static void
+cut(Node *n, int i)
+{
+	int m;
+
+	n->n--;
+	m = n->n - i;
+	memmove(&n->pfx[i], &n->pfx[i+1], m*sizeof n->pfx[0]);
+	memmove(&n->p[i], &n->p[i+1], m*sizeof n->p[0]);
+	if(!n->leaf)
+		memmove(&n->sep[i], &n->sep[i+1], m*sizeof n->sep[0]);
+}
+
+/*
+ * put (pfx, p, sep) at i in the full node n by splitting it;
+ * returns the new right half.
+ */
+static Node*
+split(Mtree *t, Node *n, int i, uvlong pfx, void *p, Datum *sep, int edge)
+{
+	int s, first, left;
+	Node *r;
+
+	first = n->leaf ? 0 : 1;
+	if(i == n->n && (edge&Right)){
+		s = n->n;
+		left = 0;
+	}else if(i == first && (edge&Left)){
+		s = first;
+		left = 1;
+	}else{
+		s = n->n/2;
+		left = i < s;
+	}
+
+	r = mknode(t, n->leaf);
+	r->n = n->n - s;
+	memmove(r->pfx, &n->pfx[s], r->n*sizeof r->pfx[0]);
+	memmove(r->p, &n->p[s], r->n*sizeof r->p[0]);
+	if(!n->leaf)
+		memmove(r->sep, &n->sep[s], r->n*sizeof r->sep[0]);
+	n->n = s;
+	if(n->leaf){
+		r->prev = n;
+		r->next = n->next;
+		if(r->next)
+			r->next->prev = r;
+		n->next = r;
+	}
+	if(left)
+		put(n, i, pfx, p, sep);
+	else
+		put(r, i-s, pfx, p, sep);
+	return r;
+}
+
+static Node*
+insert(Mtree *t, Node *n, uvlong kp, Datum *k, void *item, void **old, int edge)
+{
+	int i, eq, e;
+	uvlong pfx;
+	Datum sep;
+	Node *r;
+
+	if(n->leaf){
+		i = search(t, n, kp, k, &eq);
+		if(eq){
+			*old = n->p[i];
+			n->p[i] = item;
+			return nil;
+		}
+		if(n->n < Fan){
+			put(n, i, kp, item, nil);
+			return nil;
+		}
+		return split(t, n, i, kp, item, nil, edge);
+	}
+
+	i = child(t, n, kp, k);
+	e = 0;
+	if(i == 0)
+		e |= edge&Left;
+	if(i == n->n-1)
+		e |= edge&Right;
+	if((r = insert(t, n->p[i], kp, k, item, old, e)) == nil)
+		return nil;
+	lowkey(t, r, &pfx, &sep);
+	if(n->n < Fan){
+		put(n, i+1, pfx, r, &sep);
+		return nil;
+	}
+	return split(t, n, i+1, pfx, r, &sep, edge);
+}
+
+/*
+ * merge children j and j+1 of n if they fit in one node,
+ * or else share their entries out evenly.
+ */
+static void
+rebalance(Mtree *t, Node *n, int j)
+{
+	int m, tot;
+	uvlong pfx[2*Fan];
+	void *p[2*Fan];
+	Datum sep[2*Fan];
+	Node *l, *r;
+
+	l = n->p[j];
+	r = n->p[j+1];
+	tot = l->n + r->n;
+	memmove(pfx, l->pfx, l->n*sizeof pfx[0]);
+	memmove(pfx+l->n, r->pfx, r->n*sizeof pfx[0]);
+	memmove(p, l->p, l->n*sizeof p[0]);
+	memmove(p+l->n, r->p, r->n*sizeof p[0]);
+	if(l->leaf)
+		freesep(t, &n->sep[j+1]);
+	else{
+		memmove(sep, l->sep, l->n*sizeof sep[0]);
+		memmove(sep+l->n, r->sep, r->n*sizeof sep[0]);
+		sep[l->n] = n->sep[j+1];
+		pfx[l->n] = n->pfx[j+1];
+	}
+
+	if(tot <= Fan){
+		memmove(l->pfx, pfx, tot*sizeof pfx[0]);
+		memmove(l->p, p, tot*sizeof p[0]);
+		if(!l->leaf)
+			memmove(l->sep, sep, tot*sizeof sep[0]);
+		l->n = tot;
+		if(l->leaf){
+			l->next = r->next;
+			if(l->next)
+				l->next->prev = l;
+		}
+		cut(n, j+1);
+		freenode(t, r);
+		return;
+	}
+
+	m = tot/2;
+	memmove(l->pfx, pfx, m*sizeof pfx[0]);
+	memmove(l->p, p, m*sizeof p[0]);
+	l->n = m;
+	memmove(r->pfx, pfx+m, (tot-m)*sizeof pfx[0]);
+	memmove(r->p, p+m, (tot-m)*sizeof p[0]);
+	r->n = tot-m;
+	if(!l->leaf){
+		memmove(l->sep, sep, m*sizeof sep[0]);
+		memmove(r->sep, sep+m, (tot-m)*sizeof sep[0]);
+	}
+	lowkey(t, r, &n->pfx[j+1], &n->sep[j+1]);
+}
+
+static void*
+delete(Mtree *t, Node *n, uvlong kp, Datum *k)
+{
+	int i, eq;
+	void *item;
+	Node *c;
+
+	if(n->leaf){
+		i = search(t, n, kp, k, &eq);
+		if(!eq)
+			return nil;
+		item = n->p[i];
+		cut(n, i);
+		return item;
+	}
+
+	i = child(t, n, kp, k);
+	c = n->p[i];
+	item = delete(t, c, kp, k);
+	if(item != nil && c->n < Fan/4 && n->n > 1)
+		rebalance(t, n, i > 0 ? i-1 : i);
+	return item;
+}
+
+Mtree*
+mkmtree(Datum *(*key)(void*))
+{
+	Mtree *t;
+
+	t = emalloc(sizeof *t);
+	t->key = key;
+	t->root = mknode(t, 1);
+	return t;
+}
+
+/*
+ * add item, replacing and returning
+ * any item with the same key.
+ */
+void*
+mtreeinsert(Mtree *t, void *item)
+{
+	void *old;
+	uvlong pfx;
+	Datum *k, sep;
+	Node *r, *root;
+
+	k = t->key(item);
+	old = nil;
+	if((r = insert(t, t->root, prefix(k), k, item, &old, Left|Right)) != nil){
+		root = mknode(t, 0);
+		root->p[0] = t->root;
+		root->n = 1;
+		lowkey(t, r, &pfx, &sep);
+		put(root, 1, pfx, r, &sep);
+		t->root = root;
+	}
+	if(old == nil)
+		t->nitem++;
+	t->version++;
+	return old;
+}
+
+void*
+mtreelookup(Mtree *t, Datum *k)
+{
+	int i, eq;
+	uvlong kp;
+	Node *n;
+
+	kp = prefix(k);
+	for(n=t->root; !n->leaf; n=n->p[child(t, n, kp, k)])
+		;
+	i = search(t, n, kp, k, &eq);
+	return eq ? n->p[i] : nil;
+}
+
+/*
+ * remove and return the item with key k.
+ */
+void*
+mtreedelete(Mtree *t, Datum *k)
+{
+	void *item;
+	Node *root;
+
+	if((item = delete(t, t->root, prefix(k), k)) == nil)
+		return nil;
+	root = t->root;
+	if(!root->leaf && root->n == 1){
+		t->root = root->p[0];
+		freenode(t, root);
+	}
+	t->nitem--;
+	t->version++;
+	return item;
+}
+
+/*
+ * walk the items in key order, or backward.
+ */
+Mtreewalk*
+mtreewalk(Mtree *t, int back)
+{
+	Mtreewalk *w;
+
+	w = emalloc(sizeof *w);
+	w->tree = t;
+	w->back = back;
+	return w;
+}
+
+void*
+mtreenext(Mtreewalk *w)
+{
+	int eq;
+	uvlong kp;
+	Datum *k;
+	Node *n;
+	Mtree *t;
+
+	t = w->tree;
+	if(!w->started){
+		w->started = 1;
+		for(n=t->root; !n->leaf; n=n->p[w->back ? n->n-1 : 0])
+			;
+		w->n = n;
+		w->i = w->back ? n->n-1 : 0;
+	}else if(w->n == nil)
+		return nil;
+	else if(w->version != t->version){
+		/* the tree changed under us; find our place again */
+		k = t->key(w->last);
+		kp = prefix(k);
+		for(n=t->root; !n->leaf; n=n->p[child(t, n, kp, k)])
+			;
+		w->n = n;
+		w->i = search(t, n, kp, k, &eq);
+		if(w->back)
+			w->i--;
+		else if(eq)
+			w->i++;
+	}else
+		w->i += w->back ? -1 : 1;
+
+	while(w->i < 0 || w->i >= w->n->n){
+		if(w->back){
+			if((w->n = w->n->prev) == nil)
+				return nil;
+			w->i = w->n->n-1;
+		}else{
+			if((w->n = w->n->next) == nil)
+				return nil;
+			w->i = 0;
+		}
+	}
+	w->last = w->n->p[w->i];
+	w->version = t->version;
+	return w->last;
+}
+
+void
+endmtreewalk(Mtreewalk *w)
+{
+	free(w);
+}
+
+int
+isemptymtree(Mtree *t)
+{
+	return t->nitem == 0;
+}
+
+uvlong
+mtreemem(Mtree *t)
+{
+	return sizeof *t + t->mem;
+}
+
+static void
+freenodes(Mtree *t, Node *n)
+{
+	int i;
+
+	if(!n->leaf)
+		for(i=0; i<n->n; i++){
+			freenodes(t, n->p[i]);
+			if(i > 0)
+				freesep(t, &n->sep[i]);
+		}
+	freenode(t, n);
+}
+
+void
+freemtree(Mtree *t)
+{
+	freenodes(t, t->root);
+	free(t);
+	/* can't free the items; we didn't allocate them */
+}
@@ -0,0 +1,13 @@
+typedef struct Mtree Mtree;
+typedef struct Mtreewalk Mtreewalk;
+
+Mtree *mkmtree(Datum*(*key)(void*));
+void *mtreeinsert(Mtree *tree, void *item);
+void *mtreelookup(Mtree *tree, Datum *key);
+void *mtreedelete(Mtree *tree, Datum *key);
+Mtreewalk *mtreewalk(Mtree *tree, int back);
+void *mtreenext(Mtreewalk *walk);
+void endmtreewalk(Mtreewalk *walk);
+int isemptymtree(Mtree *tree);
+uvlong mtreemem(Mtree *tree);
+void freemtree(Mtree *tree);
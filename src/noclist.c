@@ -13,12 +13,35 @@ flushlistcache(Listcache *lc)
 }
 
 DMap*
-dmapclist(Listcache *lc, DStore *s, u32int addr, uint size)
+dmapclist(Listcache *lc, DStore *s, uvlong addr, uint size)
 {
 	USED(lc);
+	if(addr)
+		return dmapopen(s, addr);
 	return dmaplist(s, addr, size);
 }
 
+void
+listcachebigdir(Listcache *lc, int n)
+{
+	USED(lc);
+	USED(n);
+}
+
+void
+listcachesize(Listcache *lc, uvlong size)
+{
+	USED(lc);
+	USED(size);
+}
+
+void
+listcachestats(Listcache *lc, LStats *st)
+{
+	USED(lc);
+	memset(st, 0, sizeof *st);
+}
+
 Listcache*
 openlistcache(void)
 {
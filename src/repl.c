@@ -123,6 +123,23 @@ replflush(Replica *r)
 	return 0;
 }
 
+/*
+ * wait up to ms milliseconds for input, sending any
+ * buffered replies first.  returns 1 if there is
+ * something to read, 0 on timeout, -1 on error.
+ */
+int
+replwait(Replica *r, long ms)
+{
+	if(r->err)
+		return -1;
+	if(tcanread(r->rfd))
+		return 1;
+	if(replflush(r) < 0)
+		return -1;
+	return twait(r->rfd, ms);
+}
+
 void
 replclose(Replica *r)
 {
@@ -4,6 +4,12 @@
 #include "storage.h"
 
 int		syscreateexcl(char*);
+int		syspwritev(int, void**, uint*, int, vlong);
+void		sysprefetch(int, vlong, vlong);
+void*	sysmmap(int, uvlong);
+void		sysmunmap(void*, uvlong);
+int		syslock(int, int, int);
+void		sysunlock(int);
 
 #define dodebug 0
 #define DBG if(!dodebug){}else
@@ -11,15 +17,19 @@ int		syscreateexcl(char*);
 typedef struct XDBlock XDBlock;
 typedef struct XDStore XDStore;
 typedef struct Dpage Dpage;
+typedef struct Sumchunk Sumchunk;
+typedef struct Snap Snap;
 
 struct Dpage
 {
 	int		nref;
 	u32int	flags;
-	u32int	addr;
+	uvlong	addr;
 	uchar*	a;
 	XDStore*	s;
 	Dpage*	next;		/* in hash list */
+	Dpage*	lnext;	/* in lru list */
+	Dpage*	lprev;
 };
 
 struct XDStore
@@ -28,18 +38,72 @@ struct XDStore
 	void*	magic;
 
 	int		ignorewrites;
+	int		durability;
 	char*	base;
 	char*	redo;
+	char*	sumpath;
 	int		broken;
 	int		fd;
 	int		logfd;
+	int		sumfd;	/* page checksums, or -1 */
+	uvlong	storeid;	/* random; ties name.sum to this store */
+	uvlong	gen;		/* flushes so far; also in name.sum */
+	Sumchunk**	sum;	/* read in on demand */
+	ulong	nsum;
+	int		verify;	/* check pages read from disk */
 	uint		lgpagesz;
-	u32int	end;
+	uint		lgmindat;
+	uvlong	end;
 	Dpage*	root;
-	Dpage*	hash[256];
+	Dpage**	hash;
+	uint		lghash;	/* log2 of number of hash chains */
+	Dpage*	lruhead;	/* most recently used */
+	Dpage*	lrutail;
+	ulong	npage;
+	ulong	maxpage;
+	uchar*	map;		/* private mapping of the file, or nil */
+	uvlong	maplen;	/* as mapped */
+	uvlong	mapsize;	/* pages below this are read through it */
+	ulong	nmapped;	/* pages served from map, not counted in npage */
+	int		wantflush;	/* cache is full of dirty pages */
+	ulong	ndirty;
+	int		held;		/* caller holds changes for the next flush */
+	int		(*onflush)(void*);	/* see dstoreonflush */
+	void*	onflusharg;
+	ulong	maxdirty;	/* checkpoint after this many dirty pages */
+	ulong	ckptsecs;	/* or when the oldest change is this old */
+	ulong	ckpttime;	/* first change since last checkpoint */
+	DStats	stats;
+	uvlong*	fpage;	/* whole free pages, highest first */
+	ulong	nfpage;
+	ulong	mfpage;
+	int		trimmed;	/* end moved down; truncate at next flush */
+	Snap*	snap;		/* readers' snapshots, when writing */
+	int		snapfd;	/* our snapshot, when reading one; else -1 */
+	char*	snappath;
+	uvlong	snapat;	/* file size when it was taken */
+	uvlong	snapend;	/* old pages read so far */
+	uvlong*	snapoff;	/* where in snapfd each old page is, or 0 */
+	int		nlock;	/* snaplock depth */
 	XDBlock*	free[1];	/* unwarranted chumminess */
 };
 
+struct Sumchunk
+{
+	int		dirty;
+	u32int	sum[1024];
+};
+
+struct Snap
+{
+	int		slot;
+	int		fd;
+	uvlong	end;		/* file size when it was taken */
+	uvlong	off;		/* where the next old page goes */
+	uchar*	saved;	/* bitmap of pages already there */
+	Snap*	next;
+};
+
 struct XDBlock
 {
 	DBlock	db;
@@ -52,76 +116,177 @@ struct XDBlock
 	XDBlock*	next;	/* in free list */
 };
 
+/*
+ * Stores come in two formats, told apart by the first
+ * line of the root page.  Both hold the block addresses
+ * of the free list heads after the header line, and each
+ * free fragment holds the addresses of its neighbors
+ * in the free list after its own header.
+ *
+ *	"dstore %d\n": 4-byte addresses, so at most 4GB.
+ *	"dstore64 %d\n": 8-byte addresses.  The two links
+ *	in a free fragment don't fit in 16 bytes anymore,
+ *	so the smallest fragment is 32 bytes.
+ *
+ * The free list heads are followed by the end of the store.
+ * Whole free pages at the end are cut off the free list and
+ * the file is truncated to match; if we crash before the
+ * truncation, openpathfd finishes it.  Zero (older stores)
+ * means the end of the file.
+ *
+ * Whole free pages are also indexed in memory (fpage) so that
+ * allocation can hand out the lowest one; over time that
+ * drains the end of the file and lets it be cut off.
+ *
+ * The CRC-32C of each page as last written is kept in a
+ * separate file, name.sum, 4 bytes per page; 0 means unknown
+ * (pages never written since the file was started).  The sums
+ * are written after the pages and before the redo log is
+ * truncated, so replaying the log repairs them too.  A page
+ * is checked when it is read from disk, not before.
+ *
+ * After the end of the store, the root page holds a random
+ * store id and a count of flushes.  name.sum starts with
+ * "sum\n" and the same two numbers, rewritten after the sums
+ * at each flush.  A sum file whose numbers don't match, say
+ * one left from a copy of the store made at another time, is
+ * started over from the pages on disk rather than believed.
+ * Older stores have zero for the id and get one when opened.
+ *
+ * A reader that must not stop the writer takes a snapshot: it
+ * creates name.snapN, holding "snapshot" and the file size as of
+ * the last checkpoint, and keeps it locked.  Before a checkpoint
+ * overwrites a page below that size, the writer appends the
+ * page's address and old contents to each such file that lacks
+ * it.  The reader reads a page from its file if it is there and
+ * from the store otherwise.  The writer holds name.redo locked
+ * exclusively from saving old pages until the log is truncated;
+ * the reader holds it shared while it reads a page.  A snapshot
+ * file that can be locked belongs to a reader that died.  While
+ * any snapshot is live, the file is not truncated.
+ */
 enum
 {
 	LogMindat	= 4,		/* 16 bytes is smallest stored fragment size */
+	LogMindat64	= 5,
 	MinPagesize	= 128,	/* can't use pagesz < 128 */
-
-	HdrSize = 8
+	MinCache	= 64,	/* pages; a few are always pinned */
+	LogMinHash	= 8,
+	DefMaxDirty	= 1024,	/* pages */
+	DefCkptSecs	= 60,
+	DefCacheSize	= 32*1024*1024,
+
+	HdrSize = 8,
+	SnapHdr	= 16,
+	SumHdr	= 20,
+	MaxSnap	= 8,
+
+	PMapped	= 1<<16,	/* Dpage.a points into XDStore.map */
 };
 
-static	int		Bgbit32(Biobuf*, u32int*);
-static	int		Bpbit32(Biobuf*, u32int);
-static	uint		ahash(u32int, uint);
+static	int		Bgbitaddr(XDStore*, Biobuf*, uvlong*);
+static	uint		ahash(XDStore*, uvlong);
+static	void		addfpage(XDStore*, uvlong);
+static	char*	auxname(char*, char*);
 static	XDBlock*	allocdata(XDStore*, uint);
 static	Dpage*	allocpage(XDStore*);
 static 	int		applylog(XDStore*);
 static	void		branddata(XDBlock*);
+static	int		checkloaded(XDStore*);
+static	int		checkpage(XDStore*, Dpage*);
+static	void		dirtypage(Dpage*);
+static	void		droppage(XDStore*, uvlong);
 static	int		cleanpages(XDStore*);
-static	Dpage*	evictpage(XDStore*, u32int);
-static	Dpage*	findpage(XDStore*, u32int);
+static	Dpage*	evictpage(XDStore*, uvlong);
+static	Dpage*	findpage(XDStore*, uvlong);
+static	int		findsnaps(XDStore*);
 static	int		flush(XDStore*, int);
 static	void		freedata(XDBlock*);
+static	void		freepage(XDStore*, Dpage*);
 static	u32int	gbit32(uchar*);
+static	uvlong	gbit64(uchar*);
+static	uvlong	gbitaddr(XDStore*, uchar*);
+static	void		hashpage(XDStore*, Dpage*);
 static	int		isemptylog(XDStore*);
-static	XDBlock*	loaddata(XDStore*, u32int);
-static	Dpage*	loadpage(XDStore*, u32int);
+static	int		loadfpages(XDStore*);
+static	int		lockstore(XDStore*);
+static	int		needflush(XDStore*);
+static	u32int	pagesum(XDStore*, uchar*);
+static	XDBlock*	loaddata(XDStore*, uvlong);
+static	Dpage*	loadpage(XDStore*, uvlong);
+static	Dpage*	mappage(XDStore*, uvlong);
 static	int		dblog2(int);
 static	XDBlock*	mkdata(XDStore*, Dpage*, uchar*, uint);
-static	Dpage*	mkpage(XDStore*, u32int);
-static	DStore*	openpathfd(char*, int);
+static	Dpage*	mkpage(XDStore*, uvlong);
+static	int		mksnap(XDStore*);
+static	DStore*	openpathfd(char*, int, int);
 static	void		pbit32(uchar*, u32int);
+static	void		pbit64(uchar*, uvlong);
+static	void		pbitaddr(XDStore*, uchar*, uvlong);
+static	int		rebuildsums(XDStore*);
+static	int		savesnaps(XDStore*, Dpage**, int);
+static	int		setsum(XDStore*, uvlong, uchar*);
+static	int		snaplock(XDStore*);
+static	long		snapread(XDStore*, uchar*, uvlong);
+static	void		snapunlock(XDStore*);
+static	Sumchunk*	sumchunk(XDStore*, uvlong);
+static	int		sumsmatch(XDStore*, int);
 static	XDBlock*	popfree(XDStore*, int);
 static	long		preadn(int, void*, long, vlong);
+static	void		lrufront(XDStore*, Dpage*);
+static	void		lruunlink(XDStore*, Dpage*);
+static	void		unhashpage(XDStore*, Dpage*);
+static	XDBlock*	takefpage(XDStore*);
+static	int		trimtail(XDStore*);
 static	int		truncatelog(XDStore*);
-static	int		unfreedata(XDStore*, u32int, int);
+static	int		unfreedata(XDStore*, uvlong, int);
+static	void		unlockstore(XDStore*);
 static	void		unloaddata(XDBlock*);
-static	int		writelog(XDStore*);
+static	int		writelog(XDStore*, Dpage**, int);
+static	int		writepages(XDStore*, Dpage**, int);
+static	int		writesumhdr(XDStore*);
+static	int		writesums(XDStore*);
 
 /* * * * * * utility * * * * * */
 static int
-Bgbit32(Biobuf *b, u32int *p)
+Bgbitaddr(XDStore *s, Biobuf *b, uvlong *p)
 {
-	uchar tmp[4];
+	uchar tmp[8];
 
-	if(Bread(b, tmp, 4) != 4)
+	if(Bread(b, tmp, s->ds.addrsize) != s->ds.addrsize)
 		return -1;
-	*p = gbit32(tmp);
+	*p = gbitaddr(s, tmp);
 	return 0;
 }
 
-static int
-Bpbit32(Biobuf *b, u32int v)
+/*
+ * Fibonacci hashing on the page number: multiply by 2^32/phi
+ * and keep the top lghash bits.
+ */
+static uint
+ahash(XDStore *s, uvlong addr)
 {
-	uchar tmp[4];
+	return ((u32int)(addr>>s->lgpagesz)*2654435769U) >> (32-s->lghash);
+}
 
-	pbit32(tmp, v);
-	if(Bwrite(b, tmp, 4) != 4)
-		return -1;
-	return 0;
+static u32int
+gbit32(uchar *p)
+{
+	return p[0] | (p[1]<<8) | (p[2]<<16) | ((u32int)p[3]<<24);
 }
 
-#define PHIINV 0.61803398874989484820
-static uint
-ahash(u32int addr, uint nhash)
+static uvlong
+gbit64(uchar *p)
 {
-	return (uint)floor(nhash*fmod(addr*PHIINV, 1.0));
+	return gbit32(p) | ((uvlong)gbit32(p+4)<<32);
 }
 
-static u32int
-gbit32(uchar *p)
+static uvlong
+gbitaddr(XDStore *s, uchar *p)
 {
-	return p[0] | (p[1]<<8) | (p[2]<<16) | (p[3]<<24);
+	if(s->ds.addrsize == 4)
+		return gbit32(p);
+	return gbit32(p) | ((uvlong)gbit32(p+4)<<32);
 }
 
 static int
@@ -147,6 +312,21 @@ pbit32(uchar *p, u32int v)
 	p[3] = v>>24;
 }
 
+static void
+pbit64(uchar *p, uvlong v)
+{
+	pbit32(p, v);
+	pbit32(p+4, v>>32);
+}
+
+static void
+pbitaddr(XDStore *s, uchar *p, uvlong v)
+{
+	pbit32(p, v);
+	if(s->ds.addrsize == 8)
+		pbit32(p+4, v>>32);
+}
+
 static long
 preadn(int fd, void *vbuf, long size, vlong off)
 {
@@ -171,8 +351,8 @@ static int
 applylog(XDStore *ds)
 {
 	int np;
-	uchar *a, *buf;
-	u32int addr;
+	uchar *a, *buf, magic[4];
+	uvlong addr;
 	Biobuf *b;
 	Dpage *p;
 
@@ -189,23 +369,24 @@ applylog(XDStore *ds)
 		return -1;
 	}
 	Binit(b, ds->logfd, OREAD);
-	if(Bgbit32(b, &addr) < 0)
+	if(Bread(b, magic, 4) != 4)
 		goto Error;
-	if(addr != gbit32((uchar*)"log\n")){
+	if(memcmp(magic, "log\n", 4) != 0){
 		werrstr("malformed log");
 		goto Error;
 	}
 	np = 0;
 	for(;;){
-		if(Bgbit32(b, &addr) < 0)
+		if(Bgbitaddr(ds, b, &addr) < 0)
 			goto Error;
-		if(addr == ~(u32int)0)
+		if(addr == ~(uvlong)0 >> (64-8*ds->ds.addrsize))
 			break;
-DBG print("apply log page %ud\n", addr);
+DBG print("apply log page %llud\n", addr);
 		p = findpage(ds, addr);
-		if(p)
+		if(p){
 			a = p->a;
-		else
+			p->nref--;
+		}else
 			a = buf;
 		if(Bread(b, a, ds->ds.pagesize) != ds->ds.pagesize)
 			goto Error;
@@ -214,12 +395,18 @@ DBG print("apply log page %ud\n", addr);
 abort();
 			goto Error;
 }
+		if(setsum(ds, addr, a) < 0)
+			goto Error;
 		np++;
 	}
 	fprint(2, "applied changes to %d pages\n", np);
 	free(b);
 	free(buf);
-	return 0 && fsync(ds->fd);
+	/* the caller truncates the log next; recovery is rare, so always sync */
+	if(writesums(ds) < 0
+	|| (ds->sumfd >= 0 && fdatasync(ds->sumfd) < 0))
+		return -1;
+	return fdatasync(ds->fd);
 }
 
 static int
@@ -229,9 +416,11 @@ cleanpages(XDStore *ds)
 	Dpage *p;
 
 	ds->root->flags &= ~DDirty;
-	for(i=0; i<nelem(ds->hash); i++)
+	for(i=0; i<(1<<ds->lghash); i++)
 		for(p=ds->hash[i]; p; p=p->next)
 			p->flags &= ~DDirty;
+	ds->ndirty = 0;
+	ds->held = 0;
 	return 0;
 }
 
@@ -267,14 +456,20 @@ serializeroot(XDStore *s)
 		return -1;
 	}
 	p++;
-	for(i=LogMindat; i<=s->lgpagesz; i++){
+	for(i=s->lgmindat; i<=s->lgpagesz; i++){
 		if(s->free[i])
-			pbit32(p, s->free[i]->db.addr);
+			pbitaddr(s, p, s->free[i]->db.addr);
 		else
-			pbit32(p, 0);
-		p += 4;
+			pbitaddr(s, p, 0);
+		p += s->ds.addrsize;
 	}
-	root->flags |= DDirty;
+	pbitaddr(s, p, s->end);
+	p += s->ds.addrsize;
+	if(s->storeid == 0)	/* a store from before ids gets one now */
+		s->storeid = ((uvlong)fastrand()<<32) | fastrand() | 1;
+	pbit64(p, s->storeid);
+	pbit64(p+8, ++s->gen);
+	dirtypage(root);
 	return 0;
 }
 
@@ -286,17 +481,6 @@ truncatelog(XDStore *ds)
 	return 0;
 }
 
-static int
-writelogpage(Biobuf *b, Dpage *p)
-{
-DBG print("log page %ud\n", p->addr);
-	if(Bpbit32(b, p->addr) < 0)
-		return -1;
-	if(Bwrite(b, p->a, p->s->ds.pagesize) != p->s->ds.pagesize)
-		return -1;
-	return 0;
-}
-
 static int
 ppaddrcmp(const void *va, const void *vb)
 {
@@ -318,7 +502,7 @@ dirtylist(XDStore *ds, Dpage ***ppp)
 	Dpage *p, **pp;
 
 	n = 0;
-	for(i=0; i<nelem(ds->hash); i++)
+	for(i=0; i<(1<<ds->lghash); i++)
 		for(p=ds->hash[i]; p; p=p->next)
 			if(p->flags&DDirty)
 				n++;
@@ -332,7 +516,7 @@ dirtylist(XDStore *ds, Dpage ***ppp)
 		return -1;
 
 	m = 0;
-	for(i=0; i<nelem(ds->hash); i++)
+	for(i=0; i<(1<<ds->lghash); i++)
 		for(p=ds->hash[i]; p; p=p->next)
 			if(p->flags&DDirty)
 				pp[m++] = p;
@@ -343,131 +527,744 @@ dirtylist(XDStore *ds, Dpage ***ppp)
 	return n;
 }
 
+/*
+ * the log is "LOG\n", then the address and contents of each
+ * dirty page, then an all-ones address; "log\n" replaces
+ * "LOG\n" once it is all there.  it goes out in one
+ * vectored write.
+ */
 static int
-writelog(XDStore *ds)
+writelog(XDStore *ds, Dpage **pp, int np)
 {
-	int i, np;
-	Biobuf *b;
-	Dpage **pp;
+	int i, k, as, r;
+	uint *n;
+	uchar *ab;
+	void **a;
+
+	as = ds->ds.addrsize;
+	a = malloc((2*np+2)*sizeof(a[0]));
+	n = malloc((2*np+2)*sizeof(n[0]));
+	ab = malloc((np+1)*as);
+	if(a == nil || n == nil || ab == nil){
+		free(a);
+		free(n);
+		free(ab);
+		return -1;
+	}
+	k = 0;
+	a[k] = "LOG\n";
+	n[k++] = 4;
+	for(i=0; i<np; i++){
+DBG print("log page %llud\n", pp[i]->addr);
+		pbitaddr(ds, ab+i*as, pp[i]->addr);
+		a[k] = ab+i*as;
+		n[k++] = as;
+		a[k] = pp[i]->a;
+		n[k++] = ds->ds.pagesize;
+	}
+	pbitaddr(ds, ab+np*as, ~(uvlong)0);
+	a[k] = ab+np*as;
+	n[k++] = as;
+	r = syspwritev(ds->logfd, a, n, k, 0);
+	free(a);
+	free(n);
+	free(ab);
+	if(r < 0)
+		return -1;
+	if(ds->durability && fdatasync(ds->logfd) < 0)
+		return -1;
+	if(pwrite(ds->logfd, "log\n", 4, 0) != 4)
+		return -1;
+	if(ds->durability && fdatasync(ds->logfd) < 0)
+		return -1;
+	return 0;
+}
 
-	if(seek(ds->logfd, 0, 0) != 0)
+/*
+ * pp is sorted by address, so each run of adjacent
+ * pages goes out in one vectored write.
+ */
+static int
+writepages(XDStore *ds, Dpage **pp, int np)
+{
+	int i, j;
+	uint *n;
+	void **a;
+
+	a = malloc(np*sizeof(a[0]));
+	n = malloc(np*sizeof(n[0]));
+	if(np && (a == nil || n == nil)){
+		free(a);
+		free(n);
 		return -1;
+	}
+	for(i=0; i<np; i++){
+		a[i] = pp[i]->a;
+		n[i] = ds->ds.pagesize;
+	}
+	for(i=0; i<np; i=j){
+		for(j=i+1; j<np && pp[j]->addr == pp[j-1]->addr+ds->ds.pagesize; j++)
+			;
+		if(syspwritev(ds->fd, a+i, n+i, j-i, pp[i]->addr) < 0){
+			abort();
+			free(a);
+			free(n);
+			return -1;
+		}
+	}
+	free(a);
+	free(n);
 
-	b = malloc(sizeof(Biobuf));
-	if(b == nil)
+	for(i=0; i<np; i++)
+		if(setsum(ds, pp[i]->addr, pp[i]->a) < 0)
+			return -1;
+	if(writesums(ds) < 0
+	|| (ds->sumfd >= 0 && writesumhdr(ds) < 0))
 		return -1;
 
-	Binit(b, ds->logfd, OWRITE);
-	if(Bwrite(b, "LOG\n", 4) != 4){
-	Err:
-		Bterm(b);
-		free(b);
+	if(ds->durability && fdatasync(ds->fd) < 0)
+		return -1;
+	if(ds->durability && ds->sumfd >= 0 && fdatasync(ds->sumfd) < 0)
+		return -1;
+	return 0;
+}
+
+/* * * * * * page checksums * * * * * */
+static u32int
+pagesum(XDStore *s, uchar *a)
+{
+	u32int c;
+
+	c = crc32c(0, a, s->ds.pagesize);
+	return c ? c : 1;	/* 0 means unknown */
+}
+
+/*
+ * the chunk of sums covering addr, reading it in if need be.
+ * sums past the end of the file are unknown.
+ */
+static Sumchunk*
+sumchunk(XDStore *s, uvlong addr)
+{
+	int j;
+	long m;
+	ulong i, n;
+	uchar buf[4*nelem(((Sumchunk*)0)->sum)];
+	Sumchunk *c, **a;
+
+	i = (addr>>s->lgpagesz)/nelem(c->sum);
+	if(i >= s->nsum){
+		n = 2*s->nsum;
+		if(n <= i)
+			n = i+1;
+		a = realloc(s->sum, n*sizeof(a[0]));
+		if(a == nil)
+			return nil;
+		memset(a+s->nsum, 0, (n-s->nsum)*sizeof(a[0]));
+		s->sum = a;
+		s->nsum = n;
+	}
+	if((c = s->sum[i]) != nil)
+		return c;
+
+	if((m = preadn(s->sumfd, buf, sizeof buf, SumHdr+(vlong)i*sizeof buf)) < 0){
+		werrstr("pread sums @%llud: %r", SumHdr+(uvlong)i*sizeof buf);
+		return nil;
+	}
+	memset(buf+m, 0, sizeof buf-m);
+	c = malloc(sizeof(Sumchunk));
+	if(c == nil)
+		return nil;
+	c->dirty = 0;
+	for(j=0; j<nelem(c->sum); j++)
+		c->sum[j] = gbit32(buf+4*j);
+	s->sum[i] = c;
+	return c;
+}
+
+static int
+setsum(XDStore *s, uvlong addr, uchar *a)
+{
+	Sumchunk *c;
+
+	if(s->sumfd < 0)
+		return 0;
+	if((c = sumchunk(s, addr)) == nil)
 		return -1;
+	c->sum[(addr>>s->lgpagesz)%nelem(c->sum)] = pagesum(s, a);
+	c->dirty = 1;
+	return 0;
+}
+
+static int
+writesums(XDStore *s)
+{
+	int j;
+	ulong i;
+	uchar buf[4*nelem(((Sumchunk*)0)->sum)];
+	Sumchunk *c;
+
+	if(s->sumfd < 0)
+		return 0;
+	for(i=0; i<s->nsum; i++){
+		if((c = s->sum[i]) == nil || !c->dirty)
+			continue;
+		for(j=0; j<nelem(c->sum); j++)
+			pbit32(buf+4*j, c->sum[j]);
+		if(pwrite(s->sumfd, buf, sizeof buf, SumHdr+(vlong)i*sizeof buf) != sizeof buf){
+			werrstr("write sums: %r");
+			return -1;
+		}
+		c->dirty = 0;
 	}
-	if(serializeroot(ds) < 0)
-		goto Err;
+	return 0;
+}
 
-	np = dirtylist(ds, &pp);
-	if(np == -1)
-		goto Err;
-	for(i=0; i<np; i++)
-		if(writelogpage(b, pp[i]) < 0)
-			goto Err;
-	free(pp);
+static int
+writesumhdr(XDStore *s)
+{
+	uchar hdr[SumHdr];
 
-	if(Bpbit32(b, ~(u32int)0) < 0)
-		goto Err;
-	if(Bflush(b) < 0)
-		goto Err;
-	Bterm(b);
-	free(b);
-	if(0 && fsync(ds->logfd) < 0)
+	memmove(hdr, "sum\n", 4);
+	pbit64(hdr+4, s->storeid);
+	pbit64(hdr+12, s->gen);
+	if(pwrite(s->sumfd, hdr, SumHdr, 0) != SumHdr){
+		werrstr("write sum header: %r");
 		return -1;
-	if(pwrite(ds->logfd, "log\n", 4, 0) != 4)
+	}
+	return 0;
+}
+
+/*
+ * whether name.sum was written along with the store as it is.
+ * if the last flush was cut short and its log has just been
+ * replayed, the sums are fixed but the header is one behind.
+ */
+static int
+sumsmatch(XDStore *s, int replayed)
+{
+	uchar hdr[SumHdr];
+	uvlong gen;
+
+	if(preadn(s->sumfd, hdr, SumHdr, 0) != SumHdr
+	|| memcmp(hdr, "sum\n", 4) != 0
+	|| gbit64(hdr+4) != s->storeid)
+		return 0;
+	gen = gbit64(hdr+12);
+	return gen == s->gen || (replayed && gen+1 == s->gen);
+}
+
+/*
+ * start name.sum over, summing every page as it is on disk.
+ */
+static int
+rebuildsums(XDStore *s)
+{
+	ulong i;
+	uvlong addr;
+	uchar *buf;
+
+	for(i=0; i<s->nsum; i++){
+		free(s->sum[i]);
+		s->sum[i] = nil;
+	}
+	if(ftruncate(s->sumfd, 0) < 0){
+		werrstr("truncate %s: %r", s->sumpath);
+		return -1;
+	}
+	if((buf = malloc(s->ds.pagesize)) == nil)
 		return -1;
-	if(0 && fsync(ds->logfd) < 0)
+	for(addr=0; addr<s->end; addr+=s->ds.pagesize){
+		if(preadn(s->fd, buf, s->ds.pagesize, addr) != s->ds.pagesize
+		|| setsum(s, addr, buf) < 0){
+			free(buf);
+			return -1;
+		}
+	}
+	free(buf);
+	if(writesums(s) < 0
+	|| writesumhdr(s) < 0
+	|| fdatasync(s->sumfd) < 0)
 		return -1;
 	return 0;
 }
 
+/*
+ * compare a page just read from disk with its sum.
+ */
 static int
-writepages(XDStore *ds)
+checkpage(XDStore *s, Dpage *p)
 {
-	int i, np;
-	Dpage **pp, *p;
+	u32int want;
+	Sumchunk *c;
 
-	np = dirtylist(ds, &pp);
-	if(np == -1)
+	if(!s->verify)
+		return 0;
+	if((c = sumchunk(s, p->addr)) == nil)
+		return -1;
+	want = c->sum[(p->addr>>s->lgpagesz)%nelem(c->sum)];
+	if(want == 0){
+		s->stats.nosum++;
+		return 0;
+	}
+	if(pagesum(s, p->a) != want){
+		s->stats.badsum++;
+		werrstr("checksum mismatch in page @%llud", p->addr);
+		return -1;
+	}
+	s->stats.verified++;
+	return 0;
+}
+
+/*
+ * check the pages already in the cache.
+ */
+static int
+checkloaded(XDStore *s)
+{
+	Dpage *p;
+
+	for(p=s->lruhead; p; p=p->lnext)
+		if(!(p->flags&DDirty) && checkpage(s, p) < 0)
+			return -1;
+	return 0;
+}
+
+/* * * * * * snapshots * * * * * */
+static int
+lockstore(XDStore *s)
+{
+	if(syslock(s->logfd, 1, 1) < 0){
+		werrstr("lock %s: %r", s->redo);
+		return -1;
+	}
+	return 0;
+}
+
+static void
+unlockstore(XDStore *s)
+{
+	sysunlock(s->logfd);
+}
+
+static char*
+snapname(XDStore *s, int slot)
+{
+	char ext[16];
+
+	snprint(ext, sizeof ext, ".snap%d", slot);
+	return auxname(s->base, ext);
+}
+
+/*
+ * with the store locked, forget the snapshots whose readers
+ * have gone and pick up new ones.  a reader that died leaves
+ * its file behind; the next reader to want the slot reuses it.
+ */
+static int
+findsnaps(XDStore *s)
+{
+	int slot, fd;
+	char *path;
+	uchar hdr[SnapHdr];
+	vlong off;
+	Snap *n, **l;
+
+	for(l=&s->snap; (n=*l) != nil; ){
+		if(syslock(n->fd, 1, 0) < 0){
+			l = &n->next;
+			continue;
+		}
+		*l = n->next;
+		close(n->fd);
+		free(n->saved);
+		free(n);
+	}
+	for(slot=0; slot<MaxSnap; slot++){
+		for(n=s->snap; n; n=n->next)
+			if(n->slot == slot)
+				break;
+		if(n)
+			continue;
+		if((path = snapname(s, slot)) == nil)
+			return -1;
+		fd = open(path, ORDWR);
+		free(path);
+		if(fd < 0)
+			continue;
+		if(syslock(fd, 1, 0) >= 0
+		|| preadn(fd, hdr, SnapHdr, 0) != SnapHdr
+		|| memcmp(hdr, "snapshot", 8) != 0
+		|| (off = seek(fd, 0, 2)) < 0){
+			close(fd);
+			continue;
+		}
+		if((n = mallocz(sizeof(Snap), 1)) == nil){
+			close(fd);
+			return -1;
+		}
+		n->slot = slot;
+		n->fd = fd;
+		n->end = (uvlong)gbit32(hdr+8)<<32 | gbit32(hdr+12);
+		/* an earlier writer may have died halfway through a page */
+		off -= (off-SnapHdr)%(8+s->ds.pagesize);
+		n->off = off;
+		if((n->saved = mallocz((n->end>>s->lgpagesz)/8+1, 1)) == nil){
+			close(fd);
+			free(n);
+			return -1;
+		}
+		n->next = s->snap;
+		s->snap = n;
+	}
+	return 0;
+}
+
+/*
+ * copy the old contents of the pages about to be overwritten
+ * into the snapshots that still see them.
+ */
+static int
+savesnaps(XDStore *s, Dpage **pp, int np)
+{
+	int i, have;
+	uchar *buf, hdr[8];
+	uint n[2];
+	ulong x;
+	uvlong addr;
+	void *a[2];
+	Snap *sn;
+
+	if(findsnaps(s) < 0)
+		return -1;
+	if(s->snap == nil)
+		return 0;
+	if((buf = malloc(s->ds.pagesize)) == nil)
 		return -1;
 	for(i=0; i<np; i++){
-		p = pp[i];
-	//	fprint(2, "%lux...", p->addr);
-		if(pwrite(ds->fd, p->a, ds->ds.pagesize, p->addr) != ds->ds.pagesize){
-			abort();
+		addr = pp[i]->addr;
+		x = addr>>s->lgpagesz;
+		have = 0;
+		for(sn=s->snap; sn; sn=sn->next){
+			if(addr >= sn->end || (sn->saved[x/8] & (1<<(x%8))))
+				continue;
+			if(!have){
+				if(preadn(s->fd, buf, s->ds.pagesize, addr) != s->ds.pagesize){
+					werrstr("pread @%llud: %r", addr);
+					free(buf);
+					return -1;
+				}
+				have = 1;
+			}
+			pbit32(hdr, addr>>32);
+			pbit32(hdr+4, addr);
+			a[0] = hdr;
+			n[0] = 8;
+			a[1] = buf;
+			n[1] = s->ds.pagesize;
+			if(syspwritev(sn->fd, a, n, 2, sn->off) < 0){
+				werrstr("saving page for snapshot: %r");
+				free(buf);
+				return -1;
+			}
+			sn->off += 8+s->ds.pagesize;
+			sn->saved[x/8] |= 1<<(x%8);
+		}
+	}
+	free(buf);
+	return 0;
+}
+
+/*
+ * with the store locked, claim a snapshot slot as of the
+ * file's current contents.
+ */
+static int
+mksnap(XDStore *s)
+{
+	int slot, fd;
+	char *path;
+	uchar hdr[SnapHdr];
+
+	for(slot=0; slot<MaxSnap; slot++){
+		if((path = snapname(s, slot)) == nil)
 			return -1;
+		if((fd = syscreateexcl(path)) < 0 && (fd = open(path, ORDWR)) >= 0){
+			/* left by a reader that died? */
+			if(syslock(fd, 1, 0) < 0 || ftruncate(fd, 0) < 0){
+				close(fd);
+				fd = -1;
+			}
 		}
+		if(fd < 0){
+			free(path);
+			continue;
+		}
+		memmove(hdr, "snapshot", 8);
+		pbit32(hdr+8, s->end>>32);
+		pbit32(hdr+12, s->end);
+		if(syslock(fd, 1, 0) < 0
+		|| pwrite(fd, hdr, SnapHdr, 0) != SnapHdr
+		|| (s->snapoff = mallocz(((s->end>>s->lgpagesz)+1)*sizeof(uvlong), 1)) == nil){
+			werrstr("snapshot %s: %r", path);
+			remove(path);
+			free(path);
+			close(fd);
+			return -1;
+		}
+		s->snapfd = fd;
+		s->snappath = path;
+		s->snapat = s->end;
+		s->snapend = SnapHdr;
+		return 0;
 	}
+	werrstr("too many snapshots of %s", s->base);
+	return -1;
+}
 
-	if(0 && fsync(ds->fd) < 0)
+static int
+snaplock(XDStore *s)
+{
+	if(s->nlock++ == 0 && syslock(s->logfd, 0, 1) < 0){
+		s->nlock--;
+		werrstr("lock %s: %r", s->redo);
 		return -1;
+	}
 	return 0;
 }
 
+static void
+snapunlock(XDStore *s)
+{
+	if(--s->nlock == 0)
+		sysunlock(s->logfd);
+}
+
+/*
+ * read a page as of the snapshot, first noting any old
+ * pages the writer has saved since we last looked.
+ */
+static long
+snapread(XDStore *s, uchar *a, uvlong addr)
+{
+	long r;
+	uchar hdr[8];
+	uvlong x;
+	vlong end;
+
+	if(snaplock(s) < 0)
+		return -1;
+	r = -1;
+	if((end = seek(s->snapfd, 0, 2)) < 0)
+		goto Out;
+	for(; s->snapend+8+s->ds.pagesize <= end; s->snapend += 8+s->ds.pagesize){
+		if(preadn(s->snapfd, hdr, 8, s->snapend) != 8)
+			goto Out;
+		x = (uvlong)gbit32(hdr)<<32 | gbit32(hdr+4);
+		if(x < s->snapat && x%s->ds.pagesize == 0 && s->snapoff[x>>s->lgpagesz] == 0)
+			s->snapoff[x>>s->lgpagesz] = s->snapend+8;
+	}
+	if(addr < s->snapat && s->snapoff[addr>>s->lgpagesz])
+		r = preadn(s->snapfd, a, s->ds.pagesize, s->snapoff[addr>>s->lgpagesz]);
+	else
+		r = preadn(s->fd, a, s->ds.pagesize, addr);
+Out:
+	snapunlock(s);
+	return r;
+}
+
 /* * * * * * page management * * * * * */
 static Dpage*
 allocpage(XDStore *s)
 {
-	u32int addr;
+	uvlong addr;
 	Dpage *p;
 
 	addr = s->end;
+	if(s->ds.addrsize == 4 && addr+s->ds.pagesize > 1ULL<<32){
+		werrstr("dstore full; copy with trafixdb -c to convert to 64-bit addresses");
+		return nil;
+	}
 	s->end += s->ds.pagesize;
 
-//print("allocpage %ud\n", addr);
 	if((p = evictpage(s, addr)) == nil
 	&& (p = mkpage(s, addr)) == nil)
 		return nil;
 
 	memset(p->a, 0, s->ds.pagesize);
-	p->flags = DDirty;
-DBG print("allocpage %ud\n", p->addr);
+	dirtypage(p);
+DBG print("allocpage %llud\n", p->addr);
 	return p;
 }
 
+static void
+dirtypage(Dpage *p)
+{
+	XDStore *s;
+
+	if(p->flags&DDirty)
+		return;
+	p->flags |= DDirty;
+	s = p->s;
+	if(s->ndirty++ == 0 && !s->held)
+		s->ckpttime = time(0);
+}
+
+/*
+ * Reuse the least recently used page that is clean and
+ * not referenced, once the cache has reached its budget.
+ * Dirty pages can only leave the cache through flush, which
+ * writes them via the log; if they are all that stands in the
+ * way, ask for one (see dstoreneedflush) and let the cache
+ * grow past its budget until then.
+ */
 static Dpage*
-evictpage(XDStore *s, u32int addr)
+evictpage(XDStore *s, uvlong addr)
 {
-	USED(s);
-	USED(addr);
-	return nil;
+	int dirty;
+	Dpage *p;
+
+	if(s->npage < s->maxpage || s->wantflush)
+		return nil;
+
+	dirty = 0;
+	for(p=s->lrutail; p; p=p->lprev){
+		if(p->nref != 0)
+			continue;
+		if(p->flags&DDirty){
+			dirty = 1;
+			continue;
+		}
+		break;
+	}
+	if(p == nil){
+		if(dirty && !s->ignorewrites)
+			s->wantflush = 1;
+		return nil;
+	}
+
+	unhashpage(s, p);
+DBG print("evict %llud for %llud\n", p->addr, addr);
+
+	p->nref = 1;
+	p->flags = 0;
+	p->addr = addr;
+	hashpage(s, p);
+	lrufront(s, p);
+	s->stats.evict++;
+	return p;
 }
 
 static Dpage*
-findpage(XDStore *s, u32int addr)
+findpage(XDStore *s, uvlong addr)
 {
 	uint h;
 	Dpage *p;
 
 	assert(addr%s->ds.pagesize == 0);
-	h = ahash(addr, nelem(s->hash));
-	assert(h < nelem(s->hash));
-//print("look for %ud on %ud\n", addr, h);
+	h = ahash(s, addr);
 	for(p=s->hash[h]; p; p=p->next){
 		if(p->addr == addr){
 			p->nref++;
+			lrufront(s, p);
 			return p;
 		}
 	}
 	return nil;
 }
 
+static void
+freepage(XDStore *s, Dpage *p)
+{
+	unhashpage(s, p);
+	if(p->flags&PMapped)
+		s->nmapped--;
+	else{
+		lruunlink(s, p);
+		s->npage--;
+	}
+	free(p);
+}
+
+/*
+ * forget a page past the end of the store,
+ * dirty or not; it will never be written.
+ */
+static void
+droppage(XDStore *s, uvlong addr)
+{
+	Dpage *p;
+
+	if((p = findpage(s, addr)) == nil)
+		return;
+	p->nref--;
+	assert(p->nref == 0);
+	if(p->flags&DDirty)
+		s->ndirty--;
+	freepage(s, p);
+}
+
+/*
+ * Keep the chains short by doubling the table whenever
+ * there are more resident pages than chains.  Failing
+ * to grow is harmless; the chains just get longer.
+ */
+static void
+hashpage(XDStore *s, Dpage *p)
+{
+	uint h, i, olg;
+	Dpage **ohash, *q, *qnext;
+
+	if(s->npage+s->nmapped >= (1<<s->lghash) && s->lghash < 30){
+		ohash = s->hash;
+		olg = s->lghash;
+		s->hash = mallocz((2<<olg)*sizeof(s->hash[0]), 1);
+		if(s->hash == nil)
+			s->hash = ohash;
+		else{
+			s->lghash = olg+1;
+			for(i=0; i<(1<<olg); i++){
+				for(q=ohash[i]; q; q=qnext){
+					qnext = q->next;
+					h = ahash(s, q->addr);
+					q->next = s->hash[h];
+					s->hash[h] = q;
+				}
+			}
+			free(ohash);
+		}
+	}
+	h = ahash(s, p->addr);
+	p->next = s->hash[h];
+	s->hash[h] = p;
+}
+
+static void
+unhashpage(XDStore *s, Dpage *p)
+{
+	Dpage **l;
+
+	for(l=&s->hash[ahash(s, p->addr)]; *l; l=&(*l)->next){
+		if(*l == p){
+			*l = p->next;
+			break;
+		}
+	}
+}
+
 static Dpage*
-loadpage(XDStore *s, u32int addr)
+loadpage(XDStore *s, uvlong addr)
 {
 	Dpage *p;
 
-	if((p = findpage(s, addr)) != nil)
+	if((p = findpage(s, addr)) != nil){
+		s->stats.hit++;
 		return p;
+	}
+	s->stats.miss++;
+
+	if(addr+s->ds.pagesize <= s->mapsize)
+		return mappage(s, addr);
 
 	if((p = evictpage(s, addr)) == nil
 	&& (p = mkpage(s, addr)) == nil){
@@ -475,19 +1272,22 @@ loadpage(XDStore *s, u32int addr)
 		return nil;
 	}
 
-	if(preadn(s->fd, p->a, s->ds.pagesize, addr) != s->ds.pagesize){
-		werrstr("pread @%ud: %r", addr);
-		p->addr = ~(u32int)0;		/* mark unused */
-		p->nref--;
+	if((s->snapfd >= 0 ? snapread(s, p->a, addr)
+	    : preadn(s->fd, p->a, s->ds.pagesize, addr)) != s->ds.pagesize){
+		werrstr("pread @%llud: %r", addr);
+		freepage(s, p);
+		return nil;
+	}
+	if(checkpage(s, p) < 0){
+		freepage(s, p);
 		return nil;
 	}
 	return p;
 }
 
 static Dpage*
-mkpage(XDStore *s, u32int addr)
+mkpage(XDStore *s, uvlong addr)
 {
-	uint h;
 	Dpage *p;
 
 	p = malloc(sizeof(Dpage)+s->ds.pagesize);
@@ -498,13 +1298,72 @@ mkpage(XDStore *s, u32int addr)
 	p->nref = 1;
 	p->addr = addr;
 	p->s = s;
-	h = ahash(addr, nelem(s->hash));
-	p->next = s->hash[h];
-	s->hash[h] = p;
-//print("mk %ud linked to %d\n", addr, h);
+	hashpage(s, p);
+	lrufront(s, p);
+	s->npage++;
+	return p;
+}
+
+/*
+ * a page inside the mapping costs only its Dpage: the data
+ * stays in the kernel's page cache until someone writes to it,
+ * and then the kernel copies it, since the mapping is private.
+ * mapped pages are not on the lru list and never evicted.
+ */
+static Dpage*
+mappage(XDStore *s, uvlong addr)
+{
+	Dpage *p;
+
+	p = mallocz(sizeof(Dpage), 1);
+	if(p == nil){
+		werrstr("mappage: %r");
+		return nil;
+	}
+	p->a = s->map+addr;
+	p->nref = 1;
+	p->addr = addr;
+	p->s = s;
+	p->flags = PMapped;
+	hashpage(s, p);
+	s->nmapped++;
+	if(checkpage(s, p) < 0){
+		freepage(s, p);
+		return nil;
+	}
 	return p;
 }
 
+static void
+lruunlink(XDStore *s, Dpage *p)
+{
+	if(p->lprev)
+		p->lprev->lnext = p->lnext;
+	else
+		s->lruhead = p->lnext;
+	if(p->lnext)
+		p->lnext->lprev = p->lprev;
+	else
+		s->lrutail = p->lprev;
+	p->lnext = nil;
+	p->lprev = nil;
+}
+
+static void
+lrufront(XDStore *s, Dpage *p)
+{
+	if(s->lruhead == p || (p->flags&PMapped))
+		return;
+	if(p->lprev || p->lnext || s->lrutail == p)
+		lruunlink(s, p);
+	p->lnext = s->lruhead;
+	if(s->lruhead)
+		s->lruhead->lprev = p;
+	s->lruhead = p;
+	if(s->lrutail == nil)
+		s->lrutail = p;
+}
+
 /* * * * * * data management * * * * * */
 static XDBlock*
 allocdata(XDStore *s, uint n)
@@ -515,8 +1374,8 @@ allocdata(XDStore *s, uint n)
 
 	/* find or create a bigger block */
 	i = dblog2(n+HdrSize);
-	if(i < LogMindat)
-		i = LogMindat;
+	if(i < s->lgmindat)
+		i = s->lgmindat;
 	if(i > s->lgpagesz){
 		werrstr("block too big");
 		return nil;
@@ -525,12 +1384,17 @@ allocdata(XDStore *s, uint n)
 	for(j=i; s->free[j]==nil && j<s->lgpagesz; j++)
 		;
 DBG print("alloc %ud log %d j %d\n", n, i, j);
-	if(s->free[j]==nil){
+	if(j == s->lgpagesz && s->nfpage){
+		d = takefpage(s);
+		if(d == nil)
+			return nil;
+		p = d->p;
+	}else if(s->free[j]==nil){
 //print("A\n");
 		p = allocpage(s);
 		if(p == nil)
 			return nil;
-DBG print("new page %ud\n", p->addr);
+DBG print("new page %llud\n", p->addr);
 		d = mkdata(s, p, p->a, s->ds.pagesize);
 		if(d == nil){
 			p->nref--;
@@ -565,6 +1429,7 @@ DBG print("new page %ud\n", p->addr);
 			freedata(d);
 			return nil;
 		}
+		p->nref++;	/* for d1, which goes on a free list */
 		branddata(d1);
 		freedata(d1);
 	}
@@ -579,7 +1444,7 @@ static void
 branddata(XDBlock *d)
 {
 	d->db.flags |= DDirty;
-	d->p->flags |= DDirty;
+	dirtypage(d->p);
 	pbit32(d->pa, d->m);
 	pbit32(d->pa+4, d->db.n);
 }
@@ -588,14 +1453,15 @@ static void
 freedata(XDBlock *d)
 {
 	int i;
-	u32int paddr;
+	uvlong paddr;
 	uchar *ba, *pa;
 	XDBlock *f;
+	XDStore *s;
 
 //print("free %ud size %ud\n", d->db.addr, d->m);
 //print("slots before:\n"); for(i=LogMindat; i<=d->s->lgpagesz; i++) print("%d %ud\n", 1<<i, d->s->free[i] ? d->s->free[i]->addr : 0);
 	i = dblog2(d->m);
-	assert(LogMindat <= i && i <= d->s->lgpagesz);
+	assert(d->s->lgmindat <= i && i <= d->s->lgpagesz);
 	d->db.n = ~(u32int)0;
 	branddata(d);
 //print("free %p\n", d->pa);
@@ -617,7 +1483,7 @@ freedata(XDBlock *d)
 			break;
 		if(unfreedata(d->s, paddr+(ba-pa), i) < 0)
 			break;
-DBG print("merged %ud and %lud in slot %d\n", d->db.addr, paddr+(ba-pa), i);
+DBG print("merged %llud and %llud in slot %d\n", d->db.addr, paddr+(ba-pa), i);
 		d->db.addr = paddr;
 assert(pa == d->p->a+paddr-d->p->addr);
 		d->pa = pa;
@@ -626,22 +1492,33 @@ assert(pa == d->p->a+paddr-d->p->addr);
 	}
 
 	branddata(d);
-	f = d->s->free[i];
-	pbit32((uchar*)d->db.a+4, 0);
+	s = d->s;
+	f = s->free[i];
+	pbitaddr(s, (uchar*)d->db.a+s->ds.addrsize, 0);
 	if(f){
-		pbit32(d->db.a, f->db.addr);
-		pbit32((uchar*)f->db.a+4, d->db.addr);
-		((Dpage*)f->p)->flags |= DDirty;
+		pbitaddr(s, d->db.a, f->db.addr);
+		pbitaddr(s, (uchar*)f->db.a+s->ds.addrsize, d->db.addr);
+		dirtypage(f->p);
 	}else
-		pbit32(d->db.a, 0);
-DBG print("added %ud to slot %d next %ud (%ud)\n", d->db.addr, i, f ? f->db.addr: 0, gbit32(d->db.a));
-	d->next = f;
+		pbitaddr(s, d->db.a, 0);
+DBG print("added %llud to slot %d next %llud (%llud)\n", d->db.addr, i, f ? f->db.addr: 0, gbitaddr(s, d->db.a));
+	if(i == s->lgpagesz)
+		addfpage(s, d->db.addr);
+
+	/*
+	 * free blocks in memory hold their pages, so keep only
+	 * the head of each list; popfree and unfreedata
+	 * load the next one from disk when they need it.
+	 */
+	if(f)
+		unloaddata(f);
+	d->next = nil;
 	d->s->free[i] = d;
 //print("slots after:\n"); for(i=LogMindat; i<=d->s->lgpagesz; i++) print("%d %ud\n", 1<<i, d->s->free[i] ? d->s->free[i]->addr : 0);
 }
 
 static XDBlock*
-loaddata(XDStore *s, u32int addr)
+loaddata(XDStore *s, uvlong addr)
 {
 	XDBlock *d;
 	Dpage *p;
@@ -689,7 +1566,7 @@ mkdata(XDStore *s, Dpage *p, uchar *a, uint m)
 static XDBlock*
 popfree(XDStore *s, int slot)
 {
-	u32int na;
+	uvlong na;
 	XDBlock *d, *nd;
 
 	d = s->free[slot];
@@ -705,42 +1582,41 @@ popfree(XDStore *s, int slot)
 	if(d->p == nil){
 		d->p = loadpage(s, d->db.addr&~(s->ds.pagesize-1));
 		if(d->p == nil){
-			werrstr("loadpage %ud: %r", d->db.addr&~(s->ds.pagesize-1));
+			werrstr("loadpage %llud: %r", d->db.addr&~(s->ds.pagesize-1));
 			return nil;
 		}
 		d->pa = d->p->a + (d->db.addr&(s->ds.pagesize-1));
 		d->db.a = d->pa+HdrSize;
 	}
 	if(d->next){
-DBG print("used slot %d got %ud next %ud\n", slot, d->db.addr, d->next->db.addr);
+DBG print("used slot %d got %llud next %llud\n", slot, d->db.addr, d->next->db.addr);
 		s->free[slot] = d->next;
 		return d;
 	}
-	na = gbit32(d->db.a);
+	na = gbitaddr(s, d->db.a);
 	if(na == 0){
-DBG print("used slot %d got %ud next 0\n", slot, d->db.addr);
+DBG print("used slot %d got %llud next 0\n", slot, d->db.addr);
 		s->free[slot] = nil;
 		return d;
 	}
 	nd = loaddata(s, na);
 	if(nd == nil){	/* if we return d we'll leak the rest of the free chain */
-DBG print("used slot %d got %ud next %ud bad: %r\n", slot, d->db.addr, na);
-		werrstr("loaddata %ud: %r", na);
+DBG print("used slot %d got %llud next %llud bad: %r\n", slot, d->db.addr, na);
+		werrstr("loaddata %llud: %r", na);
 		return nil;
 	}
-	pbit32((uchar*)nd->db.a+4, 0);
-	((Dpage*)nd->p)->flags |= DDirty;
+	pbitaddr(s, (uchar*)nd->db.a+s->ds.addrsize, 0);
+	dirtypage(nd->p);
 	s->free[slot] = nd;
-DBG print("used slot %d got %ud next %ud (loaded)\n", slot, d->db.addr, nd->db.addr);
+DBG print("used slot %d got %llud next %llud (loaded)\n", slot, d->db.addr, nd->db.addr);
 	return d;
 }
 
 static void
 unloaddata(XDBlock *d)
 {
-DBG if(d->db.addr == 28288) print("\t%ud -> %ud, %ud\n", d->db.addr, gbit32(d->db.a), gbit32((uchar*)d->db.a+4));
 	if(d->db.flags&DDirty)
-		d->p->flags |= DDirty;
+		dirtypage(d->p);
 	d->p->nref--;
 	d->p = (Dpage*)0xBBBBBBBB;
 //print("unloaddata %p\n", d->pa);
@@ -751,9 +1627,9 @@ DBG if(d->db.addr == 28288) print("\t%ud -> %ud, %ud\n", d->db.addr, gbit32(d->d
 }
 
 static int
-unfreedata(XDStore *s, u32int addr, int slot)
+unfreedata(XDStore *s, uvlong addr, int slot)
 {
-	u32int naddr, paddr;
+	uvlong naddr, paddr;
 	XDBlock *d, **l, *pd, *nd;
 
 	d = loaddata(s, addr);
@@ -764,7 +1640,7 @@ unfreedata(XDStore *s, u32int addr, int slot)
 	 * unlink d from the on-disk doubly-linked list.
 	 */
 	nd = nil;
-	naddr = gbit32(d->db.a);
+	naddr = gbitaddr(s, d->db.a);
 	if(naddr != 0){
 		nd = loaddata(s, naddr);
 		if(nd == nil){
@@ -773,7 +1649,7 @@ unfreedata(XDStore *s, u32int addr, int slot)
 		}
 	}
 	pd = nil;
-	paddr = gbit32((uchar*)d->db.a+4);
+	paddr = gbitaddr(s, (uchar*)d->db.a+s->ds.addrsize);
 	if(paddr != 0){
 		pd = loaddata(s, paddr);
 		if(pd == nil){
@@ -783,16 +1659,16 @@ unfreedata(XDStore *s, u32int addr, int slot)
 		}
 	}
 	if(pd){
-		pbit32(pd->db.a, naddr);
+		pbitaddr(s, pd->db.a, naddr);
 		pd->db.flags |= DDirty;
 		unloaddata(pd);
 	}
 	if(nd){
-		pbit32((uchar*)nd->db.a+4, paddr);
+		pbitaddr(s, (uchar*)nd->db.a+s->ds.addrsize, paddr);
 		nd->db.flags |= DDirty;
 		unloaddata(nd);
 	}
-DBG print("unfreedata %ud prev %ud next %ud\n", d->db.addr, paddr, naddr);
+DBG print("unfreedata %llud prev %llud next %llud\n", d->db.addr, paddr, naddr);
 	unloaddata(d);
 
 	/*
@@ -801,15 +1677,125 @@ DBG print("unfreedata %ud prev %ud next %ud\n", d->db.addr, paddr, naddr);
 	for(l=&s->free[slot]; *l; l=&(*l)->next){
 		d = *l;
 		if(d->db.addr == addr){
-DBG print("unlinked %ud from in-memory chain\n", d->db.addr);
+DBG print("unlinked %llud from in-memory chain\n", d->db.addr);
 			*l = d->next;
 			unloaddata(d);
+			/* the in-memory chain is a prefix of the on-disk one */
+			if(*l == nil && naddr != 0 && (*l = loaddata(s, naddr)) == nil)
+				return -1;
 			break;
 		}
 	}
 	return 0;
 }
 
+static int
+fpagecmp(const void *va, const void *vb)
+{
+	uvlong a, b;
+
+	a = *(uvlong*)va;
+	b = *(uvlong*)vb;
+	if(a > b)
+		return -1;
+	if(a < b)
+		return 1;
+	return 0;
+}
+
+/*
+ * index of the first entry in fpage at or below addr.
+ */
+static ulong
+fpagesearch(XDStore *s, uvlong addr)
+{
+	ulong lo, hi, m;
+
+	lo = 0;
+	hi = s->nfpage;
+	while(lo < hi){
+		m = (lo+hi)/2;
+		if(s->fpage[m] > addr)
+			lo = m+1;
+		else
+			hi = m;
+	}
+	return lo;
+}
+
+/*
+ * failing to grow the index only means the page
+ * isn't reused until the store is opened again.
+ */
+static void
+addfpage(XDStore *s, uvlong addr)
+{
+	ulong i, m;
+	uvlong *a;
+
+	if(s->nfpage == s->mfpage){
+		m = s->mfpage ? 2*s->mfpage : 64;
+		a = realloc(s->fpage, m*sizeof(s->fpage[0]));
+		if(a == nil)
+			return;
+		s->fpage = a;
+		s->mfpage = m;
+	}
+	i = fpagesearch(s, addr);
+	memmove(&s->fpage[i+1], &s->fpage[i], (s->nfpage-i)*sizeof(s->fpage[0]));
+	s->fpage[i] = addr;
+	s->nfpage++;
+}
+
+/*
+ * take the lowest whole free page off the free list.
+ */
+static XDBlock*
+takefpage(XDStore *s)
+{
+	uvlong addr;
+	XDBlock *d;
+
+	addr = s->fpage[s->nfpage-1];
+	if(unfreedata(s, addr, s->lgpagesz) < 0)
+		return nil;
+	s->nfpage--;
+	d = loaddata(s, addr);
+	if(d == nil)
+		return nil;
+DBG print("took free page %llud\n", addr);
+	return d;
+}
+
+/*
+ * give whole free pages at the end of the store back.
+ */
+static int
+trimtail(XDStore *s)
+{
+	ulong n;
+	uvlong addr;
+
+	for(n=0; n<s->nfpage; n++){
+		addr = s->fpage[n];
+		if(addr != s->end - s->ds.pagesize || addr == 0)
+			break;
+		if(unfreedata(s, addr, s->lgpagesz) < 0)
+			return -1;
+		droppage(s, addr);
+		s->end = addr;
+		if(s->mapsize > addr)
+			s->mapsize = addr;	/* about to be truncated */
+		s->trimmed = 1;
+DBG print("trimmed %llud\n", addr);
+	}
+	if(n){
+		s->nfpage -= n;
+		memmove(&s->fpage[0], &s->fpage[n], s->nfpage*sizeof(s->fpage[0]));
+	}
+	return 0;
+}
+
 /* * * * * * external interface * * * * * */
 static XDStore*
 ds2xds(DStore *ds)
@@ -833,9 +1819,25 @@ db2xdb(DBlock *db)
 	return b;
 }
 
+static int
+needflush(XDStore *s)
+{
+	if(s->ignorewrites || s->broken)
+		return 0;
+	if(s->wantflush || s->ndirty >= s->maxdirty)
+		return 1;
+	return (s->ndirty || s->held) && time(0)-s->ckpttime >= s->ckptsecs;
+}
+
 static int
 flush(XDStore *s, int closing)
 {
+	int np;
+	int (*onflush)(void*);
+	Dpage **pp;
+
+	onflush = s->onflush;
+	s->onflush = nil;
 	if(s->broken){
 		werrstr("store is broken");
 		return -1;
@@ -844,15 +1846,32 @@ flush(XDStore *s, int closing)
 	if(s->ignorewrites)
 		return 0;
 
-if(!closing)return 0;
+	if(!closing && !needflush(s))
+		return 0;
 
-	if(writelog(s) < 0
-	|| writepages(s) < 0
+	pp = nil;
+	if(trimtail(s) < 0
+	|| serializeroot(s) < 0
+	|| (np = dirtylist(s, &pp)) < 0
+	|| lockstore(s) < 0
+	|| savesnaps(s, pp, np) < 0
+	|| writelog(s, pp, np) < 0
+	|| writepages(s, pp, np) < 0
 	|| truncatelog(s) < 0
+	|| (onflush && (*onflush)(s->onflusharg) < 0)
 	|| cleanpages(s) < 0){
+		unlockstore(s);
+		free(pp);
 		s->broken = 1;
 		return -1;
 	}
+	free(pp);
+	if(s->trimmed && s->snap == nil){
+		ftruncate(s->fd, s->end);	/* ignore if fails; openpathfd retries */
+		s->trimmed = 0;
+	}
+	unlockstore(s);
+	s->wantflush = 0;
 	return 0;
 }
 
@@ -862,19 +1881,24 @@ xdstoreclose(XDStore *s)
 	int i, j;
 	Dpage *p, *pnext;
 	XDBlock *d, *dnext;
+	Snap *n, *nnext;
 
 	if(s == nil)
 		return -1;
 
 	i = flush(s, 1);
-	for(j=0; j<nelem(s->hash); j++){
+	for(j=0; j<(1<<s->lghash); j++){
 		for(p=s->hash[j]; p; p=pnext){
 			pnext = p->next;
-			memset(p->a, 0xBB, s->ds.pagesize);
+			if(!(p->flags&PMapped))
+				memset(p->a, 0xBB, s->ds.pagesize);
 			free(p);
 		}
-		s->hash[j] = (Dpage*)0xBBBBBBBB;
 	}
+	if(s->map)
+		sysmunmap(s->map, s->maplen);
+	free(s->hash);
+	s->hash = (Dpage**)0xBBBBBBBB;
 	for(j=0; j<=s->lgpagesz; j++){
 		for(d=s->free[j]; d; d=dnext){
 			dnext = d->next;
@@ -883,11 +1907,30 @@ xdstoreclose(XDStore *s)
 		}
 		s->free[j] = (XDBlock*)0xBBBBBBBB;
 	}
+	free(s->fpage);
+	for(j=0; j<s->nsum; j++)
+		free(s->sum[j]);
+	free(s->sum);
 	s->root = (Dpage*)0xBBBBBBBB;
+	for(n=s->snap; n; n=nnext){
+		nnext = n->next;
+		close(n->fd);
+		free(n->saved);
+		free(n);
+	}
+	if(s->snapfd >= 0){
+		remove(s->snappath);
+		close(s->snapfd);
+	}
+	free(s->snappath);
+	free(s->snapoff);
 	close(s->fd);
 	close(s->logfd);
+	if(s->sumfd >= 0)
+		close(s->sumfd);
 	free(s->base);
 	free(s->redo);
+	free(s->sumpath);
 	free(s);
 	return i;
 }
@@ -896,19 +1939,24 @@ static int
 dstorefree(DStore *ds)
 {
 	int r;
-	char *base, *redo;
+	char *base, *redo, *sum;
 	XDStore *s;
 
 	s = ds2xds(ds);
 	base = s->base;
 	redo = s->redo;
+	sum = s->sumpath;
 	s->base = nil;
 	s->redo = nil;
+	s->sumpath = nil;
 	xdstoreclose(s);
 	r = remove(base);
 	r |= remove(redo);
+	if(sum)
+		remove(sum);
 	free(base);
 	free(redo);
+	free(sum);
 	return r;
 }
 
@@ -931,7 +1979,7 @@ dblockfree(DBlock *db)
 
 	d = db2xdb(db);
 
-DBG print("dfree %p (addr %ud size %ud p 0x%p)\n", d, d ? d->db.addr : 0, d ? d->db.n : 0, d ? d->p : 0);
+DBG print("dfree %p (addr %llud size %ud p 0x%p)\n", d, d ? d->db.addr : 0, d ? d->db.n : 0, d ? d->p : 0);
 	freedata(d);
 	return 0;
 }
@@ -943,7 +1991,7 @@ dblockclose(DBlock *db)
 
 	d = db2xdb(db);
 
-DBG print("ddrop %p (addr %ud size %ud)\n", d, d ? d->db.addr : 0, d ? d->db.n : 0);
+DBG print("ddrop %p (addr %llud size %ud)\n", d, d ? d->db.addr : 0, d ? d->db.n : 0);
 	unloaddata(d);
 	return 0;
 }
@@ -955,14 +2003,14 @@ dblockflush(DBlock *db)
 
 	d = db2xdb(db);
 	if(d->db.flags&DDirty){
-		d->p->flags |= DDirty;
+		dirtypage(d->p);
 		d->db.flags &= ~DDirty;
 	}
 	return 0;
 }
 
 DBlock*
-dstoreread(DStore *ds, u32int addr)
+dstoreread(DStore *ds, uvlong addr)
 {
 	XDBlock *ret;
 	XDStore *s;
@@ -970,7 +2018,7 @@ dstoreread(DStore *ds, u32int addr)
 	s = ds2xds(ds);
 
 	ret = loaddata(s, addr);
-DBG print("dread %ud = 0x%p (size %ud p 0x%p)\n", addr, ret, ret ? ret->db.n : 0, ret ? ret->p : 0);
+DBG print("dread %llud = 0x%p (size %ud p 0x%p)\n", addr, ret, ret ? ret->db.n : 0, ret ? ret->p : 0);
 	if(ret == nil)
 		return nil;
 	ret->db.close = dblockclose;
@@ -990,7 +2038,7 @@ dstorealloc(DStore *ds, uint size)
 	s = ds2xds(ds);
 
 	ret = allocdata(s, size);
-DBG print("dalloc %ud = 0x%p (addr %ud size %ud)\n", size, ret, ret ? ret->db.addr : 0, ret ? ret->db.n : 0);
+DBG print("dalloc %ud = 0x%p (addr %llud size %ud)\n", size, ret, ret ? ret->db.addr : 0, ret ? ret->db.n : 0);
 	if(ret == nil)
 		return nil;
 	ret->db.close = dblockclose;
@@ -1002,29 +2050,68 @@ DBG print("dalloc %ud = 0x%p (addr %ud size %ud)\n", size, ret, ret ? ret->db.ad
 }
 
 static char*
-logname(char *file)
+auxname(char *file, char *ext)
 {
 	char *log;
 	int len;
 
-	log = malloc(strlen(file)+5+1);
+	log = malloc(strlen(file)+strlen(ext)+1);
 	if(log == nil)
 		return nil;
 	strcpy(log, file);
 	len = strlen(log);
 	while(len > 1 && log[len-1] == '/')
 		log[--len] = '\0';
-	strcat(log, ".redo");
+	strcat(log, ext);
 	return log;
 }
 
+/*
+ * index the whole free pages by following the list links
+ * on disk; the pages themselves don't need to be cached.
+ */
+static int
+loadfpages(XDStore *s)
+{
+	uchar buf[HdrSize+8];
+	ulong n;
+	uvlong addr;
+
+	if(s->free[s->lgpagesz] == nil)
+		return 0;
+	n = 0;
+	for(addr=s->free[s->lgpagesz]->db.addr; addr; addr=gbitaddr(s, buf+HdrSize)){
+		if(n++ > s->end/s->ds.pagesize || addr%s->ds.pagesize){
+			werrstr("corrupt dstore file (bad free page list)");
+			return -1;
+		}
+		if(s->nfpage == s->mfpage){
+			s->mfpage = s->mfpage ? 2*s->mfpage : 64;
+			s->fpage = realloc(s->fpage, s->mfpage*sizeof(s->fpage[0]));
+			if(s->fpage == nil)
+				return -1;
+		}
+		s->fpage[s->nfpage++] = addr;
+		if(preadn(s->fd, buf, HdrSize+s->ds.addrsize, addr) != HdrSize+s->ds.addrsize){
+			werrstr("pread @%llud: %r", addr);
+			return -1;
+		}
+	}
+	qsort(s->fpage, s->nfpage, sizeof(s->fpage[0]), fpagecmp);
+	return 0;
+}
+
+/*
+ * with snap set, fd is open only for reading and we take
+ * a snapshot, leaving the store locked; see dstoresnapready.
+ */
 static DStore*
-openpathfd(char *path, int fd)
+openpathfd(char *path, int fd, int snap)
 {
 	char *logpath, tmp[MinPagesize];
 	uchar *p;
-	int i, lg, logfd, pagesz;
-	u32int addr;
+	int i, as, lg, logfd, newsum, pagesz, replayed;
+	uvlong addr;
 	vlong off;
 	XDBlock *d;
 	Dpage *root;
@@ -1034,6 +2121,8 @@ openpathfd(char *path, int fd)
 	logfd = -1;
 	if(preadn(fd, tmp, sizeof tmp, 0) != sizeof tmp){
 	Error:
+		if(s != nil)
+			s->ignorewrites = 1;	/* nothing to write back */
 		xdstoreclose(s);
 		if(logfd >= 0)
 			close(logfd);
@@ -1041,22 +2130,27 @@ openpathfd(char *path, int fd)
 		return nil;
 	}
 
-	if(memcmp(tmp, "dstore ", 7) != 0){
+	if(memcmp(tmp, "dstore64 ", 9) == 0){
+		as = 8;
+		pagesz = atoi(tmp+9);
+	}else if(memcmp(tmp, "dstore ", 7) == 0){
+		as = 4;
+		pagesz = atoi(tmp+7);
+	}else{
 		werrstr("not a dstore file");
 		goto Error;
 	}
 
-	pagesz = atoi(tmp+7);
 	if((pagesz&(pagesz-1)) || pagesz < 128){
 		werrstr("corrupt dstore file (bad page size)");
 		goto Error;
 	}
 	lg = dblog2(pagesz);
 
-	logpath = logname(path);
+	logpath = auxname(path, ".redo");
 	if(logpath == nil)
 		goto Error;
-	if((logfd = open(logpath, ORDWR)) < 0){
+	if((logfd = open(logpath, snap ? OREAD : ORDWR)) < 0){
 		werrstr("open %s: %r", logpath);
 		free(logpath);
 		goto Error;
@@ -1067,6 +2161,8 @@ openpathfd(char *path, int fd)
 		goto Error;
 	}
 	memset(s, 0, sizeof(XDStore));
+	s->sumfd = -1;
+	s->snapfd = -1;
 	s->redo = logpath;
 	s->base = strdup(path);
 	if(s->base == nil)
@@ -1074,7 +2170,32 @@ openpathfd(char *path, int fd)
 	s->fd = fd;
 	s->logfd = logfd;
 	s->ds.pagesize = pagesz;
+	s->ds.addrsize = as;
 	s->lgpagesz = lg;
+	s->lgmindat = as == 4 ? LogMindat : LogMindat64;
+	s->maxpage = DefCacheSize/pagesz;
+	if(s->maxpage < MinCache)
+		s->maxpage = MinCache;
+	s->maxdirty = DefMaxDirty;
+	s->ckptsecs = DefCkptSecs;
+	s->lghash = LogMinHash;
+	s->hash = mallocz((1<<s->lghash)*sizeof(s->hash[0]), 1);
+	if(s->hash == nil)
+		goto Error;
+
+	/* stores from before checksums get a sum file, filled in below */
+	newsum = 0;
+	if(!snap){
+		if((s->sumpath = auxname(path, ".sum")) == nil)
+			goto Error;
+		if((s->sumfd = open(s->sumpath, ORDWR)) < 0){
+			s->sumfd = syscreateexcl(s->sumpath);
+			newsum = 1;
+		}
+	}
+	if(lockstore(s) < 0)
+		goto Error;
+
 	off = seek(fd, 0, 2);
 	if(off < 0)
 		goto Error;
@@ -1084,6 +2205,19 @@ openpathfd(char *path, int fd)
 	}
 	s->end = off;
 
+	if(snap){
+		/* the log is empty between checkpoints unless the writer died */
+		if(isemptylog(s) != 1){
+			werrstr("%s needs recovery; open it for writing first", path);
+			goto Error;
+		}
+		s->ignorewrites = 1;
+		s->nlock = 1;
+		if(mksnap(s) < 0)
+			goto Error;
+	}else if(findsnaps(s) < 0)
+		goto Error;
+
 	if((root = loadpage(s, 0)) == nil)
 		goto Error;
 	p = memchr(root->a, '\n', pagesz);
@@ -1095,23 +2229,59 @@ openpathfd(char *path, int fd)
 	for(i=0; i<=lg; i++)
 		s->free[i] = nil;
 
+	/* the log may hold a newer root page; apply it before parsing */
+	replayed = 0;
+	if(!isemptylog(s)){
+		replayed = 1;
+		fprint(2, "database shut down during block writes; applying block redo log\n");
+		if(applylog(s) < 0
+		|| truncatelog(s) < 0)
+			goto Error;
+		if((off = seek(fd, 0, 2)) < 0)
+			goto Error;
+		s->end = off;
+	}
+
 	p++;
-	for(i=LogMindat; i<=lg; i++){
-		if((addr = gbit32(p)) != 0){
+	for(i=s->lgmindat; i<=lg; i++){
+		if((addr = gbitaddr(s, p)) != 0){
 			d = loaddata(s, addr);
 			if(d == nil)
 				goto Error;
 			s->free[i] = d;
 		}
-		p += 4;
+		p += as;
 	}
-
-	if(!isemptylog(s)){
-		fprint(2, "database shut down during block writes; applying block redo log\n");
-		if(applylog(s) < 0
-		|| truncatelog(s) < 0)
+	if((addr = gbitaddr(s, p)) != 0 && addr < s->end){
+		if(addr%pagesz){
+			werrstr("corrupt dstore file (bad end)");
 			goto Error;
+		}
+		if(snap || s->snap)
+			s->trimmed = 1;
+		else
+			ftruncate(fd, addr);
+		s->end = addr;
 	}
+	p += as;
+	s->storeid = gbit64(p);
+	s->gen = gbit64(p+8);
+	if(loadfpages(s) < 0)
+		goto Error;
+
+	if(s->sumfd >= 0 && !sumsmatch(s, replayed)){
+		if(!newsum)
+			fprint(2, "%s does not match %s; rebuilding it\n", s->sumpath, path);
+		if(rebuildsums(s) < 0)
+			goto Error;
+	}else if(s->sumfd >= 0 && replayed && writesumhdr(s) < 0)
+		goto Error;
+
+	/* the root and free list heads were read before the sums were ready */
+	s->verify = s->sumfd >= 0;
+	if(checkloaded(s) < 0)
+		goto Error;
+
 	s->root = root;
 	s->ds.hdrsize = HdrSize;
 	s->ds.flush = dstoreflush;
@@ -1120,6 +2290,8 @@ openpathfd(char *path, int fd)
 	s->ds.read = dstoreread;
 	s->ds.free = dstorefree;
 	s->magic = ds2xds;
+	if(!snap)
+		unlockstore(s);
 	return &s->ds;
 }
 
@@ -1130,7 +2302,56 @@ opendstore(char *path)
 
 	if((fd = open(path, ORDWR|OLOCK)) < 0)
 		return nil;
-	return openpathfd(path, fd);
+	return openpathfd(path, fd, 0);
+}
+
+/*
+ * open a snapshot of the store for reading while another
+ * process goes on writing it.  checkpoints wait until
+ * dstoresnapready, so the caller can first read anything
+ * else that has to match, like its own redo log.
+ */
+DStore*
+opendstoresnap(char *path)
+{
+	int fd;
+
+	if((fd = open(path, OREAD)) < 0)
+		return nil;
+	return openpathfd(path, fd, 1);
+}
+
+void
+dstoresnapready(DStore *ds)
+{
+	XDStore *s;
+
+	s = ds2xds(ds);
+	if(s->snapfd >= 0 && s->nlock > 0)
+		snapunlock(s);
+}
+
+/*
+ * a child forked after the open shares the parent's lock on
+ * name.redo, and one unlocking it would unlock them all;
+ * give a child that reads the snapshot its own.
+ */
+int
+dstoreforked(DStore *ds)
+{
+	int fd;
+	XDStore *s;
+
+	s = ds2xds(ds);
+	if(s->snapfd < 0)
+		return 0;
+	if((fd = open(s->redo, OREAD)) < 0){
+		werrstr("open %s: %r", s->redo);
+		return -1;
+	}
+	close(s->logfd);
+	s->logfd = fd;
+	return 0;
 }
 
 DStore*
@@ -1138,7 +2359,8 @@ createdstore(char *path, uint pagesz)
 {
 	int fd, logfd;
 	char *log;
-	uchar *buf;
+	uchar *buf, hdr[SumHdr];
+	uvlong id;
 
 	if((pagesz&(pagesz-1)) || pagesz < 128){
 		werrstr("bad page size (need power of two >= 128)");
@@ -1152,7 +2374,10 @@ createdstore(char *path, uint pagesz)
 		free(buf);
 		return nil;
 	}
-	sprint((char*)buf, "dstore %ud\n", pagesz);
+	sprint((char*)buf, "dstore64 %ud\n", pagesz);
+	/* free heads and end are zero; the id goes after them */
+	id = ((uvlong)fastrand()<<32) | fastrand() | 1;
+	pbit64(buf+strlen((char*)buf)+(dblog2(pagesz)-LogMindat64+2)*8, id);
 	if(pwrite(fd, buf, pagesz, 0) != pagesz){
 	Error:
 		free(buf);
@@ -1163,7 +2388,7 @@ createdstore(char *path, uint pagesz)
 	free(buf);
 	buf = nil;
 
-	log = logname(path);
+	log = auxname(path, ".redo");
 	if(log == nil)
 		goto Error;
 	logfd = syscreateexcl(log);
@@ -1171,7 +2396,19 @@ createdstore(char *path, uint pagesz)
 	if(logfd < 0)
 		goto Error;
 	close(logfd);
-	return openpathfd(path, fd);
+
+	/* any sum file left over belongs to some earlier store */
+	if((log = auxname(path, ".sum")) == nil)
+		goto Error;
+	if((logfd = create(log, ORDWR, 0666)) >= 0){
+		memmove(hdr, "sum\n", 4);
+		pbit64(hdr+4, id);
+		pbit64(hdr+12, 0);
+		pwrite(logfd, hdr, SumHdr, 0);	/* if not, it is rebuilt at open */
+		close(logfd);
+	}
+	free(log);
+	return openpathfd(path, fd, 0);
 }
 
 int dcs;
@@ -1197,10 +2434,322 @@ dcs++;
 	return 0;
 }
 
+uvlong
+getaddr(DStore *s, uchar *p)
+{
+	uvlong v;
+
+	v = (u32int)LONG(p);
+	if(s->addrsize == 8)
+		v = v<<32 | (u32int)LONG(p+4);
+	return v;
+}
+
+void
+putaddr(DStore *s, uchar *p, uvlong v)
+{
+	if(s->addrsize == 8){
+		PLONG(p, v>>32);
+		p += 4;
+	}
+	PLONG(p, (u32int)v);
+}
+
+/*
+ * nothing will be written, so serve pages straight
+ * from a mapping of the file if we can.
+ */
 int
 dstoreignorewrites(DStore *s)
 {
 	ds2xds(s)->ignorewrites = 1;
+	dstoremmap(s);
+	return 0;
+}
+
+/*
+ * map the store and read clean pages through the mapping
+ * rather than copying them into the cache.  pages already
+ * cached stay where they are.  mapped pages are outside
+ * the cache budget, and the mapping is private, so a page
+ * changed in memory would stay copied for good; only a
+ * store that ignores writes is mapped.  the mapping does
+ * not grow with the store: pages allocated later are
+ * cached as usual.  snapshots aren't mapped, since the
+ * writer changes the file underneath them.
+ */
+int
+dstoremmap(DStore *ds)
+{
+	vlong size;
+	XDStore *s;
+
+	s = ds2xds(ds);
+	if(!s->ignorewrites){
+		werrstr("store is writable");
+		return -1;
+	}
+	if(s->map || s->snapfd >= 0)
+		return 0;
+
+	/* pages allocated since the last flush aren't in the file yet */
+	if((size = seek(s->fd, 0, 2)) < 0)
+		return -1;
+	if(size > s->end)
+		size = s->end;
+	size -= size%s->ds.pagesize;
+	if(size == 0)
+		return 0;
+
+	if((s->map = sysmmap(s->fd, size)) == nil){
+		werrstr("mmap: %r");
+		return -1;
+	}
+	s->maplen = size;
+	s->mapsize = size;
+	return 0;
+}
+
+/*
+ * set the page cache budget, in bytes.
+ */
+int
+dstorecachesize(DStore *ds, uvlong size)
+{
+	XDStore *s;
+
+	s = ds2xds(ds);
+	s->maxpage = size/s->ds.pagesize;
+	if(s->maxpage < MinCache)
+		s->maxpage = MinCache;
+	return 0;
+}
+
+/*
+ * a checkpoint is one log write and one page write-back no
+ * matter how many commits it covers, so group and strict
+ * both sync the log before touching the pages and the
+ * pages before truncating the log.
+ */
+int
+dstoredurability(DStore *ds, int mode)
+{
+	if(mode < DSyncNone || mode > DSyncStrict){
+		werrstr("bad durability mode %d", mode);
+		return -1;
+	}
+	ds2xds(ds)->durability = mode;
+	return 0;
+}
+
+/*
+ * checkpoint once npage pages are dirty or the oldest
+ * unwritten change is secs seconds old.  zero leaves
+ * the current setting alone.
+ */
+int
+dstorecheckpoint(DStore *ds, ulong npage, ulong secs)
+{
+	XDStore *s;
+
+	s = ds2xds(ds);
+	if(npage)
+		s->maxdirty = npage;
+	if(secs)
+		s->ckptsecs = secs;
+	return 0;
+}
+
+/*
+ * the store wants a checkpoint: the page cache is over budget
+ * and only a flush can make room, or enough has changed since
+ * the last one.  the caller should flush at the next point
+ * where the store holds a consistent image.
+ */
+int
+dstoreneedflush(DStore *ds)
+{
+	return needflush(ds2xds(ds));
+}
+
+/*
+ * have the next flush that writes call fn(arg) once the
+ * pages are on disk, before it lets snapshot readers in.
+ * the db resets its own redo log there, so that a reader
+ * never sees the new pages beside the old log.
+ */
+void
+dstoreonflush(DStore *ds, int (*fn)(void*), void *arg)
+{
+	XDStore *s;
+
+	s = ds2xds(ds);
+	s->onflush = fn;
+	s->onflusharg = arg;
+}
+
+/*
+ * the caller has made a change it is holding on to (the db's
+ * list cache, say) that will only reach the store's pages when
+ * it next flushes.  start the checkpoint clock as a dirty page would.
+ */
+void
+dstorechanged(DStore *ds)
+{
+	XDStore *s;
+
+	s = ds2xds(ds);
+	if(s->ndirty == 0 && !s->held)
+		s->ckpttime = time(0);
+	s->held = 1;
+}
+
+/*
+ * seconds until the oldest unwritten change makes the store
+ * want a checkpoint, or -1 if nothing is waiting to be written.
+ * lets an idle caller flush on time instead of at its next write.
+ */
+long
+dstoreckptdue(DStore *ds)
+{
+	long t;
+	XDStore *s;
+
+	s = ds2xds(ds);
+	if(s->ignorewrites || s->broken || (s->ndirty == 0 && !s->held))
+		return -1;
+	t = (long)(s->ckpttime + s->ckptsecs) - time(0);
+	if(t < 0)
+		t = 0;
+	return t;
+}
+
+void
+dstorestats(DStore *ds, DStats *st)
+{
+	XDStore *s;
+
+	s = ds2xds(ds);
+	*st = s->stats;
+	st->npage = s->npage;
+	st->maxpage = s->maxpage;
+	st->mapped = s->nmapped;
+	st->freepage = s->nfpage;
+	st->size = s->end;
+}
+
+/*
+ * the caller expects to read the blocks at addr[0..n-1] soon.
+ * have the kernel start reading the pages that aren't cached,
+ * so the disk can work while the caller does; adjacent pages
+ * go in one request.  it's only a hint: nothing waits for it,
+ * and the pages come into our cache when they are read as usual.
+ * addr is sorted in place.
+ */
+int
+dstoreprefetch(DStore *ds, uvlong *addr, int n)
+{
+	int i;
+	uvlong pg, start, end;
+	Dpage *p;
+	XDStore *s;
+
+	s = ds2xds(ds);
+	qsort(addr, n, sizeof(addr[0]), fpagecmp);
+	start = end = 0;
+	for(i=n-1; i>=0; i--){
+		pg = addr[i] - addr[i]%s->ds.pagesize;
+		if(addr[i] == 0 || pg >= s->end || (pg >= start && pg < end))
+			continue;
+		for(p=s->hash[ahash(s, pg)]; p; p=p->next)
+			if(p->addr == pg)
+				break;
+		if(p)
+			continue;
+		s->stats.prefetch++;
+		if(pg == end){
+			end += s->ds.pagesize;
+			continue;
+		}
+		if(end > start)
+			sysprefetch(s->fd, start, end-start);
+		start = pg;
+		end = pg+s->ds.pagesize;
+	}
+	if(end > start)
+		sysprefetch(s->fd, start, end-start);
 	return 0;
 }
 
+/*
+ * read every page of the store from disk and check it against
+ * its sum, reporting mismatches on standard error.  returns
+ * the number of bad pages.  with record set, pages with no sum
+ * get one, which is how stores written before there were sums
+ * come to be checked.
+ */
+long
+dstorescrub(DStore *ds, int record)
+{
+	long bad;
+	u32int c, *want;
+	uvlong addr;
+	uchar *buf;
+	Sumchunk *sc;
+	XDStore *s;
+
+	s = ds2xds(ds);
+	if(s->sumfd < 0){
+		werrstr("no sum file");
+		return -1;
+	}
+	if(s->ignorewrites)
+		record = 0;
+	buf = malloc(s->ds.pagesize);
+	if(buf == nil)
+		return -1;
+	bad = 0;
+	for(addr=0; addr<s->end; addr+=s->ds.pagesize){
+		/* allocated since the last flush */
+		if(preadn(s->fd, buf, s->ds.pagesize, addr) != s->ds.pagesize)
+			break;
+		if((sc = sumchunk(s, addr)) == nil){
+			free(buf);
+			return -1;
+		}
+		want = &sc->sum[(addr>>s->lgpagesz)%nelem(sc->sum)];
+		c = pagesum(s, buf);
+		if(*want == 0){
+			s->stats.nosum++;
+			if(record){
+				*want = c;
+				sc->dirty = 1;
+			}
+		}else if(c != *want){
+			fprint(2, "page @%llud: checksum mismatch\n", addr);
+			s->stats.badsum++;
+			bad++;
+		}else
+			s->stats.verified++;
+	}
+	free(buf);
+	if(record && (writesums(s) < 0 || fdatasync(s->sumfd) < 0))
+		return -1;
+	return bad;
+}
+
+/*
+ * the lowest whole free page, which is where the next
+ * page-sized allocation will go, or 0 if there is none.
+ */
+uvlong
+dstorefirstfree(DStore *ds)
+{
+	XDStore *s;
+
+	s = ds2xds(ds);
+	if(s->nfpage == 0)
+		return 0;
+	return s->fpage[s->nfpage-1];
+}
+
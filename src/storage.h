@@ -2,12 +2,19 @@ typedef struct Datum	Datum;
 typedef struct DBlock	DBlock;
 typedef struct DMap		DMap;
 typedef struct DStore	DStore;
+typedef struct DStats	DStats;
+typedef struct LStats	LStats;
 typedef struct Listcache	Listcache;
 
 enum
 {
 	DDirty = 1<<0,
 
+	/* durability modes */
+	DSyncNone = 0,	/* never sync; a crash can lose or tear anything */
+	DSyncGroup,	/* sync the log once per batch of commits */
+	DSyncStrict,	/* sync the log at every commit */
+
 	DStoreHdrSize	= 8
 };
 
@@ -19,7 +26,7 @@ struct Datum
 
 struct DBlock
 {
-	u32int	addr;
+	uvlong	addr;
 	u32int	flags;
 	void*	a;
 	u32int	n;
@@ -37,7 +44,7 @@ enum
 
 struct DMap
 {
-	u32int	addr;
+	uvlong	addr;
 	int		(*insert)(DMap*, Datum*, Datum*, int);
 	int		(*lookup)(DMap*, Datum*, Datum*);
 	int		(*delete)(DMap*, Datum*);
@@ -47,33 +54,98 @@ struct DMap
 	int		(*free)(DMap*);
 	int		(*flush)(DMap*);
 	int		(*isempty)(DMap*);
+	int		(*compact)(DMap*);	/* move blocks toward the front; returns number moved */
 	void		(*dump)(DMap*, int);	/* debugging */
 };
 
+/*
+ * block addresses are 4 bytes on disk in old stores and
+ * 8 bytes in new ones; clients that keep addresses in their
+ * own blocks use getaddr and putaddr, which handle addrsize
+ * bytes in the same big-endian order as LONG.
+ */
 struct DStore
 {
 	int		hdrsize;
 	int		pagesize;
+	int		addrsize;
 	int		(*flush)(DStore*);
 	int		(*close)(DStore*);
 	DBlock*	(*alloc)(DStore*, uint);
-	DBlock*	(*read)(DStore*, u32int);
+	DBlock*	(*read)(DStore*, uvlong);
 	int		(*free)(DStore*);
 };
 
+/*
+ * page cache statistics, for tuning dstorecachesize.
+ */
+struct DStats
+{
+	ulong	hit;
+	ulong	miss;
+	ulong	evict;
+	ulong	npage;	/* pages resident now */
+	ulong	mapped;	/* pages read through the mapping; see dstoremmap */
+	ulong	verified;	/* pages read whose checksum matched */
+	ulong	badsum;	/* ... or didn't */
+	ulong	nosum;	/* ... or that had none yet */
+	ulong	prefetch;	/* pages asked for by dstoreprefetch */
+	ulong	maxpage;	/* cache budget, in pages */
+	ulong	freepage;	/* whole pages on the free list */
+	uvlong	size;	/* of the store, in bytes */
+};
+
+/*
+ * list cache statistics, for tuning listcachesize.
+ */
+struct LStats
+{
+	ulong	hit;
+	ulong	miss;
+	ulong	evict;
+	ulong	tree;	/* opens that found a tree, which isn't cached */
+	ulong	nmap;	/* maps cached now */
+	uvlong	mem;	/* bytes they hold */
+	uvlong	maxmem;	/* budget */
+};
+
 DStore*	createdstore(char*, uint);
 DStore*	opendstore(char*);
+DStore*	opendstoresnap(char*);
+int		dstorecachesize(DStore*, uvlong);
+void		dstorechanged(DStore*);
+int		dstorecheckpoint(DStore*, ulong, ulong);
+long		dstoreckptdue(DStore*);
+int		dstoredurability(DStore*, int);
+uvlong	dstorefirstfree(DStore*);
+int		dstoreforked(DStore*);
 int		dstoreignorewrites(DStore*);
+int		dstoremmap(DStore*);
+int		dstoreprefetch(DStore*, uvlong*, int);
+long		dstorescrub(DStore*, int);
+int		dstoreneedflush(DStore*);
+void		dstoreonflush(DStore*, int(*)(void*), void*);
+void		dstoresnapready(DStore*);
+void		dstorestats(DStore*, DStats*);
+uvlong	getaddr(DStore*, uchar*);
+u32int	crc32c(u32int, uchar*, ulong);
+void		putaddr(DStore*, uchar*, uvlong);
 
-DMap*	dmaplist(DStore*, u32int, uint);
-DMap*	dmaptree(DStore*, u32int, uint);
+DMap*	dmaplist(DStore*, uvlong, uint);
+DMap*	dmaptree(DStore*, uvlong, uint);
+DMap*	dmapopen(DStore*, uvlong);
+int		dmapistree(DStore*, uvlong);
+int		dmaptreemax(DStore*, uvlong);
 
 int		datumcmp(Datum*, Datum*);
 
 Listcache*	openlistcache(void);
 void		flushlistcache(Listcache*);
 void		closelistcache(Listcache*);
-DMap*	dmapclist(Listcache*, DStore*, u32int, uint);
+DMap*	dmapclist(Listcache*, DStore*, uvlong, uint);
+void		listcachebigdir(Listcache*, int);
+void		listcachesize(Listcache*, uvlong);
+void		listcachestats(Listcache*, LStats*);
 
 #define LONG(p)	(((p)[0]<<24)|((p)[1]<<16)|((p)[2]<<8)|((p)[3]))
 #define PLONG(p, l) \
@@ -1,12 +1,99 @@
 #include "tra.h"
 
 /*
- * To ease comparisons we keep Vtime entries
- * sorted by machine name. 
+ * A Vtime is a vector of Ltimes, one per replica.  Replica
+ * names are interned as small integers (see replicaid), and
+ * to ease comparisons we keep the entries sorted by id, so a
+ * merge compares integers.  Entries are written in machine
+ * name order, the order on the wire and on disk, and sorted
+ * back by id as they are read.
+ *
+ * Most vectors have a single entry, which lives in the Vtime
+ * itself: v->l points at v->l1 until a longer vector needs an
+ * array.  The merges work in place and allocate only when the
+ * first argument gains entries.
  * 
  * As a clumsy hack, if v->nl == -1, v is the 
  * top element in the partial order (i.e., infinity).
  */
+
+/*
+ * replica ids are handed out in the order the names are
+ * first seen, starting at 1.  rhash maps atoms to ids.
+ */
+static char **rname;
+static int nrname;
+static int *rhash;
+static int nrhash;
+
+static uint
+hashatom(char *m)
+{
+	return ((uintptr)m>>3) * 0x9E3779B1;
+}
+
+int
+replicaid(char *m)
+{
+	int i;
+	uint h;
+	int *oh;
+
+	assert(m != nil);
+	m = atom(m);
+	if(nrhash)
+		for(h=hashatom(m)&(nrhash-1); (i = rhash[h]) != 0; h=(h+1)&(nrhash-1))
+			if(rname[i] == m)
+				return i;
+
+	if(nrname%16 == 0)
+		rname = erealloc(rname, (nrname+1+16)*sizeof rname[0]);
+	rname[++nrname] = m;
+	if(2*nrname >= nrhash){
+		oh = rhash;
+		nrhash = nrhash ? 2*nrhash : 64;
+		rhash = emalloc(nrhash*sizeof rhash[0]);
+		free(oh);
+		for(i=1; i<nrname; i++){
+			for(h=hashatom(rname[i])&(nrhash-1); rhash[h]; h=(h+1)&(nrhash-1))
+				;
+			rhash[h] = i;
+		}
+	}
+	for(h=hashatom(m)&(nrhash-1); rhash[h]; h=(h+1)&(nrhash-1))
+		;
+	rhash[h] = nrname;
+	return nrname;
+}
+
+char*
+replicaname(int id)
+{
+	if(id < 1 || id > nrname)
+		panic("replicaname %d", id);
+	return rname[id];
+}
+
+/*
+ * make room for n entries in v, keeping the ones there.
+ */
+static void
+vtimespace(Vtime *v, int n)
+{
+	Ltime *l;
+
+	if(n <= v->al)
+		return;
+	if(v->l == &v->l1){
+		l = emallocnz(n*sizeof l[0]);
+		if(v->nl > 0)
+			l[0] = v->l1;
+		v->l = l;
+	}else
+		v->l = erealloc(v->l, n*sizeof v->l[0]);
+	v->al = n;
+}
+
 Vtime*
 _mkvtime(int m)
 {
@@ -14,21 +101,18 @@ _mkvtime(int m)
 
 	v = emalloc(sizeof *v);
 	memset(v, 0, sizeof *v);
+	v->l = &v->l1;
+	v->al = 1;
 	setmalloctag(v, getcallerpc(&m));
 	return v;
 }
 
-static void
-freevltime(Ltime *l, int nl)
-{
-	free(l);
-}
-
 void
 freevtime(Vtime *v)
 {
 	if(v){
-		freevltime(v->l, v->nl);
+		if(v->l != &v->l1)
+			free(v->l);
 		v->l = (Ltime*)0xDeadbeef;
 		free(v);
 	}
@@ -40,10 +124,9 @@ mkvtime1(char *m, ulong t, ulong wall)
 	Vtime *v;
 
 	assert(m != nil);
-	v = emalloc(sizeof *v);
-	v->l = emalloc(sizeof(v->l[0]));
+	v = mkvtime();
 	v->nl = 1;
-	v->l[0].m = atom(m);
+	v->l[0].id = replicaid(m);
 	v->l[0].t = t;
 	v->l[0].wall = wall;
 	setmalloctag(v, getcallerpc(&m));
@@ -55,7 +138,7 @@ _infvtime(int m)
 {
 	Vtime *v;
 
-	v = emalloc(sizeof(*v));
+	v = mkvtime();
 	v->nl = -1;
 	setmalloctag(v, getcallerpc(&m));
 	return v;
@@ -70,33 +153,52 @@ isinfvtime(Vtime *a)
 Vtime*
 copyvtime(Vtime *a)
 {
-	int n;
 	Vtime *b;
 
+	b = mkvtime();
 	if(isinfvtime(a))
-		b = infvtime();
+		b->nl = -1;
 	else{
-		b = mkvtime();
-		n = a->nl*sizeof(a->l[0]);
-		b->l = emallocnz(n);
+		vtimespace(b, a->nl);
+		memmove(b->l, a->l, a->nl*sizeof(a->l[0]));
 		b->nl = a->nl;
-		memmove(b->l, a->l, n);
 	}
 	setmalloctag(b, getcallerpc(&a));
 	return b;
 }
 
 /*
-static int
-ltimecmp(const void *va, const void *vb)
+ * add t to v, which is being read in; the entries
+ * may come in any order.
+ */
+void
+addvtime(Vtime *v, Ltime *t)
 {
-	Ltime *a, *b;
+	int i;
 
-	a = va;
-	b = vb;
-	return strcmp(a->m, b->m);
+	vtimespace(v, v->nl+1);
+	for(i=v->nl; i>0 && v->l[i-1].id > t->id; i--)
+		v->l[i] = v->l[i-1];
+	v->l[i] = *t;
+	v->nl++;
+}
+
+/*
+ * fill ord with the indices of v's entries in machine name
+ * order, the order in which they are written out.
+ */
+void
+vtimenameorder(Vtime *v, int *ord)
+{
+	int i, j, x;
+
+	for(i=0; i<v->nl; i++){
+		x = i;
+		for(j=i; j>0 && strcmp(replicaname(v->l[ord[j-1]].id), replicaname(v->l[x].id)) > 0; j--)
+			ord[j] = ord[j-1];
+		ord[j] = x;
+	}
 }
-*/
 
 /* treating a as a set of ltimes, see if any of them are <= b */
 int
@@ -106,10 +208,10 @@ intersectvtime(Vtime *a, Vtime *b)
 
 	j=0;
 	for(i=0; i<a->nl; i++){
-		while(j < b->nl && strcmp(a->l[i].m, b->l[j].m) > 0)
+		while(j < b->nl && b->l[j].id < a->l[i].id)
 			j++;
 
-		if(j < b->nl && a->l[i].m == b->l[j].m)
+		if(j < b->nl && a->l[i].id == b->l[j].id)
 			if(a->l[i].t <= b->l[j].t)
 				return 1;
 	}
@@ -126,16 +228,14 @@ leqvtime(Vtime *a, Vtime *b)
 	if(isinfvtime(a))
 		return 0;
 
+	if(a->nl == 1 && b->nl == 1)
+		return a->l[0].id == b->l[0].id && a->l[0].t <= b->l[0].t;
+
 	j=0;
 	for(i=0; i<a->nl; i++){
-		/*
-		 * Technically we should stop once a->l[i].m ">" b->l[j].m,
-		 * but either way the result is the same -- if the entry is missing
-		 * from b, we're not going to do another loop iteration.
-		 */
-		while(j < b->nl && a->l[i].m != b->l[j].m)
+		while(j < b->nl && b->l[j].id < a->l[i].id)
 			j++;
-		if(j==b->nl)	/* entry missing from b */
+		if(j==b->nl || b->l[j].id != a->l[i].id)	/* entry missing from b */
 			return 0;
 		if(a->l[i].t > b->l[j].t)	/* entry present but smaller */
 			return 0;
@@ -146,58 +246,51 @@ leqvtime(Vtime *a, Vtime *b)
 Vtime*
 maxvtime(Vtime *a, Vtime *b)
 {
-	int i, j, k, kk;
-	Ltime *c;
+	int i, j, k, n;
 
 	if(isinfvtime(a))
 		return a;
 	if(isinfvtime(b)){
-		freevltime(a->l, a->nl);
-		a->l = nil;
 		a->nl = -1;
 		return a;
 	}
 
-	/* count number of distinct elements in vector */
-	j=0;
-	k=0;
-	for(i=0; i<a->nl; i++){
-		while(j < b->nl && strcmp(a->l[i].m, b->l[j].m) > 0)
-			j++, k++;
-
-		if(j < b->nl && a->l[i].m == b->l[j].m)
-			j++;
-		k++;
+	if(a->nl == 1 && b->nl == 1 && a->l[0].id == b->l[0].id){
+		if(a->l[0].t < b->l[0].t)
+			a->l[0] = b->l[0];
+		return a;
 	}
-	k += b->nl - j;
-	kk=k;
 
-	c = emalloc(k*sizeof(c[0]));
+	/* count entries of b missing from a */
 	j=0;
-	k=0;
+	n=0;
 	for(i=0; i<a->nl; i++){
-		while(j < b->nl && strcmp(a->l[i].m, b->l[j].m) > 0){
-			c[k] = b->l[j];
-			j++, k++;
-		}
-
-		c[k] = a->l[i];
-		if(j < b->nl && a->l[i].m == b->l[j].m){
-			if(c[k].t < b->l[j].t)
-				c[k] = b->l[j];
+		while(j < b->nl && b->l[j].id < a->l[i].id)
+			j++, n++;
+		if(j < b->nl && a->l[i].id == b->l[j].id)
 			j++;
-		}
-		k++;
 	}
-	for(; j<b->nl; j++){
-		c[k] = b->l[j];
-		k++;
+	n += b->nl - j;
+
+	/* merge from the top down, in place */
+	vtimespace(a, a->nl+n);
+	i = a->nl-1;
+	j = b->nl-1;
+	k = a->nl+n-1;
+	while(j >= 0){
+		if(i >= 0 && a->l[i].id > b->l[j].id)
+			a->l[k--] = a->l[i--];
+		else if(i >= 0 && a->l[i].id == b->l[j].id){
+			if(a->l[i].t < b->l[j].t)
+				a->l[k] = b->l[j];
+			else
+				a->l[k] = a->l[i];
+			k--, i--, j--;
+		}else
+			a->l[k--] = b->l[j--];
 	}
-	assert(kk==k);
-
-	freevltime(a->l, a->nl);
-	a->l = c;
-	a->nl = k;
+	assert(k == i);
+	a->nl += n;
 	return a;
 }
 
@@ -223,18 +316,16 @@ unmaxvtime(Vtime *a, Vtime *b)
 	j=0;
 	wi=0;
 	for(ri=0; ri<a->nl; ri++){
-		while(j < b->nl && a->l[ri].m != b->l[j].m)
+		while(j < b->nl && b->l[j].id < a->l[ri].id)
 			j++;
-		if(j==b->nl || a->l[ri].t > b->l[j].t){
+		if(j==b->nl || b->l[j].id != a->l[ri].id || a->l[ri].t > b->l[j].t){
 			/* entry missing from b, or b is smaller */
 			/* we need to include it */
 			if(wi != ri)
 				a->l[wi] = a->l[ri];
 			wi++;
-		}else{
-			/* b will take care of this entry, drop it */
-			a->l[ri].m = nil;
 		}
+		/* else b will take care of this entry, drop it */
 	}
 	a->nl = wi;
 	return a;
@@ -243,80 +334,65 @@ unmaxvtime(Vtime *a, Vtime *b)
 Vtime*
 minvtime(Vtime *a, Vtime *b)
 {
-	int i, j, k, kk;
-	Ltime *c;
-	Vtime *x;
+	int ri, wi, j;
 
 	if(isinfvtime(b))
 		return a;
 	if(isinfvtime(a)){
-		x = copyvtime(b);
-		freevltime(a->l, a->nl);
-		*a = *x;
-		memset(x, 0, sizeof *x);
-		freevtime(x);
+		a->nl = 0;
+		vtimespace(a, b->nl);
+		memmove(a->l, b->l, b->nl*sizeof(b->l[0]));
+		a->nl = b->nl;
 		return a;
 	}
 
-	/* count number of common elements in vector */
+	/* keep the common entries, in place */
 	j=0;
-	k=0;
-	for(i=0; i<a->nl; i++){
-		while(j < b->nl && strcmp(a->l[i].m, b->l[j].m) > 0)
-			j++;
-		if(j < b->nl && a->l[i].m == b->l[j].m)
-			j++, k++;
-	}
-	kk=k;
-
-	c = emalloc(k*sizeof(c[0]));
-	j=0;
-	k=0;
-	for(i=0; i<a->nl; i++){
-		while(j < b->nl && strcmp(a->l[i].m, b->l[j].m) > 0)
+	wi=0;
+	for(ri=0; ri<a->nl; ri++){
+		while(j < b->nl && b->l[j].id < a->l[ri].id)
 			j++;
-		if(j < b->nl && a->l[i].m == b->l[j].m){
-			c[k] = a->l[i];
-			if(c[k].t > b->l[j].t)
-				c[k] = b->l[j];
+		if(j < b->nl && a->l[ri].id == b->l[j].id){
+			a->l[wi] = a->l[ri];
+			if(a->l[wi].t > b->l[j].t)
+				a->l[wi] = b->l[j];
+			wi++;
 			j++;
-			k++;
 		}
 	}
-	assert(kk==k);
-
-	freevltime(a->l, a->nl);
-	a->l = c;
-	a->nl = k;
+	a->nl = wi;
 	return a;
 }
 
 static void
 writebufltime(Buf *b, Ltime *t)
 {
-	assert(t->m != nil);
-
 	/* N.B. Version #1 is used by the database routines. */
 	writebufc(b, 0);
 	writebufl(b, t->t);
 	writebufl(b, t->wall);
-	writebufstring(b, t->m);
+	writebufstring(b, replicaname(t->id));
 }
 
 void
 readbufltime(Buf *b, Ltime *t)
 {
+	char *m;
+
 	if(readbufc(b) != 0)
 		longjmp(b->jmp, BufData);
 	t->t = readbufl(b);
 	t->wall = readbufl(b);
-	t->m = atom(readbufstring(b));
+	m = readbufstring(b);
+	if(m == nil)
+		longjmp(b->jmp, BufData);
+	t->id = replicaid(m);
 }
 
 void
 writebufvtime(Buf *b, Vtime *v)
 {
-	int i;
+	int i, buf[8], *ord;
 
 	writebufc(b, 0);
 	if(v == nil){
@@ -324,14 +400,21 @@ writebufvtime(Buf *b, Vtime *v)
 		return;
 	}
 	writebufl(b, v->nl);
+	if(v->nl <= 0)
+		return;
+	ord = v->nl <= nelem(buf) ? buf : emalloc(v->nl*sizeof ord[0]);
+	vtimenameorder(v, ord);
 	for(i=0; i<v->nl; i++)
-		writebufltime(b, v->l+i);
+		writebufltime(b, v->l+ord[i]);
+	if(ord != buf)
+		free(ord);
 }
 
 Vtime*
 readbufvtime(Buf *b)
 {
 	int i, n;
+	Ltime t;
 	Vtime *v;
 
 	if(readbufc(b) != 0)
@@ -343,11 +426,11 @@ readbufvtime(Buf *b)
 	if(n < -2 || n > 65536)
 		longjmp(b->jmp, BufData);
 	v = mkvtime();
-	v->nl = n;
-	if(v->nl > 0){
-		v->l = emalloc(sizeof(v->l[0])*v->nl);
-		for(i=0; i<v->nl; i++)
-			readbufltime(b, v->l+i);
+	if(n == -1)
+		v->nl = -1;
+	for(i=0; i<n; i++){
+		readbufltime(b, &t);
+		addvtime(v, &t);
 	}
 	setmalloctag(v, getcallerpc(&b));
 	return v;
@@ -356,7 +439,7 @@ readbufvtime(Buf *b)
 int
 vtimefmt(Fmt *fmt)
 {
-	int i;
+	int i, buf[8], *ord;
 	Vtime *v;
 
 	v = va_arg(fmt->args, Vtime*);
@@ -366,10 +449,14 @@ vtimefmt(Fmt *fmt)
 		return fmtstrcpy(fmt, "Inf");
 	if(v->nl==0)
 		return fmtstrcpy(fmt, "''");
+	ord = v->nl <= nelem(buf) ? buf : emalloc(v->nl*sizeof ord[0]);
+	vtimenameorder(v, ord);
 	for(i=0; i<v->nl; i++){
 		if(i)
 			fmtstrcpy(fmt, ",");
-		fmtprint(fmt, "%s:%lud/%lud", v->l[i].m, v->l[i].t, v->l[i].wall);
+		fmtprint(fmt, "%s:%lud/%lud", replicaname(v->l[ord[i]].id), v->l[ord[i]].t, v->l[ord[i]].wall);
 	}
+	if(ord != buf)
+		free(ord);
 	return 0;
 }
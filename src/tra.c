@@ -280,7 +280,7 @@ thetime(long t)
 void
 printmtime(int fd, Replica *r, Stat *s)
 {
-	int i;
+	int i, *ord;
 	char *by;
 	char *muid;
 	Vtime *m;
@@ -297,7 +297,7 @@ printmtime(int fd, Replica *r, Stat *s)
 		}
 		fprint(fd, "\t%s: last %s %s on %s%s%s\n",
 			rsysname(r), s->sysmtime ? "modified" : "noticed modification",
-			thetime(s->sysmtime ? s->sysmtime : m->l[0].wall), stripdot(m->l[0].m), by, muid);
+			thetime(s->sysmtime ? s->sysmtime : m->l[0].wall), stripdot(replicaname(m->l[0].id)), by, muid);
 		break;
 	default:
 		if(m->nl < 1){
@@ -305,8 +305,11 @@ printmtime(int fd, Replica *r, Stat *s)
 			break;
 		}
 		fprint(fd, "\t%s: file is resolution of modifications\n", r->name);
+		ord = emalloc(m->nl*sizeof ord[0]);
+		vtimenameorder(m, ord);
 		for(i=0; i<m->nl; i++)
-			fprint(fd, "\t\tnoticed at %s on %s\n", thetime(m->l[i].wall), stripdot(m->l[i].m));
+			fprint(fd, "\t\tnoticed at %s on %s\n", thetime(m->l[ord[i]].wall), stripdot(replicaname(m->l[ord[i]].id)));
+		free(ord);
 		fprint(fd, "\t\tfile's system mtime is %s\n", thetime(s->sysmtime));
 		break;
 	}
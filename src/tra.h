@@ -37,17 +37,22 @@ typedef struct Apath		Apath;
 typedef struct Buf		Buf;
 typedef struct Client		Client;
 typedef struct Db		Db;
+typedef struct Dbbust	Dbbust;
+typedef struct Dbcursor	Dbcursor;
+typedef struct Dbstrtab	Dbstrtab;
 typedef struct Fid		Fid;
 typedef struct Fd 	Fd;
 typedef struct Hash		Hash;
 typedef struct Hashlist	Hashlist;
 typedef struct Kid		Kid;
+typedef struct Kidview	Kidview;
 typedef struct Link		Link;
 typedef struct Ltime		Ltime;
 typedef struct Path		Path;
 typedef struct Replica	Replica;
 typedef struct Rpc		Rpc;
 typedef struct Stat		Stat;
+typedef struct Statview	Statview;
 typedef struct Str		Str;
 typedef struct Strcache	Strcache;
 typedef struct Sync		Sync;
@@ -128,14 +133,23 @@ struct Strcache
 
 struct Db
 {
-	u32int addr;
+	uvlong addr;
 	uint pagesize;
 	DStore *s;
 	DMap *root;
 	DMap *meta;
-	Strcache strcache;
+	Dbstrtab *strtab;
 	DMap *strtoid;
 	DMap *idtostr;
+	int *sidbyrid;	/* string ids of replica ids */
+	int nsidbyrid;
+	int *ridbysid;
+	Dbbust **bust;	/* ghostbust state of lists, by address */
+	int nbust;
+	uvlong *compact;	/* lists left in this compaction pass */
+	int ncompact;
+	int compactmoved;	/* pages, this pass */
+	uvlong compactsize;	/* store size after a pass that moved nothing */
 	Stat *rootstat;
 	DBlock *super;
 	DBlock *rootstatblock;
@@ -145,7 +159,10 @@ struct Db
 	int logfd;
 	int breakwrite;
 	int ignwr;
+	int snap;	/* a snapshot beside some other writer; see opendbsnap */
 	int alwaysflush;
+	int durability;
+	int bigdir;
 	Listcache *listcache;
 	Vtime *now;
 };
@@ -185,7 +202,27 @@ struct Kid
 {
 	char *name;
 	Stat *stat;
-	ulong addr;	/* not transmitted over wire; only used inside db.c */
+	uvlong addr;	/* not transmitted over wire; used by db.c, dbcursorputkids, dbloadkids */
+};
+
+/*
+ * a stat as stored in the db, decoded a field at a time
+ * by dbviewstate and friends.  the bytes belong to whoever
+ * made the view.
+ */
+struct Statview
+{
+	Db *db;
+	uchar *a;
+	int n;
+	Vtime *up;	/* parent's sync time to down-propagate, or nil */
+};
+
+struct Kidview
+{
+	char *name;
+	Statview v;
+	uvlong addr;
 };
 
 /* for free lists */
@@ -201,7 +238,7 @@ struct Ltime
 {
 	ulong t;		/* local event counting clock */
 	ulong wall;	/* local wall clock (debugging and error messages only) */
-	char *m;		/* machine name */
+	int id;		/* machine, from replicaid */
 };
 
 /*
@@ -452,8 +489,10 @@ struct Syncpath
  */
 struct Vtime
 {
-	Ltime *l;
+	Ltime *l;	/* sorted by id */
 	int nl;
+	int al;	/* room at l */
+	Ltime l1;	/* l for short vectors */
 };
 
 extern	int	debug;
@@ -465,6 +504,7 @@ extern	int	oneway;
 
 void		_coverage(char*, int);
 Hashlist*	addhash(Hashlist*, uchar*, vlong, vlong);
+void		addvtime(Vtime*, Ltime*);
 char*	atom(char*);
 int		banner(Replica*, char*);
 int		clientrpc(Replica*, Rpc*);
@@ -477,19 +517,40 @@ Vtime*		copyvtime(Vtime*);
 #define	coverage()	if((debug&DbgCoverage)==0){}else _coverage(__FILE__, __LINE__)
 Db*		createdb(char*, int);
 int		datumfmt(Fmt*);
+void		dbclosecursor(Dbcursor*);
+int		dbcompact(Db*);
+Dbcursor*	dbcursor(Db*, char**, int);
+int		dbcursordown(Dbcursor*, char*);
+int		dbcursorkids(Dbcursor*, Kid**);
+int		dbcursorkidviews(Dbcursor*, Kidview**);
+int		dbcursorput(Dbcursor*, Stat*);
+int		dbcursorputkids(Dbcursor*, Kid*, int);
+Stat*		dbcursorstat(Dbcursor*);
+void		dbcursorup(Dbcursor*);
 int		dbdelmeta(Db*, char*);
 int		dbdelstat(Db*, char**, int);
+int		dbdurability(Db*, int);
 void		dbg(int, char*, ...);
 #ifdef PLAN9
 #pragma	varargck argpos dbg 2
 #endif
 int		dbgetkids(Db*, char**, int, Kid**);
+int		dbgetkidviews(Db*, char**, int, Kidview**);
 char*		dbgetmeta(Db*, char*);
 int		dbgetstat(Db*, char**, int, Stat**);
 int		dbignorewrites(Db*);
 int		dbglevel(char*);
+long		dbidle(Db*);
+uvlong		dbloadkids(Db*, Stat*, Kid*, int);
+void		dbloadroot(Db*, Stat*, Kid*, int);
+void		dbprefetchkids(Db*, Kid*, int);
 int		dbputmeta(Db*, char*, char*);
 int		dbputstat(Db*, char**, int, Stat*);
+void		dbreloadstrings(Db*);
+Vtime*		dbviewmtime(Statview*);
+int		dbviewstate(Statview*);
+Stat*		dbviewstat(Statview*);
+Vtime*		dbviewsynctime(Statview*);
 Replica*	dialreplica(char*);
 Replica*	_dialreplica(char*);
 void		dumpdb(Db*, int);
@@ -505,6 +566,7 @@ Apath*		flattenpath(Path*);
 int		flushdb(Db*);
 void		flushstrcache(Strcache*);
 void		freekids(Kid*, int);
+void		freekidviews(Kidview*, int);
 void		freepath(Path*);
 void		freestat(Stat*);
 void		freesysstatlist(Sysstat**, int);
@@ -539,6 +601,7 @@ Vtime*		mkvtime1(char*, ulong, ulong);
 int		nilstrcmp(char*, char*);
 void		nonotes(void);
 Db*		opendb(char*);
+Db*		opendbsnap(char*);
 Fd*		openconsole(void);
 void		osinit(void);
 void		panic(char*, ...);
@@ -559,9 +622,12 @@ char*		readbufstring(Buf*);
 char*		readbufstringdup(Buf*);
 uvlong		readbufvl(Buf*);
 Vtime*		readbufvtime(Buf*);
+int		replicaid(char*);
+char*		replicaname(int);
 void		replclose(Replica*);
 void		replmuxinit(Replica*);
 Buf*		replread(Replica*);
+int		replwait(Replica*, long);
 int		replwrite(Replica*, Buf*);
 int		replflush(Replica*);
 void		resolve(Syncpath*, int);
@@ -612,10 +678,13 @@ int		syscommit(Fid*);
 int		syscreateexcl(char*);
 char*		sysctime(long);
 void		sysinit(void);
+int		sysisdir(Sysstat*);
 int		syskids(char*, Sysstat***, Sysstat*);
 int		sysmkdir(char*, Stat*);
+int		sysncpu(void);
 int		sysopen(Fid*, char*, int);
 int		sysread(Fid*, void*, int);
+int		sysready(int, long);
 int		sysremove(char*);
 int		sysseek(Fid*, vlong);
 int		sysstat(char*, Stat*, int, Sysstat*);
@@ -633,9 +702,11 @@ void		tralog(char*, ...);
 int		tread(Fd*, void*, int);
 int		treadn(Fd*, void*, int);
 int		twrite(Fd*, void*, int);
+int		twait(Fd*, long);
 int		twflush(Fd*);
 Vtime*		unmaxvtime(Vtime*, Vtime*);
 int		vtimefmt(Fmt*);
+void		vtimenameorder(Vtime*, int*);
 void		warn(const char*, ...);
 void		workthread(void*);
 char*	workstr(Syncpath*, int);
@@ -3,13 +3,18 @@
 void
 usage(void)
 {
-	fprint(2, "usage: tradump dbfile\n");
+	fprint(2, "usage: tradump [-s] dbfile\n");
 	exits("usage");
 }
 
+/*
+ * with -s, dump a snapshot of the database, so that
+ * trasrv can keep running meanwhile.
+ */
 void
 main(int argc, char **argv)
 {
+	int sflag;
 	Db *db;
 
 	fmtinstall('H', encodefmt);
@@ -17,7 +22,11 @@ main(int argc, char **argv)
 	fmtinstall('$', statfmt);
 	fmtinstall('V', vtimefmt);
 
+	sflag = 0;
 	ARGBEGIN{
+	case 's':
+		sflag = 1;
+		break;
 	case 'V':
 		traversion();
 	default:
@@ -27,11 +36,17 @@ main(int argc, char **argv)
 	if(argc != 1)
 		usage();
 
-	db = opendb(argv[0]);
+	if(sflag)
+		db = opendbsnap(argv[0]);
+	else
+		db = opendb(argv[0]);
 	if(db == nil)
 		sysfatal("opendb '%s': %r", argv[0]);
+	dbignorewrites(db);
 
 	dumpdb(db, 1);
+	if(sflag)
+		closedb(db);	/* gives up the snapshot */
 	exits(nil);
 }
 
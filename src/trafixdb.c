@@ -31,6 +31,24 @@
  *
  * File space leaks (none are currently known) can be corrected
  * by running with -c to create a new copy of the database.
+ * The copy is always written with 64-bit block addresses,
+ * so -c also converts databases made before that format
+ * (which cannot grow past 4GB) to the current one.
+ *
+ * With -s, just read every page of the store and check it
+ * against its checksum, without looking at what it holds.
+ * Pages that have no checksum yet (the store predates them)
+ * get one, unless -n is given too.
+ *
+ * With -n or -c the database is only read, so it is opened as a
+ * snapshot (see opendbsnap) and trasrv can keep running.
+ *
+ * Before fixing anything, nproc processes (-p; one per cpu by
+ * default) check the tree, each taking whole subtrees, for the
+ * problems dbfixtree fixes.  Only if they find one does the
+ * tree get dbfixtree's slower walk.  With -c there is no check
+ * first: dbfixtree writes the copy as it goes, a checkpoint at
+ * a time, so memory stays bounded however large the database.
  */
 
 char *knownproblems= 
@@ -39,10 +57,19 @@ char *knownproblems=
 ;
 
 int nflag;
+int nproc;
+int sflag;
 int verbose;
 Db *db;
 Db *wdb;
 
+/*
+ * the strings of db by id, so that reading a stat
+ * costs neither a map lookup nor a copy per string.
+ */
+char *idtab[65536];
+Db *idtabdb;
+
 /*
  * marshal/unmarshal stat structures.
  */
@@ -94,6 +121,8 @@ idtostr(Db *db, int i)
 
 	if(i == 0)
 		return nil;
+	if(db == idtabdb && idtab[i])
+		return idtab[i];	/* freestat doesn't free strings */
 
 	PSHORT(buf, i);
 	k.a = buf;
@@ -143,12 +172,14 @@ dbwritebufltime(Db *db, Buf *b, Ltime *t)
 	writebufc(b, 1);
 	writebufl(b, t->t);
 	writebufl(b, t->wall);
-	dbwritebufstring(db, b, t->m);
+	dbwritebufstring(db, b, replicaname(t->id));
 }
 
 static void
 dbreadbufltime(Db *db, Buf *b, Ltime *t)
 {
+	char *m;
+
 	switch(readbufc(b)){
 	case 0:
 		b->p--;
@@ -161,13 +192,18 @@ dbreadbufltime(Db *db, Buf *b, Ltime *t)
 	}
 	t->t = readbufl(b);
 	t->wall = readbufl(b);
-	t->m = dbreadbufstringdup(db, b);
+	m = dbreadbufstringdup(db, b);
+	if(m == nil){
+		werrstr("db: nil machine name");
+		longjmp(b->jmp, BufData);
+	}
+	t->id = replicaid(m);
 }
 
 static void
 dbwritebufvtime(Db *db, Buf *b, Vtime *v)
 {
-	int i;
+	int i, buf[8], *ord;
 
 	writebufc(b, 0);
 	if(v == nil){
@@ -175,14 +211,21 @@ dbwritebufvtime(Db *db, Buf *b, Vtime *v)
 		return;
 	}
 	writebufl(b, v->nl);
+	if(v->nl <= 0)
+		return;
+	ord = v->nl <= nelem(buf) ? buf : emalloc(v->nl*sizeof ord[0]);
+	vtimenameorder(v, ord);
 	for(i=0; i<v->nl; i++)
-		dbwritebufltime(db, b, v->l+i);
+		dbwritebufltime(db, b, v->l+ord[i]);
+	if(ord != buf)
+		free(ord);
 }
 
 static Vtime*
 dbreadbufvtime(Db *db, Buf *b)
 {
 	int i, n;
+	Ltime t;
 	Vtime *v;
 
 	if(readbufc(b) != 0)
@@ -194,11 +237,11 @@ dbreadbufvtime(Db *db, Buf *b)
 	if(n < -2 || n > 65536)
 		longjmp(b->jmp, 1);
 	v = mkvtime();
-	v->nl = n;
-	if(v->nl > 0){
-		v->l = emalloc(sizeof(v->l[0])*v->nl);
-		for(i=0; i<v->nl; i++)
-			dbreadbufltime(db, b, v->l+i);
+	if(n == -1)
+		v->nl = -1;
+	for(i=0; i<n; i++){
+		dbreadbufltime(db, b, &t);
+		addvtime(v, &t);
 	}
 	setmalloctag(v, getcallerpc(&db));
 	return v;
@@ -326,6 +369,7 @@ walkkids(void *v, Datum *key, Datum *val)
 {
 	struct { Path *p; Db *db; Kid *k; int nk; int err; } *a;
 	uchar *p;
+	int as;
 	Path *kp;
 
 	a = v;
@@ -335,7 +379,8 @@ walkkids(void *v, Datum *key, Datum *val)
 		a->k = erealloc(a->k, (a->nk+16)*sizeof(Kid));
 	a->k[a->nk].name = emalloc(key->n+1);
 	memmove(a->k[a->nk].name, key->a, key->n);
-	if(val->n <= 4){
+	as = a->db->s->addrsize;
+	if(val->n <= as){
 	Malformed:
 		kp = mkpath(a->p, a->k[a->nk].name);
 		print("%P: removing malformed database entry\n", kp);
@@ -345,8 +390,8 @@ walkkids(void *v, Datum *key, Datum *val)
 		return;
 	}
 	p = val->a;
-	a->k[a->nk].addr = LONG(p);
-	a->k[a->nk].stat = dbparsestat(a->db, (uchar*)val->a+4, val->n-4);
+	a->k[a->nk].addr = getaddr(a->db->s, p);
+	a->k[a->nk].stat = dbparsestat(a->db, p+as, val->n-as);
 	if(a->k[a->nk].stat == nil)
 		goto Malformed;
 	a->nk++;
@@ -362,6 +407,7 @@ kidsinmap(Db *db, Path *p, DMap *m, Kid **pk)
 	a.p = p;
 	m->walk(m, walkkids, &a);
 	*pk = a.k;
+	dbprefetchkids(db, a.k, a.nk);
 	return a.nk;
 }
 
@@ -379,8 +425,8 @@ DMap*
 dbfixtree(Path *p, DMap *m)
 {
 	Kid *k;
-	int bad, changed, i, j, nk;
-	u32int naddr;
+	int bad, changed, i, j, l, nk;
+	uvlong naddr;
 	DMap *km;
 	Path *kp;
 	uchar *up;
@@ -415,6 +461,10 @@ dbfixtree(Path *p, DMap *m)
 			kp = mkpath(p, k[i].name);
 			print("%P: %d duplicate entries; deleting all\n", kp, j-i);
 			freepath(kp);
+			for(l=i; l<j; l++){
+				free(k[l].name);
+				freestat(k[l].stat);
+			}
 			if(nk-j)
 				memmove(&k[i], &k[j], (nk-j)*sizeof(k[0]));
 			nk -= j-i;
@@ -430,7 +480,7 @@ dbfixtree(Path *p, DMap *m)
 	for(i=0; i<nk; i++){
 		if(k[i].addr == 0)
 			continue;
-		km = dmaplist(db->s, k[i].addr, 0);
+		km = dmapopen(db->s, k[i].addr);
 		kp = mkpath(p, k[i].name);
 		if(km == nil){
 			print("%P: bad directory pointer; truncating directory\n", kp);
@@ -456,23 +506,184 @@ dbfixtree(Path *p, DMap *m)
 	 * rewrite the pages; insert in reverse order for linear time.
 	 */
 	if(changed || wdb != db){
-		m->free(m);
-		m = dmaplist(wdb->s, 0, db->pagesize);
+		if(wdb == db)
+			m->free(m);
+		else
+			m->close(m);
+		if(wdb->bigdir && nk >= wdb->bigdir)
+			m = dmaptree(wdb->s, 0, db->pagesize);
+		else
+			m = dmaplist(wdb->s, 0, db->pagesize);
 		for(i=nk-1; i>=0; i--){
 			key.a = k[i].name;
 			key.n = strlen(k[i].name);
-			dbunparsestat(wdb, k[i].stat, &val, 4);
+			dbunparsestat(wdb, k[i].stat, &val, wdb->s->addrsize);
 			up = val.a;
-			PLONG(up, k[i].addr);
+			putaddr(wdb->s, up, k[i].addr);
 			if(m->insert(m, &key, &val, DMapCreate) < 0){
 				kp = mkpath(p, k[i].name);
 				sysfatal("%P: cannot reinsert %P: %r", p, kp);
 			}
 		}
+		/* a copy goes out as it is made, not all at closedb */
+		if(wdb != db && dstoreneedflush(wdb->s) && flushdb(wdb) < 0)
+			sysfatal("writing copy: %r");
 	}
+	freekids(k, nk);
 	return m;
 }
 
+/*
+ * check without changing anything, just counting what
+ * dbfixtree would find: entries it can't parse, names out
+ * of order or repeated, directory pointers it can't open.
+ */
+typedef struct Check Check;
+struct Check
+{
+	long nbad;
+	char *last;	/* previous name in the list */
+	uvlong *kid;	/* directories under this one */
+	int nkid;
+};
+
+static void
+checkkid(void *v, Datum *key, Datum *val)
+{
+	int as;
+	char *name;
+	uchar *p;
+	uvlong addr;
+	Check *c;
+	Stat *s;
+
+	c = v;
+	name = emalloc(key->n+1);
+	memmove(name, key->a, key->n);
+	if(c->last && strcmp(c->last, name) >= 0)
+		c->nbad++;
+	free(c->last);
+	c->last = name;
+
+	as = db->s->addrsize;
+	p = val->a;
+	if(val->n <= as || (s = dbparsestat(db, p+as, val->n-as)) == nil){
+		c->nbad++;
+		return;
+	}
+	freestat(s);
+	if((addr = getaddr(db->s, p)) != 0){
+		if(c->nkid%16 == 0)
+			c->kid = erealloc(c->kid, (c->nkid+16)*sizeof(c->kid[0]));
+		c->kid[c->nkid++] = addr;
+	}
+}
+
+static long
+checkdir(DMap *m, uvlong **kid, int *nkid)
+{
+	Check c;
+
+	memset(&c, 0, sizeof c);
+	m->walk(m, checkkid, &c);
+	free(c.last);
+	dstoreprefetch(db->s, c.kid, c.nkid);
+	*kid = c.kid;
+	*nkid = c.nkid;
+	return c.nbad;
+}
+
+static long
+checktree(uvlong addr)
+{
+	int i, nkid;
+	long nbad;
+	uvlong *kid;
+	DMap *m;
+
+	if((m = dmapopen(db->s, addr)) == nil)
+		return 1;
+	nbad = checkdir(m, &kid, &nkid);
+	m->close(m);
+	for(i=0; i<nkid; i++)
+		nbad += checktree(kid[i]);
+	free(kid);
+	return nbad;
+}
+
+/*
+ * check the top few levels here, until there are plenty
+ * of subtrees to go around, then fork nproc checkers that
+ * take subtrees from a pipe until it is empty.  each has
+ * its own copy of the caches, so they share nothing but
+ * the file.
+ */
+static long
+checkall(void)
+{
+	int h, i, n, nkid, nw, p[2], r[2];
+	long nbad, x;
+	uvlong *kid, *w;
+	DMap *m;
+
+	nbad = checkdir(db->root, &w, &nw);
+	for(h=0; h<nw && nw-h < 8*nproc; h++){
+		if((m = dmapopen(db->s, w[h])) == nil){
+			nbad++;
+			continue;
+		}
+		nbad += checkdir(m, &kid, &nkid);
+		m->close(m);
+		w = erealloc(w, (nw+nkid)*sizeof(w[0]));
+		memmove(w+nw, kid, nkid*sizeof(w[0]));
+		nw += nkid;
+		free(kid);
+	}
+	if(nproc <= 1 || nw-h <= 1){
+		for(; h<nw; h++)
+			nbad += checktree(w[h]);
+		free(w);
+		return nbad;
+	}
+
+	if(pipe(p) < 0 || pipe(r) < 0)
+		sysfatal("pipe: %r");
+	n = nproc < nw-h ? nproc : nw-h;
+	for(i=0; i<n; i++){
+		switch(fork()){
+		case -1:
+			sysfatal("fork: %r");
+		case 0:
+			close(p[1]);
+			close(r[0]);
+			if(dstoreforked(db->s) < 0)
+				sysfatal("checker: %r");
+			x = 0;
+			/* each index is one write, so each read gets a whole one */
+			while(read(p[0], &h, sizeof h) == sizeof h)
+				x += checktree(w[h]);
+			write(r[1], &x, sizeof x);
+			exits(nil);
+		}
+	}
+	close(p[0]);
+	close(r[1]);
+	for(; h<nw; h++)
+		if(write(p[1], &h, sizeof h) != sizeof h)
+			sysfatal("write: %r");
+	close(p[1]);
+	for(i=0; i<n; i++){
+		if(readn(r[0], &x, sizeof x) != sizeof x)
+			sysfatal("a checker died");
+		nbad += x;
+	}
+	for(i=0; i<n; i++)
+		waitpid();
+	close(r[0]);
+	free(w);
+	return nbad;
+}
+
 /*
  * arguably, we should be using something like these
  * Stab-based routines in db.c.  it's much simpler.
@@ -595,13 +806,13 @@ checkstab(void)
 	wdb->strtoid = dmaplist(wdb->s, 0, wdb->pagesize);
 	if(wdb->strtoid == nil)
 		sysfatal("wbstab: allocating strtoid list: %r");
-	snprint(buf, sizeof buf, "%ud", wdb->strtoid->addr);
+	snprint(buf, sizeof buf, "%llud", wdb->strtoid->addr);
 	dbputmeta(wdb, "strtoid", buf);
 
 	wdb->idtostr = dmaplist(wdb->s, 0, wdb->pagesize);
 	if(wdb->idtostr == nil)
 		sysfatal("wbstab: allocating strtoid list: %r");
-	snprint(buf, sizeof buf, "%ud", wdb->idtostr->addr);
+	snprint(buf, sizeof buf, "%llud", wdb->idtostr->addr);
 	dbputmeta(wdb, "idtostr", buf);
 
 	qsort(stab, nstab, sizeof(stab[0]), stabscmp);
@@ -625,6 +836,28 @@ checkstab(void)
 		if(wdb->strtoid->insert(wdb->idtostr, &k, &v, DMapCreate|DMapReplace) < 0)
 			sysfatal("wbstab insert strtoid: %r");
 	}
+	dbreloadstrings(wdb);
+}
+
+static void
+idtabwalk(void *a, Datum *k, Datum *v)
+{
+	uchar *p;
+
+	USED(a);
+	if(k->n != 2)
+		return;
+	p = k->a;
+	free(idtab[SHORT(p)]);
+	idtab[SHORT(p)] = emalloc(v->n+1);
+	memmove(idtab[SHORT(p)], v->a, v->n);
+}
+
+void
+loadidtab(Db *db)
+{
+	db->idtostr->walk(db->idtostr, idtabwalk, nil);
+	idtabdb = db;
 }
 
 void
@@ -643,15 +876,23 @@ copymeta(void *a, Datum *k, Datum *v)
 void
 usage(void)
 {
-	fprint(2, "usage: trafixdb [-c new.tradb] [-nv] dbfile\n");
+	fprint(2, "usage: trafixdb [-c new.tradb] [-nsv] [-p nproc] dbfile\n");
 	exits("usage");
 }
 
 void
 main(int argc, char **argv)
 {
+	char *newfile;
+	long nbad;
+	uvlong a;
+	DMap *m;
+	DStats st0, st;
+
 	initfmt();
 
+	newfile = nil;
+	nproc = sysncpu();
 	ARGBEGIN{
 	case 'V':
 		traversion();
@@ -659,27 +900,56 @@ main(int argc, char **argv)
 		print("known inconsistencies that trafixdb fixes:\n");
 		write(1, knownproblems, strlen(knownproblems));
 		exits(nil);
+	case 'c':
+		newfile = EARGF(usage());
+		break;
 	case 'n':
 		nflag = 1;
 		break;
+	case 'p':
+		nproc = atoi(EARGF(usage()));
+		break;
+	case 's':
+		sflag = 1;
+		break;
 	case 'v':
 		verbose = 1;
 		break;
 	}ARGEND
 
-	if(argc != 1 && argc != 2)
+	if(argc == 2 && newfile == nil)
+		newfile = argv[--argc];
+	if(argc != 1)
 		usage();
 
-	db = opendb(argv[0]);
+	db = nil;
+	if((nflag || newfile) && !sflag)
+		db = opendbsnap(argv[0]);
+	if(db == nil)
+		db = opendb(argv[0]);
 	if(db == nil)
 		sysfatal("opening db %q: %r", argv[0]);
 
+	if(sflag){
+		if(nflag)
+			dbignorewrites(db);
+		dstorestats(db->s, &st0);	/* opening read a few */
+		if((nbad = dstorescrub(db->s, 1)) < 0)
+			sysfatal("scrubbing db %q: %r", argv[0]);
+		dstorestats(db->s, &st);
+		print("%lud pages checked, %ld bad, %lud without checksum\n",
+			st.verified+st.badsum - (st0.verified+st0.badsum), nbad, st.nosum-st0.nosum);
+		closedb(db);
+		exits(nbad ? "bad pages" : nil);
+	}
+
 	wdb = db;
-	if(argc == 2){
-		wdb = createdb(argv[1], db->pagesize+db->s->hdrsize);
+	if(newfile){
+		wdb = createdb(newfile, db->pagesize+db->s->hdrsize);
 		if(wdb == nil)
-			sysfatal("creating db %q: %r", argv[1]);
-		dbputstat(wdb, nil, 0, db->rootstat);
+			sysfatal("creating db %q: %r", newfile);
+		wdb->rootstat = copystat(db->rootstat);
+		wdb->rootstatdirty = 1;
 
 		db->meta->walk(db->meta, copymeta, wdb->meta);
 	}
@@ -687,8 +957,23 @@ main(int argc, char **argv)
 	if(nflag || db != wdb)
 		dbignorewrites(db);
 
+	loadidtab(db);
 	checkstab();
-	db->root = dbfixtree(nil, db->root);
+	if(newfile == nil && (nbad = checkall()) == 0){
+		if(verbose)
+			print("no problems found\n");
+		closedb(db);
+		exits(nil);
+	}
+	a = db->root->addr;
+	m = dbfixtree(nil, db->root);
+	if(wdb != db){
+		/* dbfixtree closed the old root; reopen it for closedb */
+		wdb->root->free(wdb->root);
+		wdb->root = m;
+		db->root = dmapopen(db->s, a);
+	}else
+		db->root = m;
 
 	closedb(db);
 	if(db != wdb)
@@ -1,23 +1,550 @@
 #include "tra.h"
 
+/*
+ * With -r, tramkdb goes on to fill the new db from the
+ * tree at root, recording what the first trasrv scan of
+ * it would, without the scan's cost per file.
+ *
+ * The parent walks the top of the tree and writes records
+ * for it to a file: a stat for each directory, and in place
+ * of each run of plain files and of each subtree deep enough
+ * down, a marker for an item of work.  nproc workers stat
+ * and hash the items, taking them from a pipe and writing
+ * the records for each to a file of their own.  The parent
+ * then reads the top back, and each item's records as it
+ * comes to them, writing each directory's list as its last
+ * record goes by: the lists go out bottom up, whole and
+ * sorted (dbloadkids).
+ *
+ * A record is an op byte and, but for 'u', a name and stat:
+ *	f	a plain file
+ *	d	a directory, whose kids follow up to a 'u'
+ *	i	a directory, whose kids are the next item
+ *	c	(no name or stat) more kids, in the next item
+ *	u	end of a directory's kids
+ */
+
+enum
+{
+	RunSize = 64,	/* files in an item */
+	Window = 1024,	/* items handed out ahead of the reader */
+};
+
+typedef struct Item Item;
+struct Item
+{
+	Path *p;	/* directory */
+	char *tpath;
+	Vtime *st;	/* its sync time */
+	char **name;	/* files in it to stat; nil for the whole tree */
+	int nname;
+};
+
+Item *item;
+int nitem;
+int nproc;
+Vtime *now;
+
+/* reading the items back */
+Biobuf *itemb;	/* by worker */
+int *done;	/* worker+1 once written */
+int nread;
+int nsent;
+int workfd;
+int resfd;
+
+static char **cfg;
+static int ncfg;
+
 void
 usage(void)
 {
-	fprint(2, "usage: tramkdb [-R] [-b blocksize] dbfile sysname\n");
+	fprint(2, "usage: tramkdb [-R] [-b blocksize] [-i inc/exc] [-o opt] [-p nproc] [-r root] dbfile sysname\n");
 	exits("usage");
 }
 
+void
+addcfg(char *s)
+{
+	if(ncfg%16 == 0)
+		cfg = erealloc(cfg, (16+ncfg)*sizeof(cfg[0]));
+	cfg[ncfg++] = estrdup(s);
+}
+
+int
+config(char *s)
+{
+	int i;
+
+	for(i=0; i<ncfg; i++)
+		if(strcmp(cfg[i], s) == 0)
+			return 1;
+	return 0;
+}
+
+static Vtime*
+copynow(Vtime *now, ulong mtime)
+{
+	now = copyvtime(now);
+	if(mtime != 0)
+		now->l[0].wall = mtime;
+	return now;
+}
+
+static int
+syskidscmp(const void *va, const void *vb)
+{
+	Sysstat *a, *b;
+
+	a = *(Sysstat**)va;
+	b = *(Sysstat**)vb;
+	return strcmp(a->name, b->name);
+}
+
+static void
+putrec(Biobuf *b, int op, char *name, Stat *s)
+{
+	static uchar *a;
+	static long na;
+	long n;
+	Buf mb;
+
+	memset(&mb, 0, sizeof mb);
+	writebufstring(&mb, name);
+	writebufstat(&mb, s);
+	n = (intptr)mb.p;
+	if(4+n > na){
+		na = 4+n;
+		a = erealloc(a, na);
+	}
+	PLONG(a, n);
+	mb.p = a+4;
+	mb.ep = a+4+n;
+	if(setjmp(mb.jmp))
+		sysfatal("putrec: buffer overflow");
+	writebufstring(&mb, name);
+	writebufstat(&mb, s);
+	if(Bputc(b, op) < 0 || Bwrite(b, a, 4+n) != 4+n)
+		sysfatal("write records: %r");
+}
+
+static void
+getrec(Biobuf *b, char **name, Stat **s)
+{
+	static uchar *a;
+	static long na;
+	uchar hdr[4];
+	long n;
+	Buf mb;
+
+	if(Bread(b, hdr, 4) != 4)
+		sysfatal("short record");
+	n = LONG(hdr);
+	if(n > na){
+		na = n;
+		a = erealloc(a, na);
+	}
+	if(Bread(b, a, n) != n)
+		sysfatal("short record");
+	mb.p = a;
+	mb.ep = a+n;
+	if(setjmp(mb.jmp))
+		sysfatal("bad record");
+	*name = readbufstringdup(&mb);
+	*s = readbufstat(&mb);
+}
+
+/*
+ * the stat the first scan would record for tpath, new in a
+ * directory with sync time st, or nil if it would record none.
+ */
+static Stat*
+scanstat(char *tpath, Vtime *st, Sysstat *ss)
+{
+	Stat *s;
+
+	s = mkghoststat(st);
+	if(!sysstat(tpath, s, 1, ss)){
+		freestat(s);
+		return nil;
+	}
+	freevtime(s->ctime);
+	s->ctime = copynow(now, s->sysmtime);
+	freevtime(s->mtime);
+	s->mtime = copynow(now, s->sysmtime);
+	return s;
+}
+
+static int
+ignored(Path *p)
+{
+	int r;
+	Apath *ap;
+
+	ap = flattenpath(p);
+	r = ignorepath(ap);
+	free(ap);
+	return r;
+}
+
+static void
+emitfile(Biobuf *b, Path *p, char *tpath, Vtime *st, Sysstat *ss)
+{
+	Stat *s;
+
+	if((s = scanstat(tpath, st, ss)) == nil)
+		return;
+	putrec(b, 'f', p->s, s);
+	freestat(s);
+}
+
+static int
+newitem(Path *p, char *tpath, Vtime *st)
+{
+	Item *it;
+
+	if(nitem%32 == 0)
+		item = erealloc(item, (nitem+32)*sizeof(item[0]));
+	it = &item[nitem];
+	memset(it, 0, sizeof *it);
+	if(p)
+		p->ref++;
+	it->p = p;
+	it->tpath = estrdup(tpath);
+	it->st = copyvtime(st);
+	return nitem++;
+}
+
+/*
+ * write the records for the kids of directory p, at tpath
+ * with sync time st.  d is how many levels remain above
+ * the subtrees that are items, or -1 in a worker.
+ */
+static void
+emit(Biobuf *b, Path *p, char *tpath, Vtime *st, int d)
+{
+	int i, nks, run;
+	char *ktpath;
+	Item *it;
+	Path *kp;
+	Stat *s;
+	Sysstat **ks;
+
+	nks = syskids(tpath, &ks, nil);
+	if(nks < 0)
+		nks = 0;
+	qsort(ks, nks, sizeof(ks[0]), syskidscmp);
+	run = -1;
+	for(i=0; i<nks; i++){
+		kp = mkpath(p, ks[i]->name);
+		if(ignored(kp)){	/* the scan never looks at these */
+			freepath(kp);
+			continue;
+		}
+		ktpath = esmprint("%s/%s", tpath, ks[i]->name);
+		if(!sysisdir(ks[i])){
+			if(d < 0)
+				emitfile(b, kp, ktpath, st, ks[i]);
+			else{
+				if(run < 0 || item[run].nname == RunSize){
+					run = newitem(p, tpath, st);
+					Bputc(b, 'c');
+				}
+				it = &item[run];
+				if(it->nname%16 == 0)
+					it->name = erealloc(it->name, (it->nname+16)*sizeof(it->name[0]));
+				it->name[it->nname++] = estrdup(ks[i]->name);
+			}
+		}else{
+			run = -1;	/* a run holds adjacent files only */
+			if((s = scanstat(ktpath, st, ks[i])) != nil){
+				if(d == 1){
+					putrec(b, 'i', ks[i]->name, s);
+					newitem(kp, ktpath, s->synctime);
+				}else{
+					putrec(b, 'd', ks[i]->name, s);
+					emit(b, kp, ktpath, s->synctime, d < 0 ? d : d-1);
+				}
+				freestat(s);
+			}
+		}
+		freepath(kp);
+		free(ktpath);
+	}
+	freesysstatlist(ks, nks);
+	Bputc(b, 'u');
+}
+
+static void
+work(Biobuf *b, Item *it)
+{
+	int i;
+	char *tpath;
+	Path *p;
+
+	if(it->name == nil){
+		emit(b, it->p, it->tpath, it->st, -1);
+		return;
+	}
+	for(i=0; i<it->nname; i++){
+		p = mkpath(it->p, it->name[i]);
+		tpath = esmprint("%s/%s", it->tpath, it->name[i]);
+		emitfile(b, p, tpath, it->st, nil);
+		freepath(p);
+		free(tpath);
+	}
+	Bputc(b, 'u');
+}
+
+/*
+ * the depth below root at which there are enough directories
+ * to keep nproc workers busy, or the deepest there is.
+ */
+static int
+treedepth(char *root)
+{
+	int d, i, j, nks, nlev, nnext;
+	char **lev, **next;
+	Sysstat **ks;
+
+	lev = emalloc(sizeof(lev[0]));
+	lev[0] = estrdup(root);
+	nlev = 1;
+	for(d=0; nlev > 0 && nlev < 8*nproc; d++){
+		next = nil;
+		nnext = 0;
+		for(i=0; i<nlev; i++){
+			nks = syskids(lev[i], &ks, nil);
+			for(j=0; j<nks; j++){
+				if(!sysisdir(ks[j]))
+					continue;
+				if(nnext%32 == 0)
+					next = erealloc(next, (nnext+32)*sizeof(next[0]));
+				next[nnext++] = esmprint("%s/%s", lev[i], ks[j]->name);
+			}
+			freesysstatlist(ks, nks);
+			free(lev[i]);
+		}
+		free(lev);
+		lev = next;
+		nlev = nnext;
+	}
+	for(i=0; i<nlev; i++)
+		free(lev[i]);
+	free(lev);
+	if(nlev == 0 && d > 1)
+		d--;	/* ran out of directories below d-1 */
+	return d;
+}
+
+/*
+ * an unlinked file to pass records through: written
+ * through *wfd, read through the result.
+ */
+static int
+tmpfile(char *dbfile, int i, int *wfd)
+{
+	int fd;
+	char *s;
+
+	s = esmprint("%s.load%d", dbfile, i);
+	if((*wfd = create(s, OWRITE, 0600)) < 0)
+		sysfatal("create %s: %r", s);
+	if((fd = open(s, OREAD)) < 0)
+		sysfatal("open %s: %r", s);
+	remove(s);
+	free(s);
+	return fd;
+}
+
+static void
+senditem(void)
+{
+	if(write(workfd, &nsent, sizeof nsent) != sizeof nsent)
+		sysfatal("write: %r");
+	if(++nsent == nitem)
+		close(workfd);
+}
+
+/*
+ * the records of the next item, once it is written.
+ */
+static Biobuf*
+nextitem(void)
+{
+	int h, x[2];
+
+	h = nread++;
+	while(done[h] == 0){
+		if(readn(resfd, x, sizeof x) != sizeof x)
+			sysfatal("a worker died");
+		done[x[0]] = x[1]+1;
+		if(nsent < nitem)
+			senditem();
+	}
+	return &itemb[done[h]-1];
+}
+
+/*
+ * read the records for the kids of a directory, up to
+ * its 'u', writing the lists of those that are directories.
+ */
+static int
+readkids(Db *db, Biobuf *b, Kid **pk)
+{
+	int i, op, nk, n;
+	char *name;
+	uvlong addr;
+	Kid *k, *kk;
+	Stat *s;
+
+	k = nil;
+	nk = 0;
+	for(;;){
+		switch(op = Bgetc(b)){
+		default:
+			sysfatal("bad record type %d", op);
+		case 'u':
+			*pk = k;
+			return nk;
+		case 'c':
+			n = readkids(db, nextitem(), &kk);
+			for(i=0; i<n; i++){
+				if(nk%32 == 0)
+					k = erealloc(k, (nk+32)*sizeof(k[0]));
+				k[nk++] = kk[i];
+			}
+			free(kk);
+			continue;
+		case 'f':
+		case 'd':
+		case 'i':
+			break;
+		}
+		getrec(b, &name, &s);
+		addr = 0;
+		if(op != 'f'){
+			n = readkids(db, op == 'd' ? b : nextitem(), &kk);
+			addr = dbloadkids(db, s, kk, n);
+			freekids(kk, n);
+			/* keeps the dirty pages in memory bounded */
+			if(dstoreneedflush(db->s) && flushdb(db) < 0)
+				sysfatal("flushdb: %r");
+		}
+		if(nk%32 == 0)
+			k = erealloc(k, (nk+32)*sizeof(k[0]));
+		k[nk].name = name;
+		k[nk].stat = s;
+		k[nk].addr = addr;
+		nk++;
+	}
+}
+
+static void
+load(char *dbfile, char *root)
+{
+	int d, fd, h, i, n, nw, wfd, w[2], r[2], x[2];
+	char *sysname;
+	Biobuf b, top;
+	Db *db;
+	Kid *k;
+	Stat *s;
+
+	if((db = opendb(dbfile)) == nil)
+		sysfatal("opendb %s: %r", dbfile);
+	if((sysname = dbgetmeta(db, "sysname")) == nil)
+		sysfatal("cannot look up system name in database: %r");
+
+	/* the first scan's event counter; trasrv goes on from it */
+	now = mkvtime1(sysname, 1, time(0));
+	free(sysname);
+	if(dbputmeta(db, "now", "1") < 0)
+		sysfatal("cannot write event counter to database: %r");
+	freevtime(db->now);
+	db->now = copyvtime(now);
+	dbgetstat(db, nil, 0, &s);
+	maxvtime(s->synctime, now);
+	sysstat(root, s, 1, nil);
+	if(s->state != SDir)
+		sysfatal("%s is not a directory", root);
+	freevtime(s->ctime);
+	s->ctime = copynow(now, s->sysmtime);
+	freevtime(s->mtime);
+	s->mtime = copynow(now, s->sysmtime);
+
+	d = treedepth(root);
+	fd = tmpfile(dbfile, 0, &wfd);
+	Binit(&b, wfd, OWRITE);
+	emit(&b, nil, root, s->synctime, d);
+	Bterm(&b);
+	close(wfd);
+	Binit(&top, fd, OREAD);
+
+	nw = nproc < nitem ? nproc : nitem;
+	itemb = emalloc(nw*sizeof(itemb[0]));
+	done = emalloc(nitem*sizeof(done[0]));
+	if(pipe(w) < 0 || pipe(r) < 0)
+		sysfatal("pipe: %r");
+	for(i=0; i<nw; i++){
+		Binit(&itemb[i], tmpfile(dbfile, i+1, &wfd), OREAD);
+		switch(fork()){
+		case -1:
+			sysfatal("fork: %r");
+		case 0:
+			close(w[1]);
+			close(r[0]);
+			Binit(&b, wfd, OWRITE);
+			x[1] = i;
+			/* each index is one write, so each read gets a whole one */
+			while(read(w[0], &h, sizeof h) == sizeof h){
+				work(&b, &item[h]);
+				if(Bflush(&b) < 0)
+					sysfatal("write records: %r");
+				x[0] = h;
+				write(r[1], x, sizeof x);
+			}
+			exits(nil);
+		}
+		close(wfd);
+	}
+	close(w[0]);
+	close(r[1]);
+	workfd = w[1];
+	resfd = r[0];
+	while(nsent < nitem && nsent < Window)
+		senditem();
+	if(nitem == 0)
+		close(workfd);
+
+	n = readkids(db, &top, &k);
+	dbloadroot(db, s, k, n);
+	freekids(k, n);
+	freestat(s);
+	Bterm(&top);
+	close(fd);
+	for(i=0; i<nw; i++){
+		waitpid();
+		Bterm(&itemb[i]);
+		close(Bfildes(&itemb[i]));
+	}
+	close(resfd);
+	if(closedb(db) < 0)
+		sysfatal("closedb: %r");
+}
+
 extern int __flagfmt(Fmt*);
 void
 threadmain(int argc, char **argv)
 {
 	int blocksize, norandom;
-	char *name, *sysname;
+	char *name, *root, *sysname;
 
 	initfmt();
 
 	blocksize = 8192;
 	norandom = 0;
+	nproc = sysncpu();
+	root = nil;
 	ARGBEGIN{
 	case 'D':
 		debug |= dbglevel(EARGF(usage()));
@@ -27,24 +554,31 @@ threadmain(int argc, char **argv)
 	case 'b':
 		blocksize = atoi(EARGF(usage()));
 		break;
+	case 'i':
+		loadignore(EARGF(usage()));
+		break;
+	case 'o':
+		addcfg(EARGF(usage()));
+		break;
+	case 'p':
+		nproc = atoi(EARGF(usage()));
+		break;
+	case 'r':
+		root = EARGF(usage());
+		break;
 	case 'R':
 		norandom = 1;
 		break;
 	}ARGEND
 
-	if(argc != 2)
+	if(argc != 2 || nproc < 1)
 		usage();
 
 	name = argv[0];
 	sysname = argv[1];
 
 	tramkdb(name, sysname, blocksize, !norandom);
+	if(root)
+		load(name, root);
 	exits(nil);
 }
-
-int
-config(char *s)
-{
-	USED(s);
-	return 0;
-}
@@ -224,27 +224,81 @@ syskidscmp(const void *va, const void *vb)
 }
 
 static int
-dbgetkidscmp(const void *va, const void *vb)
+kidviewcmp(const void *va, const void *vb)
 {
-	Kid *a, *b;
+	Kidview *a, *b;
 
-	a = (Kid*)va;
-	b = (Kid*)vb;
+	a = (Kidview*)va;
+	b = (Kidview*)vb;
 	return strcmp(a->name, b->name);
 }
 
+/*
+ * stats for plain files in one directory, to be
+ * written together by dbcursorputkids.
+ */
+typedef struct Kidq Kidq;
+struct Kidq
+{
+	Kid *k;
+	int n;
+};
+
+static void
+putstat(Dbcursor *c, Kidq *q, Apath *ap, Stat *s)
+{
+	Kid *k;
+
+	if(q == nil){
+		dbcursorput(c, s);
+		return;
+	}
+	k = q->n ? &q->k[q->n-1] : nil;
+	if(k == nil || strcmp(k->name, ap->e[ap->n-1]) != 0){
+		if(q->n%32 == 0)
+			q->k = erealloc(q->k, (q->n+32)*sizeof(q->k[0]));
+		k = &q->k[q->n++];
+		k->name = estrdup(ap->e[ap->n-1]);
+		k->stat = nil;
+		k->addr = 0;
+	}
+	freestat(k->stat);
+	k->stat = copystat(s);
+}
+
+/*
+ * whether the scan passes over p, as the
+ * ignore check in statupdate does with no stat.
+ */
+static int
+ignored(Path *p)
+{
+	int r;
+	Apath *ap;
+
+	ap = flattenpath(p);
+	r = ignorepath(ap);
+	free(ap);
+	return r;
+}
+
 /*
  * BUG?: assumes db ops cannot fail. 
+ *
+ * c points at p in the db; it is left there.  if q is not nil,
+ * p is a plain file with nothing under it in the db, c points at
+ * its parent instead, and the stat for p goes in q.
  */
 static int
-statupdate(Srv *srv, Path *p, Stat *os, Vtime *m, Sysstat *ss)
+statupdate(Srv *srv, Dbcursor *c, Path *p, Stat *os, Vtime *m, Sysstat *ss, Kidq *q)
 {
 	int changed, i, j, nk, nks, ostate;
 	char *tpath;
 	Apath *ap;
-	Kid *k;
+	Kidview *k;
+	Kidq kq;
 	Path *kp;
-	Stat *s;
+	Stat *s, *ks0;
 	Sysstat **ks;
 
 	s = os;
@@ -254,19 +308,16 @@ statupdate(Srv *srv, Path *p, Stat *os, Vtime *m, Sysstat *ss)
 			return 0;
 		if(!(s->state & SNonreplicated)){
 			s->state |= SNonreplicated;
-			dbputstat(srv->db, ap->e, ap->n, s);
+			putstat(c, q, ap, s);
 		}
 		free(ap);
 		return 0;
 	}
-	if(s == nil){
-		i = dbgetstat(srv->db, ap->e, ap->n, &s);
-		if(i != ap->n)
-			dbputstat(srv->db, ap->e, ap->n, s);	/* BUG: shouldn't be necessary */
-	}
+	if(s == nil)
+		s = dbcursorstat(c);
 	if(s->state & SNonreplicated){
 		s->state &= ~SNonreplicated;
-		dbputstat(srv->db, ap->e, ap->n, s);
+		putstat(c, q, ap, s);
 	}
 /*
 	if(leqvtime(srv->now, s->synctime)){
@@ -294,33 +345,65 @@ statupdate(Srv *srv, Path *p, Stat *os, Vtime *m, Sysstat *ss)
 		freevtime(s->mtime);
 		s->mtime = copynow(srv->now, s->sysmtime);
 //fprint(2, "%P: now %$\n", p, s);
-		dbputstat(srv->db, ap->e, ap->n, s);
+		putstat(c, q, ap, s);
 dbg(DbgCache, "dbputstat done in statupdate\n");
 	}
 /*
 	s->synctime = maxvtime(s->synctime, srv->now);
 */
 
+	k = nil;
+	nk = 0;
+	if(q == nil){
+		nk = dbcursorkidviews(c, &k);
+		qsort(k, nk, sizeof(k[0]), kidviewcmp);
+	}
 	nks = 0;
 	ks = nil;
-	if(s->state == SDir){
+	if(s->state == SDir && q == nil){
 //fprint(2, "syskids dir %s\n", tpath);
 		nks = syskids(tpath, &ks, ss);
 dbg(DbgCache, "x 1 in statupdate\n");
 		qsort(ks, nks, sizeof(ks[0]), syskidscmp);
 dbg(DbgCache, "x 2 in statupdate\n");
+		/*
+		 * plain files are collected in kq and written
+		 * at the end, without moving the cursor to them;
+		 * their old stats come from k.
+		 */
+		memset(&kq, 0, sizeof kq);
+		j = 0;
 		for(i=0; i<nks; i++){
 			if(i) assert(strcmp(ks[i-1]->name, ks[i]->name) < 0);
+			while(j<nk && strcmp(k[j].name, ks[i]->name) < 0)
+				j++;
 			kp = mkpath(p, ks[i]->name);
-			statupdate(srv, kp, nil, s->mtime, ks[i]);
+			if(ignored(kp)){
+				freepath(kp);
+				continue;
+			}
+			if(!sysisdir(ks[i]) && (j==nk || strcmp(k[j].name, ks[i]->name) != 0)){
+				ks0 = mkghoststat(s->synctime);
+				statupdate(srv, c, kp, ks0, s->mtime, ks[i], &kq);
+				freestat(ks0);
+			}else if(!sysisdir(ks[i]) && k[j].addr == 0){
+				ks0 = dbviewstat(&k[j].v);
+				statupdate(srv, c, kp, ks0, s->mtime, ks[i], &kq);
+				freestat(ks0);
+			}else{
+				dbcursordown(c, ks[i]->name);
+				statupdate(srv, c, kp, nil, s->mtime, ks[i], nil);
+				dbcursorup(c);
+			}
 			freepath(kp);
 		}
+		if(kq.n){
+			dbcursorputkids(c, kq.k, kq.n);
+			freekids(kq.k, kq.n);
+		}
 	}
 dbg(DbgCache, "x done in statupdate\n");
 
-	k = nil;
-	nk = dbgetkids(srv->db, ap->e, ap->n, &k);
-	qsort(k, nk, sizeof(k[0]), dbgetkidscmp);
 	j = 0;
 	for(i=0; i<nk; i++){
 		if(i) assert(strcmp(k[i-1].name, k[i].name) < 0);
@@ -329,11 +412,15 @@ dbg(DbgCache, "x done in statupdate\n");
 		if(j<nks && strcmp(ks[j]->name, k[i].name) == 0)
 			continue;
 		kp = mkpath(p, k[i].name);
-		statupdate(srv, kp, k[i].stat, s->mtime, nil);
+		dbcursordown(c, k[i].name);
+		ks0 = dbviewstat(&k[i].v);
+		statupdate(srv, c, kp, ks0, s->mtime, nil, nil);
+		freestat(ks0);
+		dbcursorup(c);
 		freepath(kp);
 	}
 	freesysstatlist(ks, nks);
-	freekids(k, nk);
+	freekidviews(k, nk);
 dbg(DbgCache, "y done in statupdate\n");
 
 	if(m)
@@ -351,16 +438,18 @@ Stat*
 srvstat(Srv *srv, Path *p)
 {
 	Apath *ap;
+	Dbcursor *c;
 	Stat *s;
 	Vtime *m;
 
 	ap = flattenpath(p);
-
-	dbgetstat(srv->db, ap->e, ap->n, &s);
+	c = dbcursor(srv->db, ap->e, ap->n);
+	s = dbcursorstat(c);
 
 	m = mkvtime();
-	if(statupdate(srv, p, s, m, nil))
+	if(statupdate(srv, c, p, s, m, nil, nil))
 		logflush(srv->db);
+	dbclosecursor(c);
 	free(ap);
 	freevtime(m);
 	return s;
@@ -809,7 +898,7 @@ int
 srvreadonly(Srv *srv, int ignwr)
 {
 	srv->readonly = 1;
-	if(ignwr && dbignorewrites(srv->db) < 0)
+	if(ignwr && dbignorewrites(srv->db) < 0)	/* maps the store too */
 		return -1;
 	return 0;
 }
@@ -817,8 +906,19 @@ srvreadonly(Srv *srv, int ignwr)
 int
 srvhangup(Srv *srv)
 {
+	DStats st;
+	LStats lst;
+
 	if(!srv->closed){
 		srv->closed = 1;
+		dstorestats(srv->db->s, &st);
+		dbg(DbgCache, "page cache: %lud hit %lud miss %lud evict %lud/%lud pages %lud mapped\n",
+			st.hit, st.miss, st.evict, st.npage, st.maxpage, st.mapped);
+		listcachestats(srv->db->listcache, &lst);
+		dbg(DbgCache, "list cache: %lud hit %lud miss %lud evict %lud tree %lud maps %llud/%llud bytes\n",
+			lst.hit, lst.miss, lst.evict, lst.tree, lst.nmap, lst.mem, lst.maxmem);
+		if(!srv->readonly && dbcompact(srv->db) < 0)
+			fprint(2, "compacting db: %r\n");
 		closedb(srv->db);
 	}
 	return 0;
@@ -830,10 +930,29 @@ srvmeta(Srv *srv, char *k)
 	return dbgetmeta(srv->db, k);
 }
 
+/*
+ * read the next request.  while the client is quiet,
+ * checkpoint the db when it comes due rather than
+ * leaving its dirty pages for the next write.  a
+ * readonly server still writes the db unless it
+ * was told to ignore writes.
+ */
+static Buf*
+srvnext(Srv *srv)
+{
+	long secs;
+
+	while(!srv->db->ignwr && !srv->closed
+	&& (secs = dbidle(srv->db)) >= 0)
+		if(replwait(srv->r, secs*1000) != 0)
+			break;
+	return replread(srv->r);
+}
+
 void
 usage(void)
 {
-	fprint(2, "usage: trasrv [-i inc/exc] [-o opt] ... -a | dbfile root\n");
+	fprint(2, "usage: trasrv [-i inc/exc] [-l listmb] [-m cachemb] [-o opt] [-t ckptsecs] ... -a | dbfile root\n");
 	exits("usage");
 }
 
@@ -879,9 +998,14 @@ main(int argc, char **argv)
 	Srv *srv;
 	Flate *inflate, *deflate;
 	int fd, automatic;
+	uvlong cachesize, listsize;
+	ulong ckptsecs;
 
 	initfmt();
 	automatic = 0;
+	cachesize = 0;
+	listsize = 0;
+	ckptsecs = 0;
 	ARGBEGIN{
 	default:
 		usage();
@@ -896,9 +1020,18 @@ main(int argc, char **argv)
 	case 'i':
 		loadignore(EARGF(usage()));
 		break;
+	case 'l':
+		listsize = (uvlong)atoi(EARGF(usage()))*1024*1024;
+		break;
+	case 'm':
+		cachesize = (uvlong)atoi(EARGF(usage()))*1024*1024;
+		break;
 	case 'o':
 		addcfg(EARGF(usage()));
 		break;
+	case 't':
+		ckptsecs = atoi(EARGF(usage()));
+		break;
 	}ARGEND
 
 	if(dbgname == nil)
@@ -932,6 +1065,12 @@ main(int argc, char **argv)
 	nonotes();
 
 	srv = opensrv(dbfile);
+	if(cachesize)
+		dstorecachesize(srv->db->s, cachesize);
+	if(listsize)
+		listcachesize(srv->db->listcache, listsize);
+	if(ckptsecs)
+		dstorecheckpoint(srv->db->s, 0, ckptsecs);
 	// fprint(2, "# %V\n", srv->now);
 	srv->root = root;
 	dbgname = srv->name;
@@ -944,7 +1083,7 @@ main(int argc, char **argv)
 //fprint(2, "%s: banner finished\n", argv0);
 	inflate = nil;
 	deflate = nil;
-	while((b = replread(srv->r)) != nil){
+	while((b = srvnext(srv)) != nil){
 		memset(&t, 0, sizeof t);
 		memset(&r, 0, sizeof r);
 		if(convM2R(b, &t) < 0){
@@ -1123,13 +1262,13 @@ if(0)
 extern int dcs, dcentrycmps, dclistlookups, dclistadd1s, dclistinserts;
 extern int dclookupavls, dcinsertavls, dcdeleteavls, lookupavls;
 extern int cmaplookups, cmapinserts, dbwalks, dbwalklooks;
-extern int strtoids, idtostrs;
+extern int strtoids, idtostrs, ghostwalks, ghostlooks;
 fprint(2, "dc tot %d entrycmp %d listlookup %d listadd1 %d listinsert %d\n",
 	dcs, dcentrycmps, dclistlookups, dclistadd1s, dclistinserts);
 fprint(2, "\tavl lookup %d lookupcmp %d insertcmp %d deletecmp %d\n",
 		lookupavls, dclookupavls, dcinsertavls, dcdeleteavls);
 fprint(2, "\tcmaplookup %d cmapinsert %d dbwalks %d dbwalklooks %d\n", cmaplookups, cmapinserts, dbwalks, dbwalklooks);
-fprint(2, "\tstrtoids %d idtostrs %d\n", strtoids, idtostrs);
+fprint(2, "\tstrtoids %d idtostrs %d ghostwalks %d ghostlooks %d\n", strtoids, idtostrs, ghostwalks, ghostlooks);
 }
 	exits(nil);
 }
@@ -134,6 +134,17 @@ tcanread(Fd *f)
 	return 0;
 }
 
+/*
+ * wait up to ms milliseconds for something to read.
+ */
+int
+twait(Fd *f, long ms)
+{
+	if(tcanread(f))
+		return 1;
+	return sysready(f->fd, ms);
+}
+
 int
 _tread(Fd *f, void *a, int n)
 {
@@ -3,6 +3,7 @@
 #include <dirent.h>
 #include <sys/time.h>
 #include <errno.h>
+#include <poll.h>
 #include <time.h>
 #include <pwd.h>
 #include <grp.h>
@@ -24,6 +25,26 @@ nonotes(void)
 	setsid();
 }
 
+/*
+ * wait up to ms milliseconds for fd to have input.
+ * returns 1 if it does, 0 on timeout, -1 on error.
+ */
+int
+sysready(int fd, long ms)
+{
+	int n;
+	struct pollfd p;
+
+	p.fd = fd;
+	p.events = POLLIN;
+	p.revents = 0;
+	while((n = poll(&p, 1, ms)) < 0 && errno == EINTR)
+		;
+	if(n < 0)
+		return -1;
+	return n > 0;
+}
+
 long
 writen(int fd, void *p, long n)
 {
@@ -185,6 +206,15 @@ syskids(char *tpath, Sysstat ***pk, Sysstat *ss)
 	return n;
 }
 
+/*
+ * is ss, from syskids, a directory?
+ */
+int
+sysisdir(Sysstat *ss)
+{
+	return (ss->st.st_mode&S_IFMT) == S_IFDIR;
+}
+
 void
 freesysstatlist(Sysstat **k, int nk)
 {
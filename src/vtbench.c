@@ -0,0 +1,103 @@
+#include "tra.h"
+
+/*
+ * microbenchmarks for the vector time operations in time.c.
+ *
+ *	vtbench [-n nop]
+ *
+ * times nop calls each of leqvtime, maxvtime, unmaxvtime,
+ * and copyvtime/freevtime on vectors of one entry (a file
+ * changed on one replica) and of three entries (a file
+ * synced among three replicas).
+ */
+
+void
+usage(void)
+{
+	fprint(2, "usage: vtbench [-n nop]\n");
+	exits("usage");
+}
+
+static char *names[] = { "alpha", "bravo", "charlie" };
+
+static Vtime*
+mkvt(int n, ulong t)
+{
+	int i;
+	Vtime *v, *x;
+
+	v = mkvtime1(names[0], t, t);
+	for(i=1; i<n; i++){
+		x = mkvtime1(names[i], t+i, t+i);
+		maxvtime(v, x);
+		freevtime(x);
+	}
+	return v;
+}
+
+static void
+bench(int n, int nop)
+{
+	int i, leq;
+	vlong t, tleq, tmax, tunmax, tcopy;
+	Vtime *a, *b, *c;
+
+	a = mkvt(n, 100);
+	b = mkvt(n, 200);
+
+	leq = 0;
+	t = nsec();
+	for(i=0; i<nop; i++)
+		leq += leqvtime(a, b);
+	tleq = nsec()-t;
+	if(leq != nop)
+		sysfatal("leqvtime");
+
+	c = copyvtime(a);
+	t = nsec();
+	for(i=0; i<nop; i++)
+		maxvtime(c, b);
+	tmax = nsec()-t;
+
+	t = nsec();
+	for(i=0; i<nop; i++){
+		c->l[0].t = 300;	/* stays ahead of b */
+		unmaxvtime(c, b);
+		maxvtime(c, b);
+	}
+	tunmax = nsec()-t;
+	freevtime(c);
+
+	t = nsec();
+	for(i=0; i<nop; i++)
+		freevtime(copyvtime(b));
+	tcopy = nsec()-t;
+
+	print("%d entr%s\tleq %4.1fns max %4.1fns unmax+max %4.1fns copy+free %4.1fns\n",
+		n, n == 1 ? "y" : "ies",
+		(double)tleq/nop, (double)tmax/nop, (double)tunmax/nop, (double)tcopy/nop);
+	freevtime(a);
+	freevtime(b);
+}
+
+void
+main(int argc, char **argv)
+{
+	int nop;
+
+	nop = 10000000;
+	ARGBEGIN{
+	case 'n':
+		nop = atoi(EARGF(usage()));
+		break;
+	default:
+		usage();
+	}ARGEND
+
+	if(argc != 0 || nop <= 0)
+		usage();
+	initfmt();
+	bench(1, nop);
+	bench(3, nop);
+	exits(nil);
+}